@@ -17,6 +17,19 @@
 #include <map>
 #include <vector>
 #include <algorithm>
+#include <memory>
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <rom/miniz.h>  // ROM inflater used for EPUB metadata
+#define HAS_ROM_INFLATE 1
+#include <mbedtls/sha256.h>  // Backed by the SHA accelerator on ESP32 targets
+#include <esp_freertos_hooks.h>  // Idle hooks for the /bench CPU estimate
+#include <lwip/sockets.h>        // Non-blocking sends for the download scheduler
+#include <esp_rom_crc.h>          // ROM CRC-32 for gzip/zip trailers
+#include <unistd.h>               // truncate() through the FAT VFS
+#else
+#include <bearssl/bearssl_hash.h>  // Software SHA-256
+#endif
 
 // Global Variables
 
@@ -42,12 +55,146 @@ DNSServer dnsServer;
 // SD card CS pin
 #if defined(ARDUINO_ARCH_ESP32)
 const int SD_CS_PIN = 10;
+// Every download slot (up to 16), the handle cache (4), upload writers plus a multipart upload (9)
+// and the background jobs (scan cursors a few directories deep, gzip in/out, read-back, tables)
+// can hold a file at once. Each costs the VFS about 550 bytes of internal RAM.
+const uint8_t SD_MAX_OPEN_FILES = 40;
+const uint32_t SD_SPI_CLOCK_DEFAULT = 4000000;
+const char* SD_MOUNT_POINT = "/sd";    // VFS prefix for the POSIX calls the SD class doesn't wrap
+uint32_t sdSpiClockHz = SD_SPI_CLOCK_DEFAULT;  // /bench can remount at other clocks
 #else
 const int SD_CS_PIN = D8;
 #endif
 
+// SHA-256 state for content fingerprints; uploads hash as they stream
+struct ContentHasher {
+#if defined(ARDUINO_ARCH_ESP32)
+  mbedtls_sha256_context ctx;
+#else
+  br_sha256_context ctx;
+#endif
+};
+
 // File Uploads
-File uploadFile;
+
+// Upload write-behind: HTTP chunks (~1.4 KB) are gathered into cluster-sized blocks so the card
+// sees large writes on cluster boundaries instead of partial-sector read-modify-write cycles
+const size_t UPLOAD_BUFFER_INTERNAL = 16384;
+const size_t UPLOAD_BUFFER_PSRAM = 32768;
+size_t uploadBufferSize = UPLOAD_BUFFER_INTERNAL;  // Chosen in setup(); 0 writes every chunk directly
+
+struct UploadWriter {
+  uint8_t* data = nullptr;
+  size_t capacity = 0;
+  size_t used = 0;
+  size_t written = 0;       // Bytes that reached the card
+  bool failed = false;
+  uint32_t writes = 0;
+  uint32_t writeMicros = 0;
+  unsigned long startedAt = 0;
+  size_t preallocated = 0;  // File length reserved up front; trimmed to the real length at the end
+  size_t startOffset = 0;   // File offset of the first byte; blocks still end on cluster multiples
+  uint32_t crc = 0;         // CRC-32 of everything appended, continued from the caller's seed
+  uint32_t crcMicros = 0;
+};
+
+// Content sniffing: the first bytes of every upload are held in RAM and checked against the
+// file-type registry before anything is written, so a renamed video never reaches the card
+const size_t UPLOAD_SNIFF_BYTES = 1024;
+unsigned long uploadsSniffRejected = 0;
+
+struct FileType;
+
+// Per-request upload state. Every multipart post and session chunk gets a fresh context when
+// its body starts, so one uploader never inherits another's file, paths or hash. The web server
+// reads one request body at a time, so the context of the body in flight is all there is.
+struct UploadContext {
+  File file;
+  UploadWriter writer;
+  String publicPath;    // Multipart: library path of the current file part
+  String sdPath;        // Multipart: physical destination
+  String tempPath;      // Where the body streams to until commit
+  String sessionId;     // Chunk: owning session
+  size_t offset = 0;    // Chunk: part length the body starts at
+  size_t received = 0;  // Body bytes seen for the current file
+  ContentHasher hasher;
+  int status = 0;       // Reply decided while the body streamed; 0 before it started
+  const FileType* sniffType = nullptr;  // Set while the first bytes are still held back
+  uint8_t sniff[UPLOAD_SNIFF_BYTES];
+  size_t sniffed = 0;
+};
+
+std::unique_ptr<UploadContext> uploadRequest;
+unsigned long uploadsCompleted = 0;
+uint64_t uploadBytesTotal = 0;
+float uploadLastMBps = 0;
+
+// Integrity: the upload page sends the file's CRC-32 and the writer computes its own as the
+// bytes stream past. A mismatch lands in quarantine instead of the library. Published uploads
+// are also read back off the card by an idle-time pass that catches write-path corruption.
+const char* UPLOAD_QUARANTINE_DIR = "/quarantine";
+const unsigned long UPLOAD_VERIFY_BUDGET_US = 4000;
+const size_t UPLOAD_VERIFY_BLOCK = 4096;
+bool uploadReadBack = true;  // /scheduler?verify=0 skips the read-back pass
+
+struct UploadVerify {
+  String path;   // Public library path
+  size_t size;
+  uint32_t crc;  // What the stream check saw
+};
+
+struct UploadVerifyJob {
+  std::vector<UploadVerify> queue;
+  File file;
+  String sdPath;
+  uint8_t* block = nullptr;
+  size_t done = 0;
+  uint32_t crc = 0;
+};
+
+UploadVerifyJob uploadVerifyJob;
+uint64_t uploadCrcBytes = 0;
+uint64_t uploadCrcMicros = 0;
+uint64_t uploadVerifyBytes = 0;
+uint64_t uploadVerifyMicros = 0;
+unsigned long uploadVerifyPassed = 0;
+unsigned long uploadVerifyFailed = 0;
+unsigned long uploadsQuarantined = 0;
+
+// Resumable uploads: a session's bytes land in <dir>/<id>.part and <id>.meta holds
+// "name\tsize\tdigest\tcrcBytes\tcrc", rewritten after every chunk. crcBytes is the resume
+// offset, so sessions survive dropped connections and reboots. On ESP32 the .part is
+// preallocated to full length when the session opens and chunks are written in place.
+const char* UPLOAD_SESSION_DIR = "/upload-sessions";
+const size_t UPLOAD_CHUNK_BYTES = 262144;               // Chunk size the upload page sends per PATCH
+const size_t UPLOAD_SESSION_MAX = 8;                    // Least recently used session gives way past this
+const unsigned long UPLOAD_SESSION_IDLE_MS = 86400000;  // Untouched sessions expire after a day
+
+struct UploadSession {
+  String name;
+  size_t size = 0;
+  unsigned long touchedAt = 0;
+  uint32_t ticket = 0;    // Queue order; lower tickets are admitted first
+  bool writing = false;   // Holds one of the writer slots
+  bool hasDigest = false;
+  uint32_t digest = 0;    // CRC-32 the client computed over the whole file
+  uint32_t crc = 0;       // Running CRC-32 of the part's first crcBytes
+  size_t crcBytes = 0;
+  bool preallocated = false;  // Part is full length on the card; its clusters are already counted
+};
+
+std::map<String, UploadSession> uploadSessions;  // Keyed by session id
+
+// Admission: only a few sessions write at once so each file gets long sequential runs on the
+// card instead of every uploader's chunks interleaving cluster by cluster. The rest queue.
+const uint8_t UPLOAD_WRITERS_DEFAULT = 2;
+const unsigned long UPLOAD_SLOT_IDLE_MS = 60000;  // A writer silent this long goes back in line
+uint8_t uploadWriterSlots = UPLOAD_WRITERS_DEFAULT;
+uint32_t uploadSessionTickets = 0;
+
+unsigned long uploadChunksAccepted = 0;
+unsigned long uploadChunksRejected = 0;
+unsigned long uploadSessionsRefused = 0;  // Creates answered 429 because every session was busy
 
 bool sdCardReady = false;
 
@@ -55,6 +202,17 @@ bool sdCardReady = false;
 unsigned long lastCleanupTime = 0;
 const unsigned long CLEANUP_INTERVAL = 3600000; // 1 hour in milliseconds
 
+// Forum storage: append-only record logs, "/forum/threads.log" for the thread list and
+// "/forum/posts/<id>.log" per thread. A record is a magic, the payload length, the payload's
+// CRC-32 and the payload (fields joined by 0x1F), so a post costs one small append. A torn or
+// damaged record fails its length or CRC check and readers step past it to the next magic.
+const char* FORUM_THREADS_LOG = "/forum/threads.log";
+const uint16_t FORUM_RECORD_MAGIC = 0xF07A;
+const size_t FORUM_RECORD_HEADER = 8;
+const size_t FORUM_RECORD_MAX = 8192;   // Longest payload written or believed
+const char FORUM_FIELD_SEPARATOR = '\x1F';
+unsigned long forumRecordsSkipped = 0;  // Bytes stepped over while resyncing past bad records
+
 // Forum structures
 struct ForumPost {
   String id;
@@ -90,8 +248,9 @@ bool ensureSdFile(const char* path, const char* description, const char* default
 void finalizeChunkedResponse();
 
 struct LibraryFileEntry {
-  String path;
+  String path;    // Public library path (what catalogs and URLs use)
   size_t size;
+  String sdPath;  // Where the file actually lives on the card
 };
 
 void collectLibraryFiles(const String& dirPath, std::vector<LibraryFileEntry>& files);
@@ -99,23 +258,825 @@ String humanReadableSize(size_t bytes);
 String urlEncodePath(const String& path);
 String formatTimestamp(unsigned long timestamp);
 
+// Library catalog (metadata extracted from the books themselves)
+const char* CATALOG_METADATA_PATH = "/catalog/metadata.tsv";
+const size_t CATALOG_COMPACT_MIN_ROWS = 64;  // Below this a superseded row isn't worth a rewrite
+
+struct BookMetadata {
+  size_t size;
+  String title;
+  String author;
+  String language;
+};
+
+std::map<String, BookMetadata> libraryCatalog;  // Keyed by public library path
+
+// Resumable walk over the library tree; each step touches at most one directory entry
+struct LibraryScanCursor {
+  std::vector<File> dirs;
+  std::vector<String> paths;
+  bool allFiles = false;  // Report every file, not just allowed book types
+  uint8_t maxDepth = 255; // Directory levels below the root to descend into
+};
+
+enum LibraryScanResult { LIBRARY_SCAN_FILE, LIBRARY_SCAN_PENDING, LIBRARY_SCAN_DONE };
+
+bool libraryScanBegin(LibraryScanCursor& cursor, const String& rootPath);
+LibraryScanResult libraryScanStep(LibraryScanCursor& cursor, LibraryFileEntry& entry);
+void libraryScanEnd(LibraryScanCursor& cursor);
+
+// Background metadata extraction settings
+const unsigned long METADATA_LOOP_BUDGET_US = 3000;     // Max extractor time per loop pass
+const unsigned long METADATA_RESCAN_INTERVAL = 600000;  // Full catalog pass every 10 minutes
+const size_t METADATA_READ_CHUNK = 1024;                // Bounded SD read size per step
+const size_t METADATA_XML_LIMIT = 8192;                 // Max XML bytes inspected per EPUB entry
+const size_t METADATA_FIELD_LIMIT = 160;                // Max stored length per metadata field
+const uint8_t PDF_MAX_XREF_SECTIONS = 16;
+
+enum MetadataPhase {
+  META_IDLE,
+  META_SCAN,
+  META_EPUB_EOCD,
+  META_EPUB_CENTRAL_DIR,
+  META_EPUB_LOCAL_HEADER,
+  META_EPUB_READ_ENTRY,
+  META_PDF_TAIL,
+  META_PDF_XREF,
+  META_PDF_XREF_ENTRY,
+  META_PDF_OBJECT,
+  META_STORE
+};
+
+struct MetadataJob {
+  MetadataPhase phase = META_IDLE;
+  LibraryScanCursor cursor;
+  File file;
+  String path;
+  size_t fileSize = 0;
+  BookMetadata result;
+
+  // EPUB (ZIP) state
+  uint32_t cdOffset = 0;
+  uint32_t cdEnd = 0;
+  uint32_t cdPos = 0;
+  String entryName;
+  bool readingOpf = false;
+  uint16_t entryMethod = 0;
+  uint32_t entryOffset = 0;
+  uint32_t entryCompSize = 0;
+  uint32_t entryPos = 0;
+  uint8_t* xmlBuf = nullptr;
+  size_t xmlLen = 0;
+#if HAS_ROM_INFLATE
+  tinfl_decompressor* inflator = nullptr;
+#endif
+
+  // PDF state
+  uint32_t xrefOffset = 0;
+  uint32_t xrefPos = 0;
+  uint8_t xrefSections = 0;
+  long infoObj = -1;
+  long rootObj = -1;
+  long targetObj = -1;
+  bool readingRoot = false;
+  uint32_t objectOffset = 0;
+
+  // Pass statistics
+  bool rescanRequested = true;
+  unsigned long lastPassEnd = 0;
+  unsigned long passStart = 0;
+  uint32_t booksSeen = 0;
+  uint32_t booksExtracted = 0;
+  uint64_t bytesRead = 0;
+  uint64_t busyMicros = 0;
+};
+
+MetadataJob metadataJob;
+
+// Gzip sidecars: "book.txt.gz" next to compressible books, written by an idle-time job
+const char* CATALOG_GZIP_PATH = "/catalog/gzip.tsv";
+const unsigned long GZIP_LOOP_BUDGET_US = 3000;     // Max compressor time per loop pass
+const unsigned long GZIP_RESCAN_INTERVAL = 900000;  // Look for new books every 15 minutes
+const size_t GZIP_MIN_SOURCE = 2048;                // Smaller books aren't worth a sidecar
+const uint8_t GZIP_MAX_RATIO_PERCENT = 90;          // Keep the sidecar only below this size ratio
+const size_t GZIP_WINDOW = 4096;                    // LZ77 window (buffer holds two)
+const uint8_t GZIP_HASH_BITS = 12;
+const uint8_t GZIP_MAX_CHAIN = 24;                  // Match candidates tried per position
+const size_t GZIP_MIN_LOOKAHEAD = 262;              // Max match + min match + 1
+const size_t GZIP_READ_CHUNK = 1024;
+const uint8_t GZIP_DAYS_KEPT = 7;
+
+struct GzipSidecar {
+  size_t sourceSize;
+  size_t gzipSize;  // 0 when compression wasn't worth keeping
+};
+
+struct GzipJob {
+  bool active = false;
+  bool rescanRequested = true;
+  unsigned long lastPassEnd = 0;
+  LibraryScanCursor cursor;
+
+  // Current book
+  File in;
+  File out;
+  String path;        // Public path of the book
+  String sidecarPath; // Physical path of the finished sidecar
+  size_t sourceSize = 0;
+  bool inputDone = false;
+
+  // Deflate state: fixed-Huffman single block over a sliding window
+  uint8_t* window = nullptr;
+  uint16_t* head = nullptr;
+  uint16_t* prev = nullptr;
+  size_t windowLen = 0;
+  size_t strStart = 0;
+  uint32_t bitBuffer = 0;
+  uint8_t bitCount = 0;
+  uint8_t outBuf[512];
+  size_t outLen = 0;
+  size_t outTotal = 0;
+  uint32_t crc = 0;
+  uint32_t inputBytes = 0;
+  bool writeError = false;
+};
+
+std::map<String, GzipSidecar> gzipSidecars;  // Keyed by public library path
+GzipJob gzipJob;
+uint64_t gzipSavedBytesPerDay[GZIP_DAYS_KEPT] = {0};  // [0] is today (uptime days)
+unsigned long gzipCurrentDay = 0;
+uint64_t gzipSavedBytesTotal = 0;
+unsigned long gzipServed = 0;
+
+uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t length);
+void loadGzipCatalog();
+void processGzipJob();
+void dropGzipSidecar(const String& publicPath);
+void abortGzipBook(GzipJob& job);
+void noteGzipSaved(size_t bytes);
+
+// File types the library accepts. Lookups hash the lower-cased extension into a slot table
+// whose seed is searched at compile time, so every entry lands in its own slot (a perfect hash).
+enum ReaderFormat { READER_NONE, READER_TEXT, READER_FB2, READER_EPUB };
+
+// What the first bytes of an upload must look like. ANY: one of the signatures is present;
+// ALL: every one is; TEXT: no NUL bytes outside a UTF-16 file; NONE: anything goes.
+enum FileSniffRule { SNIFF_NONE, SNIFF_ANY, SNIFF_ALL, SNIFF_TEXT };
+
+struct FileSignature {
+  const char* bytes;  // nullptr for an unused slot
+  uint16_t offset;
+  uint16_t slack;     // Further start positions tried past offset; 0 = exact
+};
+
+const uint8_t FILE_SIGNATURE_MAX = 2;
+
+struct FileType {
+  const char* ext;      // Lower case, no dot
+  const char* mime;
+  bool compressible;    // Worth a gzip sidecar
+  ReaderFormat reader;  // How /read shows it; TEXT and FB2 get a server-side page index
+  FileSniffRule sniff;
+  FileSignature signatures[FILE_SIGNATURE_MAX];  // Within the first UPLOAD_SNIFF_BYTES
+};
+
+// Palm databases (azw, mobi, prc, pdb) keep their type and creator at offset 60. PDF readers
+// accept the header anywhere in the first kilobyte. EPUB requires an uncompressed "mimetype"
+// as the first ZIP entry, so its name and contents sit right after the 30-byte local header.
+constexpr FileType FILE_TYPES[] = {
+  {"pdf", "application/pdf", false, READER_NONE, SNIFF_ANY, {{"%PDF-", 0, 1019}}},
+  {"epub", "application/epub+zip", false, READER_EPUB, SNIFF_ALL,
+   {{"PK\x03\x04", 0, 0}, {"mimetypeapplication/epub+zip", 30, 0}}},
+  {"doc", "application/msword", true, READER_NONE, SNIFF_ANY, {{"\xD0\xCF\x11\xE0\xA1\xB1\x1A\xE1", 0, 0}}},
+  {"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document", false, READER_NONE,
+   SNIFF_ANY, {{"PK\x03\x04", 0, 0}}},
+  {"rtf", "application/rtf", true, READER_NONE, SNIFF_ANY, {{"{\\rtf", 0, 0}}},
+  {"txt", "text/plain", true, READER_TEXT, SNIFF_TEXT, {}},
+  {"azw", "application/vnd.amazon.ebook", false, READER_NONE, SNIFF_ANY, {{"BOOKMOBI", 60, 0}, {"TPZ", 0, 0}}},
+  {"mobi", "application/x-mobipocket-ebook", false, READER_NONE, SNIFF_ANY, {{"BOOKMOBI", 60, 0}}},
+  {"lib", "application/octet-stream", false, READER_NONE, SNIFF_NONE, {}},
+  {"fb2", "application/x-fictionbook+xml", true, READER_FB2, SNIFF_ANY, {{"<?xml", 0, 16}, {"<FictionBook", 0, 16}}},
+  {"prc", "application/x-mobipocket-ebook", false, READER_NONE, SNIFF_ANY, {{"BOOKMOBI", 60, 0}, {"TEXtREAd", 60, 0}}},
+  {"pdb", "application/vnd.palm", false, READER_NONE, SNIFF_NONE, {}},
+  {"ibook", "application/x-ibooks+zip", false, READER_NONE, SNIFF_ANY, {{"PK\x03\x04", 0, 0}}},
+};
+constexpr size_t FILE_TYPE_COUNT = sizeof(FILE_TYPES) / sizeof(FILE_TYPES[0]);
+constexpr size_t FILE_TYPE_SLOTS = 32;
+constexpr size_t FILE_TYPE_MAX_EXT = 5;
+
+struct FileTypeHash {
+  static constexpr uint32_t hash(const char* ext, uint32_t seed) {
+    uint32_t value = seed;
+    for (; *ext; ++ext) {
+      value = (value ^ static_cast<uint8_t>(*ext)) * 16777619UL;
+    }
+    return (value ^ (value >> 15)) % FILE_TYPE_SLOTS;  // Fold high bits in; the low ones barely mix
+  }
+  static constexpr bool perfect(uint32_t seed) {
+    bool used[FILE_TYPE_SLOTS] = {};
+    for (size_t i = 0; i < FILE_TYPE_COUNT; ++i) {
+      uint32_t slot = hash(FILE_TYPES[i].ext, seed);
+      if (used[slot]) {
+        return false;
+      }
+      used[slot] = true;
+    }
+    return true;
+  }
+  static constexpr uint32_t findSeed() {
+    uint32_t seed = 2166136261UL;
+    while (!perfect(seed)) {
+      seed++;
+    }
+    return seed;
+  }
+};
+
+constexpr uint32_t FILE_TYPE_SEED = FileTypeHash::findSeed();
+
+struct FileTypeSlots {
+  int8_t index[FILE_TYPE_SLOTS];
+  constexpr FileTypeSlots() : index() {
+    for (size_t i = 0; i < FILE_TYPE_SLOTS; ++i) {
+      index[i] = -1;
+    }
+    for (size_t i = 0; i < FILE_TYPE_COUNT; ++i) {
+      index[FileTypeHash::hash(FILE_TYPES[i].ext, FILE_TYPE_SEED)] = i;
+    }
+  }
+};
+
+constexpr FileTypeSlots FILE_TYPE_SLOT_TABLE;
+static_assert(FileTypeHash::perfect(FILE_TYPE_SEED), "file type hash must be collision-free");
+
+const FileType* fileTypeFor(const char* name, size_t length);
+const FileType* fileTypeFor(const String& name);
+
+// Paged reader: "book.txt.pgx" next to text books holds page start offsets, extended as pages are read.
+// Layout: magic, source size, format, encoding[20], then one uint32 offset per page boundary;
+// 0xFFFFFFFF after the last boundary marks the index complete.
+const char* PAGE_INDEX_SUFFIX = ".pgx";
+const uint32_t PAGE_INDEX_MAGIC = 0x31584750;  // "PGX1"
+const size_t PAGE_INDEX_HEADER = 32;
+const uint32_t PAGE_INDEX_END = 0xFFFFFFFFUL;
+const size_t READER_PAGE_BYTES = 2048;         // One screen on a small phone
+const uint16_t READER_EXTEND_PAGES = 64;       // Most pages indexed by a single request
+const size_t READER_BODY_SEARCH = 65536;       // How far into an FB2 to look for <body>
+
+struct PageIndexInfo {
+  uint32_t format;
+  char encoding[20];
+  uint32_t boundaries;  // Offsets stored so far
+  uint32_t lastOffset;
+  bool complete;
+};
+
+ReaderFormat readerFormat(const String& path);
+void dropPageIndex(const String& publicPath);
+
+// Small LRU caches in front of the FAT path walk: idle read handles and stat results
+const uint8_t FILE_CACHE_HANDLES = 4;
+const uint8_t FILE_CACHE_ENTRIES = 32;
+
+struct CachedHandle {
+  String path;
+  File file;
+  uint32_t lastUsed;
+};
+
+struct CachedEntry {
+  String path;
+  bool exists;
+  size_t size;
+  uint32_t lastUsed;
+};
+
+std::vector<CachedHandle> fileCacheHandles;  // Idle handles; checked-out ones are not in here
+std::vector<CachedEntry> fileCacheEntries;
+uint32_t fileCacheClock = 0;
+uint32_t fileCacheEpoch = 0;                 // Bumped by every invalidation
+unsigned long fileCacheHandleHits = 0;
+unsigned long fileCacheHandleMisses = 0;
+unsigned long fileCacheEntryHits = 0;
+unsigned long fileCacheEntryMisses = 0;
+uint32_t fileCacheOpenMicros = 0;            // Running average cost of a real open
+uint32_t fileCacheStatMicros = 0;            // Running average cost of a real stat
+uint64_t fileCacheSavedMicros = 0;
+
+File fileCacheOpen(const String& path, uint32_t& epoch);
+void fileCacheRelease(const String& path, File file, uint32_t epoch);
+bool fileCacheStat(const String& path, size_t& size);
+void fileCacheInvalidate(const String& path);
+
+// Download pipeline: a reader task fills a ring of buffers from SD while the sender drains them
+const size_t DOWNLOAD_BUFFER_INTERNAL = 8192;   // Per-buffer size without PSRAM
+const uint8_t DOWNLOAD_DEPTH_INTERNAL = 2;
+const size_t DOWNLOAD_BUFFER_PSRAM = 32768;     // One FAT cluster on typical SDHC cards
+const uint8_t DOWNLOAD_DEPTH_PSRAM = 4;
+const uint32_t DOWNLOAD_STALL_TIMEOUT_MS = 10000;  // Give up when nothing moves for this long
+const uint8_t DOWNLOAD_READER_CORE = 0;         // Keep SD reads off the loop() core
+
+size_t downloadBufferSize = DOWNLOAD_BUFFER_INTERNAL;  // Chosen in setup() once PSRAM is known
+uint8_t downloadPipelineDepth = DOWNLOAD_DEPTH_INTERNAL;
+
+struct DownloadPipeline {
+  File file;
+  String name;
+  String cachePath;           // Set when the handle came from the file cache
+  uint32_t cacheEpoch = 0;
+  size_t remaining = 0;       // Bytes the reader still has to fetch
+  size_t bufferSize = 0;
+  uint8_t depth = 0;
+  std::vector<uint8_t*> buffers;
+  std::vector<size_t> lengths;
+  int current = -1;           // Buffer being sent, -1 when none is held
+  size_t currentOffset = 0;
+  size_t sent = 0;
+  bool eof = false;
+  bool failed = false;
+  unsigned long startedAt = 0;
+  unsigned long lastProgressAt = 0;
+  uint32_t senderWaitUs = 0;  // Time the socket side sat waiting for SD
+  bool trackCrc = false;      // Keep a CRC-32 of the bytes sent (ZIP bundles)
+  uint32_t crc = 0;
+  bool quiet = false;         // Part of a larger transfer that does its own accounting
+  uint8_t* fill = nullptr;    // Hot-cache copy being filled as the bytes go out
+  size_t fillSize = 0;
+#if defined(ARDUINO_ARCH_ESP32)
+  QueueHandle_t filled = nullptr;   // Buffer indices ready to send
+  QueueHandle_t empty = nullptr;    // Buffer indices ready to refill
+  SemaphoreHandle_t readerDone = nullptr;
+  volatile bool stopping = false;
+  volatile uint32_t readerWaitUs = 0;  // Time the reader sat waiting for the socket
+  volatile uint32_t readUs = 0;
+#endif
+};
+
+// Hot-object cache: whole popular books held in PSRAM and served without touching SD.
+// Admission is frequency-aware (TinyLFU-style): a newcomer only displaces LRU victims it
+// has been requested more often than, so one-off downloads can't flush the popular set.
+const size_t HOT_CACHE_CAPACITY_PSRAM = 2UL * 1024 * 1024;  // Default cap with PSRAM; 0 disables
+const size_t HOT_CACHE_MAX_OBJECT = 512UL * 1024;
+const uint16_t HOT_SKETCH_WIDTH = 256;       // Counters per row of the frequency sketch
+const uint8_t HOT_SKETCH_ROWS = 4;
+const uint16_t HOT_SKETCH_AGE_EVERY = 2048;  // Halve all counters after this many requests
+
+struct HotObject {
+  uint8_t* data;
+  size_t size;
+  ~HotObject() { free(data); }
+};
+
+struct HotCacheEntry {
+  String path;                         // Physical SD path
+  std::shared_ptr<HotObject> object;   // Streams hold their own reference across eviction
+  uint32_t lastUsed;
+};
+
+std::vector<HotCacheEntry> hotCacheEntries;
+size_t hotCacheCapacity = 0;           // Set in setup() once PSRAM is known
+size_t hotCacheBytes = 0;
+size_t hotCacheFilling = 0;            // Reserved by fills still streaming; never past the capacity
+uint32_t hotCacheClock = 0;
+uint8_t hotSketch[HOT_SKETCH_ROWS][HOT_SKETCH_WIDTH];
+uint16_t hotSketchSamples = 0;
+unsigned long hotCacheHits = 0;
+unsigned long hotCacheMisses = 0;
+unsigned long hotCacheRejected = 0;    // Fills refused by admission
+uint64_t hotCacheSavedBytes = 0;       // Served from PSRAM instead of SD
+
+// Per-book download counters: kept in RAM, written to SD in one batch on a timer. Shutdown
+// handlers run with the scheduler half down, so code that restarts the board calls
+// flushDownloadStats() first.
+const char* CATALOG_STATS_PATH = "/catalog/stats.tsv";
+const unsigned long STATS_FLUSH_INTERVAL_MS = 600000;  // At most one stats write every 10 minutes
+const uint16_t STATS_TOP_DEFAULT = 20;
+const uint8_t STATS_SEED_MAX = 8;                      // Sketch hits granted per book at boot
+
+struct DownloadStat {
+  uint32_t starts;
+  uint32_t completes;
+  uint64_t bytes;
+};
+
+std::map<String, DownloadStat> downloadStats;  // Keyed by public library path
+bool downloadStatsDirty = false;
+unsigned long downloadStatsFlushedAt = 0;
+unsigned long downloadStatsFlushes = 0;
+uint64_t downloadStatsCycles = 0;              // CPU cycles spent updating counters
+unsigned long downloadStatsUpdates = 0;
+
+void loadDownloadStats();
+void noteDownloadStart(const String& publicPath);
+void noteDownloadFinish(const String& publicPath, size_t bytes, bool complete);
+void processDownloadStats();
+void dropDownloadStats(const String& path);
+
+std::shared_ptr<HotObject> hotCacheLookup(const String& path);
+bool hotCacheReserveFill(const String& path, size_t size);
+void hotCacheReleaseFill(size_t size);
+void hotCacheInsert(const String& path, uint8_t* data, size_t size);
+void hotCacheInvalidate(const String& path);
+
+// Download benchmark (/bench): synthetic files streamed under a matrix of settings
+const char* BENCH_DOWNLOAD_DIR = "/bench-dl";
+const size_t BENCH_MAX_FILE_SIZE = 64UL * 1024 * 1024;
+
+struct BenchRun {
+  uint32_t id = 0;
+  unsigned long transfers = 0;
+  uint64_t bytes = 0;
+  unsigned long serverMs = 0;
+  uint32_t idleCount[2] = {0, 0};
+  unsigned long idleWindowMs = 0;
+  size_t heapUsedInternal = 0;
+  size_t heapUsedPsram = 0;
+};
+
+BenchRun benchRun;
+
+// /bench/prepare only starts the file; loop() writes it a few ms per pass
+const unsigned long BENCH_PREPARE_BUDGET_US = 4000;
+const unsigned long BENCH_IDLE_HOOK_TIMEOUT_MS = 120000;  // Hooks of a run that went quiet come off
+
+struct BenchPrepareJob {
+  bool active = false;
+  bool failed = false;  // Short write; reported to the next /bench/prepare for the same size
+  String path;
+  size_t size = 0;
+  size_t written = 0;
+  File file;
+};
+
+BenchPrepareJob benchPrepare;
+unsigned long benchTouchedAt = 0;  // Last /bench request
+
+// Upload benchmark (/bench/upload): the page plays slow, jittery and lossy clients against the
+// session endpoints while timing a page load; the sketch tracks loop stalls and heap low marks
+const unsigned long UPLOAD_BENCH_BLOCKED_US = 20000;  // Loop gaps past this count as blocked time
+
+struct UploadBenchRun {
+  uint32_t id = 0;
+  bool active = false;
+  unsigned long startedAt = 0;
+  unsigned long lastPassAt = 0;   // micros() at the previous loop pass
+  uint32_t passes = 0;
+  uint32_t maxGapUs = 0;
+  uint64_t blockedUs = 0;
+  uint64_t bytesAtStart = 0;
+  unsigned long acceptedAtStart = 0;
+  unsigned long rejectedAtStart = 0;
+  size_t heapAtStart = 0;
+  size_t psramAtStart = 0;
+  size_t heapLow = 0;
+  size_t psramLow = 0;
+};
+
+UploadBenchRun uploadBench;
+volatile uint32_t benchIdleCount[2] = {0, 0};
+float benchIdleRate[2] = {0, 0};  // Idle-hook calls per ms on an unloaded core
+bool benchIdleHooksInstalled = false;
+
+unsigned long downloadsCompleted = 0;
+unsigned long downloadsFailed = 0;
+uint64_t downloadBytesTotal = 0;
+
+// Download scheduler: deficit round robin over the active transfers, pumped from loop()
+const size_t DOWNLOAD_QUANTUM = 4096;               // Bytes per weight unit per round
+const uint8_t DOWNLOAD_SLOTS_INTERNAL = 3;          // Concurrent downloads without PSRAM
+const uint8_t DOWNLOAD_SLOTS_PSRAM = 6;
+const uint8_t DOWNLOAD_SLOTS_MAX = 16;              // /scheduler ceiling; SD_MAX_OPEN_FILES counts on it
+const uint16_t DOWNLOAD_DEFAULT_WEIGHT = 1;
+const uint32_t DOWNLOAD_RATE_CAP_DEFAULT = 1536UL * 1024;  // Bytes/s left to bulk; the rest stays for pages
+const uint32_t DOWNLOAD_RATE_CAP_MIN = 64UL * 1024;        // Bucket (cap / 10) still holds a few quanta
+const uint32_t DOWNLOAD_RATE_CAP_MAX = 64UL * 1024 * 1024;
+const unsigned long DOWNLOAD_PUMP_BUDGET_US = 8000;  // Max scheduler time per loop pass
+
+// Store-mode ZIP streamed from SD; CRCs go into data descriptors so nothing is buffered
+const uint16_t BUNDLE_MAX_FILES = 1000;
+const uint64_t BUNDLE_MAX_BYTES = 0xFFFFFFFFULL;  // No ZIP64
+const uint16_t ZIP_FLAGS = 0x0808;                // Bit 3: CRC and sizes follow the data; bit 11: UTF-8 names
+const uint16_t ZIP_DOS_DATE = 0x0021;             // 1980-01-01; there is no RTC to do better
+
+struct ZipBundleEntry {
+  String name;      // Name inside the archive
+  String sdPath;
+  uint32_t size;
+  uint32_t crc;
+  uint32_t offset;  // Of the local header
+};
+
+enum ZipBundleStage { ZIP_LOCAL_HEADER, ZIP_DATA, ZIP_DESCRIPTOR, ZIP_CENTRAL, ZIP_FINISHING, ZIP_DONE };
+
+struct ZipBundle {
+  std::vector<ZipBundleEntry> entries;
+  ZipBundleStage stage = ZIP_LOCAL_HEADER;
+  size_t index = 0;
+  std::vector<uint8_t> pending;  // Header bytes waiting for socket room
+  size_t pendingOffset = 0;
+  uint32_t offset = 0;           // Archive bytes emitted so far
+  uint32_t centralStart = 0;
+  unsigned long lastProgressAt = 0;
+  bool pipeOpen = false;
+  bool failed = false;
+  String name;
+};
+
+struct ActiveDownload {
+  DownloadPipeline pipe;
+  WiFiClient client;
+  ZipBundle* bundle = nullptr;  // Set for /bundle transfers; pipe then carries the current entry
+  std::shared_ptr<HotObject> hot;  // Set for hot-cache hits; pipe only does the bookkeeping
+  String statsPath;                // Public path counted in downloadStats, if any
+  size_t hotOffset = 0;
+  uint16_t weight = DOWNLOAD_DEFAULT_WEIGHT;
+  size_t deficit = 0;
+  uint32_t benchRunId = 0;   // Non-zero for /bench transfers
+  unsigned long bundleStartedAt = 0;
+  uint32_t idleAtStart[2] = {0, 0};
+};
+
+std::vector<ActiveDownload*> activeDownloads;
+uint8_t downloadSlots = DOWNLOAD_SLOTS_INTERNAL;
+uint32_t downloadRateCap = DOWNLOAD_RATE_CAP_DEFAULT;  // 0 disables the cap
+uint32_t downloadTokens = 0;                           // Token bucket for the global cap
+unsigned long downloadTokensRefilledAt = 0;
+size_t downloadRoundStart = 0;                         // Rotates who goes first each pass
+unsigned long downloadRounds = 0;
+unsigned long downloadsRejected = 0;
+
+bool downloadSlotAvailable();
+ActiveDownload* prepareDownload(File file, size_t length, size_t bufferSize, uint8_t depth);
+void activateDownload(ActiveDownload* download, uint16_t weight);
+ActiveDownload* scheduleBundle(ZipBundle* bundle, uint16_t weight);
+void processDownloads();
+void handleScheduler();
+void handleBundle();
+
+bool downloadPipelineBegin(DownloadPipeline& pipe, File file, size_t length, size_t bufferSize, uint8_t depth);
+size_t downloadPipelineSend(DownloadPipeline& pipe, WiFiClient& client, size_t maxBytes, uint32_t waitMs);
+void downloadPipelineEnd(DownloadPipeline& pipe);
+
+// Library storage layout: flat letter directories, or each letter sharded into hashed buckets
+const char* CATALOG_LAYOUT_PATH = "/catalog/layout";
+const uint8_t LIBRARY_SHARD_BUCKETS = 16;             // "~0".."~f" under each section
+const unsigned long SHARD_MIGRATION_BUDGET_US = 4000; // Max migration time per loop pass
+const uint8_t SHARD_MIGRATION_BATCH = 8;              // Files moved per directory reopen
+const unsigned long SHARD_MIGRATION_RETRY_MS = 60000;  // Pause before another pass over what didn't move
+
+enum LibraryLayout { LIBRARY_LAYOUT_FLAT, LIBRARY_LAYOUT_MIGRATING, LIBRARY_LAYOUT_SHARDED };
+
+struct ShardMigrationJob {
+  uint8_t section = 0;            // Next section slot to drain
+  unsigned long moved = 0;
+  unsigned long skipped = 0;      // Files this pass could not move; they stay in the section root
+  unsigned long startedAt = 0;
+  unsigned long retryAt = 0;      // Set when a pass ended with skipped files
+  std::vector<String> failed;     // Names in the current section not to try again this pass
+};
+
+LibraryLayout libraryLayout = LIBRARY_LAYOUT_FLAT;
+ShardMigrationJob shardMigration;
+
+String libraryPhysicalPath(const String& publicPath);
+String libraryShardedPath(const String& publicPath);
+String libraryPublicPath(const String& sdPath);
+void loadLibraryLayout();
+void processShardMigration();
+void handleReshard();
+void handleBenchPage();
+void handleBenchClock();
+void handleBenchPrepare();
+void handleBenchCleanup();
+void processBench();
+void handleBenchFile();
+void handleBenchResult();
+void handleOpenBenchmark();
+void handleUploadBenchPage();
+void handleUploadBenchStart();
+void handleUploadBenchResult();
+
+// Library change journal and per-section generation counters
+const char* CATALOG_JOURNAL_PATH = "/catalog/journal.log";
+const size_t JOURNAL_MAX_BYTES = 65536;        // Rotate once the journal grows past this
+const uint16_t JOURNAL_CHECKPOINT_EVERY = 32;  // Records between in-RAM seek checkpoints
+const uint8_t LIBRARY_SECTION_COUNT = 28;      // 0-9, #@, A-Z
+
+// Changes are to public paths; moving a book between layouts isn't one
+enum LibraryChangeOp { LIBRARY_CHANGE_ADD, LIBRARY_CHANGE_REMOVE };
+
+struct JournalCheckpoint {
+  uint32_t seq;     // First record at this offset
+  uint32_t offset;
+};
+
+uint32_t libraryJournalSeq = 0;       // Last sequence number written
+uint32_t libraryJournalBaseSeq = 0;   // Records at or below this were rotated away
+std::vector<JournalCheckpoint> journalCheckpoints;
+uint32_t sectionGenerations[LIBRARY_SECTION_COUNT] = {0};
+uint32_t libraryGeneration = 0;
+uint32_t libraryBootId = 0;           // Keeps RAM generations unique across reboots
+
+void loadLibraryJournal();
+void recordLibraryChange(LibraryChangeOp op, const String& path);
+void bumpSectionGeneration(const String& path);
+void handleLibraryChanges();
+
+// Library metrics: running counters, reconciled by a bounded background scan
+const unsigned long LIBRARY_METRICS_INTERVAL = 600000;  // Reconcile every 10 minutes
+const uint8_t LIBRARY_METRICS_ENTRIES_PER_PASS = 8;     // Directory entries visited per loop pass
+size_t libraryFileCount = 0;
+uint64_t libraryTotalBytes = 0;
+uint64_t sdTotalBytes = 0;
+uint64_t sdUsedBytes = 0;
+bool libraryMetricsReconciled = false;
+unsigned long lastLibraryMetricsUpdate = 0;
+
+struct LibraryMetricsScan {
+  bool active = false;
+  LibraryScanCursor cursor;
+  size_t fileCount = 0;
+  uint64_t libraryBytes = 0;
+  uint64_t usedBytes = 0;
+  unsigned long startedAt = 0;
+};
+
+LibraryMetricsScan libraryMetricsScan;
+
+// Free space: asking FatFs means a walk over the whole FAT, so the free clusters are counted
+// once after mount straight off the FAT sectors, a few per loop pass, and then kept current
+// as uploads and jobs allocate and free. An hourly recount absorbs the small untracked
+// writes (journal, forum, sidecars).
+const unsigned long FREE_SPACE_BUDGET_US = 3000;            // Max counting time per loop pass
+const unsigned long FREE_SPACE_RECOUNT_INTERVAL = 3600000;
+const uint64_t FREE_SPACE_RESERVE_BYTES = 1024UL * 1024;     // Kept back for catalog and forum writes
+const size_t FREE_SPACE_SECTOR = 512;
+
+struct FreeSpaceCounter {
+  bool known = false;          // freeClusters holds a count
+  bool unsupported = false;    // exFAT, FAT12 or odd sector size: no count, no pre-admission
+  uint32_t clusterBytes = 0;
+  uint32_t clusters = 0;       // Data clusters on the volume
+  uint32_t freeClusters = 0;
+  bool counting = false;
+  uint8_t fatBits = 0;         // 16 or 32
+  uint32_t fatStart = 0;       // First sector of the first FAT
+  uint32_t fatSector = 0;      // Next FAT sector to read, from fatStart
+  uint32_t fatSectors = 0;     // Sectors holding entries for the data clusters
+  uint32_t counted = 0;
+  int32_t pending = 0;         // Clusters freed (+) or taken (-) while a count runs
+  unsigned long startedAt = 0;
+  unsigned long countedAt = 0;
+  unsigned long countMs = 0;   // Duration of the last count
+};
+
+FreeSpaceCounter freeSpace;
+unsigned long uploadsRejectedFull = 0;
+
+void noteClustersResized(uint64_t oldBytes, uint64_t newBytes);
+uint64_t sdFreeBytes();
+void processFreeSpaceCount();
+
+// Content hashing and deduplication
+const char* CATALOG_HASHES_PATH = "/catalog/hashes.tsv";
+const char* CATALOG_ALIASES_PATH = "/catalog/aliases.tsv";
+const unsigned long FINGERPRINT_LOOP_BUDGET_US = 3000;
+const unsigned long FINGERPRINT_RESCAN_INTERVAL = 1800000;  // Re-check the library every 30 minutes
+const size_t FINGERPRINT_READ_CHUNK = 4096;
+
+struct ContentFingerprint {
+  String hash;  // SHA-256, lowercase hex
+  size_t size;
+};
+
+std::map<String, ContentFingerprint> pathFingerprints;  // Public library path -> content hash
+std::map<String, String> contentHashIndex;              // Content hash -> canonical public path
+std::map<String, String> libraryAliases;                // Alias path -> canonical path
+
+struct FingerprintJob {
+  bool active = false;
+  bool rescanRequested = true;
+  unsigned long lastPassEnd = 0;
+  LibraryScanCursor cursor;
+  File file;
+  String path;
+  size_t size = 0;
+  ContentHasher hasher;
+  uint32_t duplicateFiles = 0;
+  uint64_t duplicateBytes = 0;
+  std::vector<std::pair<String, String>> duplicates;  // Found during the last pass
+};
+
+FingerprintJob fingerprintJob;
+
+void contentHashBegin(ContentHasher& hasher);
+void contentHashUpdate(ContentHasher& hasher, const uint8_t* data, size_t length);
+String contentHashFinish(ContentHasher& hasher);
+void loadContentIndex();
+bool registerUploadFingerprint(const String& path, const String& hash, size_t size);
+void releaseLibraryPath(const String& path);
+void replaceTsvTable(const char* path, const std::vector<String>& lines);
+String resolveLibraryPath(const String& path);
+void processFingerprintJob();
+
+void updateLibraryMetrics();
+void noteStorageAdded(const String& path, uint64_t bytes);
+void noteStorageRemoved(const String& path, uint64_t bytes);
+size_t sdFileBytes(const char* path);
+bool replaceSdTable(const char* path, size_t written);
+void restoreSdTable(const char* path);
+void handleMetrics();
+void handleDuplicates();
+void handleLibraryChanges();
+
+void loadLibraryCatalog();
+void compactLibraryCatalog(size_t rows);
+void dropCatalogEntry(const String& path);
+void processMetadataExtraction();
+void requestMetadataRescan();
+
+// Registry entry for a file name (or path) by its extension, nullptr if the library doesn't take it.
+// No allocation: the extension is lower-cased into a small stack buffer.
+const FileType* fileTypeFor(const char* name, size_t length) {
+  size_t dot = length;
+  while (dot > 0 && name[dot - 1] != '.' && name[dot - 1] != '/') {
+    dot--;
+  }
+  size_t extLength = length - dot;
+  if (dot == 0 || name[dot - 1] != '.' || extLength == 0 || extLength > FILE_TYPE_MAX_EXT) {
+    return nullptr;
+  }
+  char ext[FILE_TYPE_MAX_EXT + 1];
+  for (size_t i = 0; i < extLength; ++i) {
+    ext[i] = tolower(static_cast<unsigned char>(name[dot + i]));
+  }
+  ext[extLength] = '\0';
+  int8_t index = FILE_TYPE_SLOT_TABLE.index[FileTypeHash::hash(ext, FILE_TYPE_SEED)];
+  if (index < 0 || strcmp(FILE_TYPES[index].ext, ext) != 0) {
+    return nullptr;
+  }
+  return &FILE_TYPES[index];
+}
+
+const FileType* fileTypeFor(const String& name) {
+  return fileTypeFor(name.c_str(), name.length());
+}
+
+bool fileSignatureFound(const FileSignature& signature, const uint8_t* data, size_t length) {
+  size_t size = strlen(signature.bytes);
+  for (size_t at = signature.offset; at <= signature.offset + signature.slack && at + size <= length; ++at) {
+    if (memcmp(data + at, signature.bytes, size) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether the first bytes of a file fit its type. Checks stay inside the first UPLOAD_SNIFF_BYTES;
+// a file shorter than a signature's end doesn't match it.
+bool fileContentMatches(const FileType& type, const uint8_t* data, size_t length) {
+  length = std::min(length, UPLOAD_SNIFF_BYTES);
+  if (type.sniff == SNIFF_TEXT) {
+    // UTF-16 text is full of NULs; a byte order mark vouches for it
+    if (length >= 2 && ((data[0] == 0xFF && data[1] == 0xFE) || (data[0] == 0xFE && data[1] == 0xFF))) {
+      return true;
+    }
+    return memchr(data, 0, length) == nullptr;
+  }
+  if (type.sniff != SNIFF_ANY && type.sniff != SNIFF_ALL) {
+    return true;
+  }
+  bool all = true;
+  for (const FileSignature& signature : type.signatures) {
+    if (signature.bytes == nullptr) {
+      continue;
+    }
+    bool found = fileSignatureFound(signature, data, length);
+    if (found && type.sniff == SNIFF_ANY) {
+      return true;
+    }
+    all = all && found;
+  }
+  return type.sniff == SNIFF_ALL && all;
+}
+
 // Function to check if file is allowed
 bool isAllowedFile(const String& filename) {
-  String lowerFilename = filename;
-  lowerFilename.toLowerCase();
-  return lowerFilename.endsWith(".pdf") ||
-         lowerFilename.endsWith(".epub") ||
-         lowerFilename.endsWith(".doc") ||
-         lowerFilename.endsWith(".docx") ||
-         lowerFilename.endsWith(".rtf") ||
-         lowerFilename.endsWith(".txt") ||
-         lowerFilename.endsWith(".azw") ||
-         lowerFilename.endsWith(".mobi") ||
-         lowerFilename.endsWith(".lib") ||
-         lowerFilename.endsWith(".fb2") ||
-         lowerFilename.endsWith(".prc") ||
-         lowerFilename.endsWith(".pdb") ||
-         lowerFilename.endsWith(".ibook");
+  return fileTypeFor(filename) != nullptr;
+}
+
+// A client-supplied file name that stays a single entry in the directory it lands in
+bool isSafeUploadName(const String& name) {
+  if (name.length() == 0 || name.startsWith(".") || name.indexOf("..") >= 0) {
+    return false;
+  }
+  for (size_t i = 0; i < name.length(); i++) {
+    uint8_t c = name.charAt(i);
+    if (c == '/' || c == '\\' || c < 0x20 || c == 0x7f) {
+      return false;
+    }
+  }
+  return true;
 }
 
 // Function to check if string is IP address
@@ -249,6 +1210,121 @@ String urlEncodePath(const String& path) {
   return encoded;
 }
 
+// ----- Forum logs -----
+
+String forumPostsPath(const String& threadId) {
+  return "/forum/posts/" + threadId + ".log";
+}
+
+// Field text with the separator stripped, so user input can't shift the fields after it
+String forumField(String value) {
+  value.replace(String(FORUM_FIELD_SEPARATOR), "");
+  return value;
+}
+
+// Appends one record in a single write. A crash can only leave a torn record at the end,
+// which readers skip; everything before it stays intact.
+bool forumLogAppend(const String& path, const String& payload) {
+  if (payload.length() == 0 || payload.length() > FORUM_RECORD_MAX) {
+    return false;
+  }
+  size_t length = payload.length();
+  std::unique_ptr<uint8_t[]> record(new uint8_t[FORUM_RECORD_HEADER + length]);
+  uint32_t crc = crc32Update(0, reinterpret_cast<const uint8_t*>(payload.c_str()), length);
+  record[0] = FORUM_RECORD_MAGIC & 0xFF;
+  record[1] = FORUM_RECORD_MAGIC >> 8;
+  record[2] = length & 0xFF;
+  record[3] = length >> 8;
+  for (int i = 0; i < 4; ++i) {
+    record[4 + i] = (crc >> (8 * i)) & 0xFF;
+  }
+  memcpy(record.get() + FORUM_RECORD_HEADER, payload.c_str(), length);
+
+  fileCacheInvalidate(path);
+  File file = SD.open(path, FILE_APPEND);
+  if (!file) {
+    Serial.println("[FORUM][ERROR] Cannot open " + path);
+    return false;
+  }
+  size_t written = file.write(record.get(), FORUM_RECORD_HEADER + length);
+  file.close();
+  fileCacheInvalidate(path);
+  noteStorageAdded(path, written);  // A torn record still takes its bytes
+  return written == FORUM_RECORD_HEADER + length;
+}
+
+// Reads the next intact record's payload. Anything that isn't one (a torn tail, a damaged
+// block) is stepped over a byte at a time until a magic with a matching CRC turns up.
+bool forumLogNext(File& file, String& payload) {
+  uint8_t header[FORUM_RECORD_HEADER];
+  while (file.available() >= static_cast<int>(FORUM_RECORD_HEADER)) {
+    size_t at = file.position();
+    if (file.read(header, FORUM_RECORD_HEADER) != FORUM_RECORD_HEADER) {
+      return false;
+    }
+    uint16_t magic = header[0] | (header[1] << 8);
+    size_t length = header[2] | (header[3] << 8);
+    uint32_t crc = header[4] | (header[5] << 8) | (header[6] << 16) | (static_cast<uint32_t>(header[7]) << 24);
+    if (magic == FORUM_RECORD_MAGIC && length > 0 && length <= FORUM_RECORD_MAX &&
+        static_cast<size_t>(file.available()) >= length) {
+      std::unique_ptr<uint8_t[]> data(new uint8_t[length]);
+      if (file.read(data.get(), length) == length && crc32Update(0, data.get(), length) == crc) {
+        payload = "";
+        payload.reserve(length);
+        for (size_t i = 0; i < length; ++i) {
+          payload += static_cast<char>(data[i]);
+        }
+        return true;
+      }
+    }
+    forumRecordsSkipped++;
+    file.seek(at + 1);
+  }
+  return false;
+}
+
+// Field index of a record payload, "" past the last one
+String forumRecordField(const String& payload, uint8_t index) {
+  int start = 0;
+  for (uint8_t i = 0; i < index; ++i) {
+    start = payload.indexOf(FORUM_FIELD_SEPARATOR, start);
+    if (start < 0) {
+      return "";
+    }
+    start++;
+  }
+  int end = payload.indexOf(FORUM_FIELD_SEPARATOR, start);
+  return payload.substring(start, end < 0 ? payload.length() : end);
+}
+
+String forumThreadRecord(const ForumThread& thread) {
+  return forumField(thread.id) + FORUM_FIELD_SEPARATOR + forumField(thread.title) + FORUM_FIELD_SEPARATOR +
+         forumField(thread.author) + FORUM_FIELD_SEPARATOR + forumField(thread.timestamp);
+}
+
+ForumThread parseForumThread(const String& payload) {
+  ForumThread thread;
+  thread.id = forumRecordField(payload, 0);
+  thread.title = forumRecordField(payload, 1);
+  thread.author = forumRecordField(payload, 2);
+  thread.timestamp = forumRecordField(payload, 3);
+  return thread;
+}
+
+String forumPostRecord(const ForumPost& post) {
+  return forumField(post.id) + FORUM_FIELD_SEPARATOR + forumField(post.author) + FORUM_FIELD_SEPARATOR +
+         forumField(post.content) + FORUM_FIELD_SEPARATOR + forumField(post.timestamp);
+}
+
+ForumPost parseForumPost(const String& payload) {
+  ForumPost post;
+  post.id = forumRecordField(payload, 0);
+  post.author = forumRecordField(payload, 1);
+  post.content = forumRecordField(payload, 2);
+  post.timestamp = forumRecordField(payload, 3);
+  return post;
+}
+
 String formatTimestamp(unsigned long timestamp) {
   unsigned long now = millis();
   unsigned long diff = now >= timestamp ? now - timestamp : 0;
@@ -303,69 +1379,4345 @@ void collectLibraryFiles(const String& dirPath, std::vector<LibraryFileEntry>& f
       }
       collectLibraryFiles(entryPath, files);
     } else if (isAllowedFile(name)) {
-      files.push_back({entryPath, entrySize});
+      files.push_back({libraryPublicPath(entryPath), entrySize, entryPath});
     }
   }
 
   dir.close();
 }
 
-bool initializeSdCard() {
-  Serial.println("[SD] ----- Initialization Start -----");
-  Serial.printf("[SD] Configured CS pin: %d\n", SD_CS_PIN);
-  Serial.println("[SD] Attempting to mount card...");
+bool libraryScanBegin(LibraryScanCursor& cursor, const String& rootPath) {
+  libraryScanEnd(cursor);
+  File root = SD.open(rootPath.c_str());
+  if (!root) {
+    return false;
+  }
+  if (!root.isDirectory()) {
+    root.close();
+    return false;
+  }
+  cursor.dirs.push_back(root);
+  cursor.paths.push_back(rootPath);
+  return true;
+}
 
-  pinMode(SD_CS_PIN, OUTPUT);
-  digitalWrite(SD_CS_PIN, HIGH);
+LibraryScanResult libraryScanStep(LibraryScanCursor& cursor, LibraryFileEntry& entry) {
+  if (cursor.dirs.empty()) {
+    return LIBRARY_SCAN_DONE;
+  }
 
-#if defined(ARDUINO_ARCH_ESP32)
-  SPI.begin(SCK, MISO, MOSI, SD_CS_PIN);
-#else
-  SPI.begin();
-#endif
+  File next = cursor.dirs.back().openNextFile();
+  if (!next) {
+    cursor.dirs.back().close();
+    cursor.dirs.pop_back();
+    cursor.paths.pop_back();
+    return cursor.dirs.empty() ? LIBRARY_SCAN_DONE : LIBRARY_SCAN_PENDING;
+  }
 
-  //#if HAS_SD2CARD_HELPER
-  //    Serial.println("[SD] Performing low-level card.init verification (SPI_HALF_SPEED)");
-  //    Sd2Card card;
-  //    if (!card.init(SPI_HALF_SPEED, SD_CS_PIN)) {
-  //        Serial.printf("[SD][ERROR] card.init failed (code=%u, data=%u)\n", card.errorCode(), card.errorData());
-  //        Serial.println("[SD][HINT] Check wiring, ensure the card is inserted, and verify CS pin wiring");
-  //        Serial.println("[SD] ----- Initialization Aborted -----");
-  //        return false;
-  //   }
+  String name = next.name();
+  bool isDir = next.isDirectory();
+  size_t entrySize = next.size();
+  next.close();
 
-  // const uint8_t detectedType = card.type();
-  //const char* typeLabel = "Unknown";
-  //switch (detectedType) {
-  //   case SD_CARD_TYPE_SD1:
-  //      typeLabel = "SD1";
-  //     break;
-  //  case SD_CARD_TYPE_SD2:
-  //     typeLabel = "SD2";
-  //     break;
-  // case SD_CARD_TYPE_SDHC:
-  //     typeLabel = "SDHC";
-  //     break;
-  //  default:
-  //      break;
-  // }
+  const String& parent = cursor.paths.back();
+  String entryPath = parent.endsWith("/") ? parent + name : parent + "/" + name;
 
-  //   Serial.printf("[SD] card.init succeeded; detected type: %s\n", typeLabel);
-  //#else
-  //   Serial.println("[SD][WARN] card.init helper unavailable; skipping low-level verification");
-  //#endif
+  if (isDir) {
+    if (cursor.dirs.size() > cursor.maxDepth) {
+      return LIBRARY_SCAN_PENDING;
+    }
+    File child = SD.open(entryPath.c_str());
+    if (child) {
+      cursor.dirs.push_back(child);
+      cursor.paths.push_back(entryPath);
+    }
+    return LIBRARY_SCAN_PENDING;
+  }
 
-  if (!SD.begin(SD_CS_PIN)) {
-    Serial.println("[SD][ERROR] SD.begin failed; card not available");
-    Serial.println("[SD] ----- Initialization Aborted -----");
-    return false;
+  if (!cursor.allFiles && !isAllowedFile(name)) {
+    return LIBRARY_SCAN_PENDING;
   }
 
-  Serial.println("[SD] Card mounted successfully");
+  entry.path = libraryPublicPath(entryPath);
+  entry.size = entrySize;
+  entry.sdPath = entryPath;
+  return LIBRARY_SCAN_FILE;
+}
 
-  enum SdRequirementType { SD_REQ_DIRECTORY, SD_REQ_FILE };
+void libraryScanEnd(LibraryScanCursor& cursor) {
+  for (auto& dir : cursor.dirs) {
+    dir.close();
+  }
+  cursor.dirs.clear();
+  cursor.paths.clear();
+}
 
-  struct SdRequirement {
+// ----- Library metrics -----
+
+bool isLibraryBookPath(const String& path) {
+  return path.startsWith("/Alexandria/") && isAllowedFile(path.substring(path.lastIndexOf('/') + 1));
+}
+
+void noteStorageAdded(const String& path, uint64_t bytes) {
+  sdUsedBytes += bytes;
+  if (isLibraryBookPath(path)) {
+    libraryFileCount++;
+    libraryTotalBytes += bytes;
+  }
+}
+
+void noteStorageRemoved(const String& path, uint64_t bytes) {
+  sdUsedBytes -= std::min(sdUsedBytes, bytes);
+  if (isLibraryBookPath(path)) {
+    if (libraryFileCount > 0) {
+      libraryFileCount--;
+    }
+    libraryTotalBytes -= std::min(libraryTotalBytes, bytes);
+  }
+}
+
+// Size of a file on the card, 0 when it isn't there; for tables about to be rewritten
+size_t sdFileBytes(const char* path) {
+  File file = SD.open(path, FILE_READ);
+  if (!file) {
+    return 0;
+  }
+  size_t size = file.size();
+  file.close();
+  return size;
+}
+
+// Swaps a finished "<path>.tmp" (written bytes long) in for the table. FAT can't rename over a
+// file, so the old one steps aside as "<path>.bak" first and only goes once the new one is in
+// place; a failed swap puts it back. A power cut anywhere in between is undone by restoreSdTable.
+bool replaceSdTable(const char* path, size_t written) {
+  String tempPath = String(path) + ".tmp";
+  String backupPath = String(path) + ".bak";
+  size_t oldBytes = sdFileBytes(path);
+  bool hadTable = SD.exists(path);
+  if (hadTable) {
+    SD.remove(backupPath);
+    if (!SD.rename(path, backupPath.c_str())) {
+      SD.remove(tempPath);
+      return false;
+    }
+  }
+  if (!SD.rename(tempPath.c_str(), path)) {
+    SD.remove(tempPath);
+    if (hadTable) {
+      SD.rename(backupPath.c_str(), path);
+    }
+    return false;
+  }
+  if (hadTable) {
+    SD.remove(backupPath);
+  }
+  noteStorageRemoved(path, oldBytes);
+  noteStorageAdded(path, written);
+  return true;
+}
+
+// Called before a table is loaded. Without the table, a backup means the cut came after the
+// temp was complete, so the temp wins; a lone backup or temp is the best copy left.
+void restoreSdTable(const char* path) {
+  String tempPath = String(path) + ".tmp";
+  String backupPath = String(path) + ".bak";
+  if (!SD.exists(path)) {
+    String source = SD.exists(tempPath) ? tempPath : backupPath;
+    if (SD.exists(source) && SD.rename(source.c_str(), path)) {
+      Serial.println("[SD] Restored " + String(path) + " from " + source);
+    }
+  }
+  SD.remove(tempPath);
+  SD.remove(backupPath);
+}
+
+// ----- Free space -----
+
+uint32_t clustersFor(uint64_t bytes) {
+  if (freeSpace.clusterBytes == 0) {
+    return 0;
+  }
+  return (bytes + freeSpace.clusterBytes - 1) / freeSpace.clusterBytes;
+}
+
+// Called wherever the sketch grows, shrinks or deletes a file; 0 bytes is a removed file
+void noteClustersResized(uint64_t oldBytes, uint64_t newBytes) {
+  int32_t freed = static_cast<int32_t>(clustersFor(oldBytes)) - static_cast<int32_t>(clustersFor(newBytes));
+  if (freed == 0) {
+    return;
+  }
+  int64_t updated = static_cast<int64_t>(freeSpace.freeClusters) + freed;
+  freeSpace.freeClusters = constrain(updated, static_cast<int64_t>(0), static_cast<int64_t>(freeSpace.clusters));
+  if (freeSpace.counting) {
+    freeSpace.pending += freed;
+  }
+}
+
+uint64_t sdFreeBytes() {
+  return static_cast<uint64_t>(freeSpace.freeClusters) * freeSpace.clusterBytes;
+}
+
+// Reads the boot sector (behind an MBR if there is one) and lays out the FAT walk
+bool beginFreeSpaceCount() {
+#if defined(ARDUINO_ARCH_ESP32)
+  static uint8_t sector[FREE_SPACE_SECTOR];
+  if (SD.sectorSize() != FREE_SPACE_SECTOR || !SD.readRAW(sector, 0)) {
+    return false;
+  }
+  uint32_t volumeStart = 0;
+  if (sector[0] != 0xEB && sector[0] != 0xE9) {
+    volumeStart = sector[0x1C6] | (sector[0x1C7] << 8) | (sector[0x1C8] << 16) |
+                  (static_cast<uint32_t>(sector[0x1C9]) << 24);  // First partition's LBA
+    if (!SD.readRAW(sector, volumeStart)) {
+      return false;
+    }
+  }
+  uint16_t bytesPerSector = sector[11] | (sector[12] << 8);
+  uint8_t sectorsPerCluster = sector[13];
+  uint16_t reserved = sector[14] | (sector[15] << 8);
+  uint8_t fats = sector[16];
+  uint16_t rootEntries = sector[17] | (sector[18] << 8);
+  uint32_t totalSectors = sector[19] | (sector[20] << 8);
+  uint32_t fatSize = sector[22] | (sector[23] << 8);
+  if (totalSectors == 0) {
+    totalSectors = sector[32] | (sector[33] << 8) | (sector[34] << 16) | (static_cast<uint32_t>(sector[35]) << 24);
+  }
+  if (fatSize == 0) {
+    fatSize = sector[36] | (sector[37] << 8) | (sector[38] << 16) | (static_cast<uint32_t>(sector[39]) << 24);
+  }
+  if (memcmp(sector + 3, "EXFAT", 5) == 0 || bytesPerSector != FREE_SPACE_SECTOR || sectorsPerCluster == 0 ||
+      fats == 0 || fatSize == 0) {
+    return false;
+  }
+  uint32_t rootSectors = (rootEntries * 32UL + bytesPerSector - 1) / bytesPerSector;
+  uint32_t metaSectors = reserved + fats * fatSize + rootSectors;
+  if (totalSectors <= metaSectors) {
+    return false;
+  }
+  uint32_t clusters = (totalSectors - metaSectors) / sectorsPerCluster;
+  if (clusters < 4085) {
+    return false;  // FAT12 packs entries across byte boundaries; not worth it for a tiny card
+  }
+
+  freeSpace.fatBits = clusters < 65525 ? 16 : 32;
+  freeSpace.clusters = clusters;
+  freeSpace.clusterBytes = static_cast<uint32_t>(bytesPerSector) * sectorsPerCluster;
+  freeSpace.fatStart = volumeStart + reserved;
+  freeSpace.fatSectors = ((clusters + 2ULL) * (freeSpace.fatBits / 8) + bytesPerSector - 1) / bytesPerSector;
+  freeSpace.fatSector = 0;
+  freeSpace.counted = 0;
+  freeSpace.pending = 0;
+  return true;
+#else
+  return false;  // The ESP8266 SD wrapper has no raw sector access
+#endif
+}
+
+// Counts free FAT entries a sector at a time until the loop budget runs out
+void processFreeSpaceCount() {
+#if defined(ARDUINO_ARCH_ESP32)
+  // Raw sector reads share the SPI bus with transfers; a count in progress resumes afterwards
+  if (!sdCardReady || freeSpace.unsupported || !activeDownloads.empty() || uploadInProgress()) {
+    return;
+  }
+  if (!freeSpace.counting) {
+    if (freeSpace.known && millis() - freeSpace.countedAt < FREE_SPACE_RECOUNT_INTERVAL) {
+      return;
+    }
+    if (!beginFreeSpaceCount()) {
+      freeSpace.unsupported = true;
+      Serial.println("[SD] Free-space counter unavailable for this card's file system");
+      return;
+    }
+    freeSpace.counting = true;
+    freeSpace.startedAt = millis();
+  }
+
+  static uint8_t sector[FREE_SPACE_SECTOR];
+  unsigned long start = micros();
+  size_t perSector = FREE_SPACE_SECTOR / (freeSpace.fatBits / 8);
+  while (freeSpace.fatSector < freeSpace.fatSectors && micros() - start < FREE_SPACE_BUDGET_US) {
+    if (!SD.readRAW(sector, freeSpace.fatStart + freeSpace.fatSector)) {
+      freeSpace.counting = false;  // Try again on the next pass
+      return;
+    }
+    uint32_t first = freeSpace.fatSector * perSector;
+    for (size_t i = 0; i < perSector; ++i) {
+      uint32_t cluster = first + i;
+      if (cluster < 2 || cluster >= freeSpace.clusters + 2) {
+        continue;  // Entries 0 and 1 are reserved; the last sector has padding
+      }
+      uint32_t entry = freeSpace.fatBits == 32
+                           ? (sector[i * 4] | (sector[i * 4 + 1] << 8) | (sector[i * 4 + 2] << 16) |
+                              (static_cast<uint32_t>(sector[i * 4 + 3] & 0x0F) << 24))
+                           : static_cast<uint32_t>(sector[i * 2] | (sector[i * 2 + 1] << 8));
+      freeSpace.counted += entry == 0;
+    }
+    freeSpace.fatSector++;
+  }
+  if (freeSpace.fatSector < freeSpace.fatSectors) {
+    return;
+  }
+
+  // Changes made during the count may have landed on either side of the read position; the
+  // next recount settles that
+  int64_t total = static_cast<int64_t>(freeSpace.counted) + freeSpace.pending;
+  freeSpace.freeClusters = constrain(total, static_cast<int64_t>(0), static_cast<int64_t>(freeSpace.clusters));
+  freeSpace.counting = false;
+  freeSpace.known = true;
+  freeSpace.countedAt = millis();
+  freeSpace.countMs = freeSpace.countedAt - freeSpace.startedAt;
+  Serial.printf("[SD] Free space counted in %lu ms: %lu of %lu clusters (%u bytes each), %llu bytes free\n",
+                freeSpace.countMs, static_cast<unsigned long>(freeSpace.freeClusters),
+                static_cast<unsigned long>(freeSpace.clusters), static_cast<unsigned int>(freeSpace.clusterBytes),
+                static_cast<unsigned long long>(sdFreeBytes()));
+#endif
+}
+
+// Advances the reconcile scan by a few directory entries; the counters stay valid meanwhile
+void updateLibraryMetrics() {
+  if (!sdCardReady) {
+    return;
+  }
+
+  LibraryMetricsScan& scan = libraryMetricsScan;
+  if (!scan.active) {
+    if (libraryMetricsReconciled && millis() - lastLibraryMetricsUpdate < LIBRARY_METRICS_INTERVAL) {
+      return;
+    }
+    scan.cursor.allFiles = true;
+    if (!libraryScanBegin(scan.cursor, "/")) {
+      lastLibraryMetricsUpdate = millis();
+      return;
+    }
+    scan.active = true;
+    scan.fileCount = 0;
+    scan.libraryBytes = 0;
+    scan.usedBytes = 0;
+    scan.startedAt = millis();
+  }
+
+  for (uint8_t i = 0; i < LIBRARY_METRICS_ENTRIES_PER_PASS; ++i) {
+    LibraryFileEntry entry;
+    LibraryScanResult result = libraryScanStep(scan.cursor, entry);
+    if (result == LIBRARY_SCAN_FILE) {
+      scan.usedBytes += entry.size;
+      if (isLibraryBookPath(entry.path)) {
+        scan.fileCount++;
+        scan.libraryBytes += entry.size;
+      }
+    } else if (result == LIBRARY_SCAN_DONE) {
+      scan.active = false;
+      libraryFileCount = scan.fileCount;
+      libraryTotalBytes = scan.libraryBytes;
+      sdUsedBytes = sdTotalBytes > 0 ? std::min(scan.usedBytes, sdTotalBytes) : scan.usedBytes;
+      libraryMetricsReconciled = true;
+      lastLibraryMetricsUpdate = millis();
+      Serial.printf("[SD] Metrics reconciled in %lu ms: %u library files, %llu bytes; card used %llu of %llu bytes\n",
+                    lastLibraryMetricsUpdate - scan.startedAt,
+                    static_cast<unsigned int>(libraryFileCount),
+                    static_cast<unsigned long long>(libraryTotalBytes),
+                    static_cast<unsigned long long>(sdUsedBytes),
+                    static_cast<unsigned long long>(sdTotalBytes));
+      return;
+    }
+  }
+}
+
+// ----- Library change journal -----
+
+int librarySectionIndex(const String& sectionName) {
+  if (sectionName == "0-9" || sectionName == "num") {
+    return 0;
+  }
+  if (sectionName == "#@" || sectionName == "sym") {
+    return 1;
+  }
+  if (sectionName.length() == 1) {
+    char c = toupper(sectionName.charAt(0));
+    if (c >= 'A' && c <= 'Z') {
+      return 2 + (c - 'A');
+    }
+  }
+  return -1;
+}
+
+// "/Alexandria/<section>/..." -> section slot, or -1 outside the library
+int librarySectionIndexForPath(const String& path) {
+  const String prefix = "/Alexandria/";
+  if (!path.startsWith(prefix)) {
+    return -1;
+  }
+  int slash = path.indexOf('/', prefix.length());
+  if (slash < 0) {
+    return -1;
+  }
+  return librarySectionIndex(path.substring(prefix.length(), slash));
+}
+
+void bumpSectionGeneration(const String& path) {
+  libraryGeneration++;
+  int section = librarySectionIndexForPath(path);
+  if (section >= 0) {
+    sectionGenerations[section]++;
+  }
+}
+
+// Text and attribute values for HTML built from card contents (file names, book metadata)
+String htmlEscape(const String& value) {
+  String out;
+  out.reserve(value.length() + 8);
+  for (size_t i = 0; i < value.length(); ++i) {
+    char c = value.charAt(i);
+    switch (c) {
+      case '&': out += "&amp;"; break;
+      case '<': out += "&lt;"; break;
+      case '>': out += "&gt;"; break;
+      case '"': out += "&quot;"; break;
+      case '\'': out += "&#39;"; break;
+      default: out += c; break;
+    }
+  }
+  return out;
+}
+
+String jsonEscape(const String& value) {
+  String out;
+  out.reserve(value.length() + 8);
+  for (size_t i = 0; i < value.length(); ++i) {
+    char c = value.charAt(i);
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (static_cast<uint8_t>(c) < 0x20) {
+      char esc[8];
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+      out += esc;
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+const char* libraryChangeOpName(LibraryChangeOp op) {
+  switch (op) {
+    case LIBRARY_CHANGE_ADD: return "add";
+    case LIBRARY_CHANGE_REMOVE: return "remove";
+  }
+  return "?";
+}
+
+void startJournal(uint32_t baseSeq) {
+  noteStorageRemoved(CATALOG_JOURNAL_PATH, sdFileBytes(CATALOG_JOURNAL_PATH));
+  SD.remove(CATALOG_JOURNAL_PATH);
+  File journal = SD.open(CATALOG_JOURNAL_PATH, FILE_WRITE);
+  if (journal) {
+    noteStorageAdded(CATALOG_JOURNAL_PATH, journal.printf("#base %lu\n", static_cast<unsigned long>(baseSeq)));
+    journal.close();
+  }
+  libraryJournalBaseSeq = baseSeq;
+  journalCheckpoints.clear();
+}
+
+void loadLibraryJournal() {
+  libraryBootId = static_cast<uint32_t>(random(1, 0x7FFFFFFF));
+  journalCheckpoints.clear();
+
+  File journal = SD.open(CATALOG_JOURNAL_PATH, FILE_READ);
+  if (!journal) {
+    startJournal(0);
+    libraryJournalSeq = 0;
+    return;
+  }
+
+  // One sequential read at boot to rebuild the seek checkpoints
+  uint32_t count = 0;
+  while (journal.available()) {
+    uint32_t offset = journal.position();
+    String line = journal.readStringUntil('\n');
+    if (line.startsWith("#base ")) {
+      libraryJournalBaseSeq = line.substring(6).toInt();
+      libraryJournalSeq = libraryJournalBaseSeq;
+      continue;
+    }
+    uint32_t seq = line.toInt();
+    if (seq == 0) {
+      continue;
+    }
+    if (count++ % JOURNAL_CHECKPOINT_EVERY == 0) {
+      journalCheckpoints.push_back({seq, offset});
+    }
+    libraryJournalSeq = seq;
+  }
+  journal.close();
+  Serial.printf("[JRNL] Journal at seq %lu (base %lu, %lu records)\n",
+                static_cast<unsigned long>(libraryJournalSeq),
+                static_cast<unsigned long>(libraryJournalBaseSeq),
+                static_cast<unsigned long>(count));
+}
+
+void recordLibraryChange(LibraryChangeOp op, const String& path) {
+  bumpSectionGeneration(path);
+  if (op == LIBRARY_CHANGE_REMOVE) {
+    dropDownloadStats(path);
+    dropCatalogEntry(path);
+    releaseLibraryPath(path);
+  }
+  if (!sdCardReady) {
+    return;
+  }
+
+  File journal = SD.open(CATALOG_JOURNAL_PATH, FILE_APPEND);
+  if (!journal) {
+    Serial.println("[JRNL][ERROR] Failed to open journal");
+    return;
+  }
+  if (journal.size() > JOURNAL_MAX_BYTES) {
+    journal.close();
+    startJournal(libraryJournalSeq);
+    journal = SD.open(CATALOG_JOURNAL_PATH, FILE_APPEND);
+    if (!journal) {
+      return;
+    }
+  }
+
+  uint32_t seq = ++libraryJournalSeq;
+  uint32_t offset = journal.size();
+  if ((seq - libraryJournalBaseSeq - 1) % JOURNAL_CHECKPOINT_EVERY == 0) {
+    journalCheckpoints.push_back({seq, offset});
+  }
+  size_t written = journal.printf("%lu\t%s\t%s\n", static_cast<unsigned long>(seq), libraryChangeOpName(op), path.c_str());
+  journal.close();
+  noteStorageAdded(CATALOG_JOURNAL_PATH, written);
+}
+
+// ----- File handle cache -----
+
+uint32_t fileCacheAverage(uint32_t average, uint32_t sample) {
+  return average == 0 ? sample : (average * 7 + sample) / 8;
+}
+
+void fileCacheRememberEntry(const String& path, bool exists, size_t size) {
+  for (auto& entry : fileCacheEntries) {
+    if (entry.path == path) {
+      entry.exists = exists;
+      entry.size = size;
+      entry.lastUsed = ++fileCacheClock;
+      return;
+    }
+  }
+  if (fileCacheEntries.size() >= FILE_CACHE_ENTRIES) {
+    auto oldest = std::min_element(fileCacheEntries.begin(), fileCacheEntries.end(),
+                                   [](const CachedEntry& a, const CachedEntry& b) { return a.lastUsed < b.lastUsed; });
+    fileCacheEntries.erase(oldest);
+  }
+  fileCacheEntries.push_back({path, exists, size, ++fileCacheClock});
+}
+
+// exists() without the path walk when the answer is cached; size is set for files that exist
+bool fileCacheStat(const String& path, size_t& size) {
+  for (auto& entry : fileCacheEntries) {
+    if (entry.path == path) {
+      entry.lastUsed = ++fileCacheClock;
+      fileCacheEntryHits++;
+      fileCacheSavedMicros += fileCacheStatMicros;
+      size = entry.size;
+      return entry.exists;
+    }
+  }
+  fileCacheEntryMisses++;
+  unsigned long start = micros();
+  File file = SD.exists(path) ? SD.open(path, FILE_READ) : File();
+  bool exists = static_cast<bool>(file);
+  size = exists ? file.size() : 0;
+  if (file) {
+    file.close();
+  }
+  fileCacheStatMicros = fileCacheAverage(fileCacheStatMicros, micros() - start);
+  fileCacheRememberEntry(path, exists, size);
+  return exists;
+}
+
+// Checks out a read handle positioned at 0. The caller owns it until fileCacheRelease().
+File fileCacheOpen(const String& path, uint32_t& epoch) {
+  epoch = fileCacheEpoch;
+  for (size_t i = 0; i < fileCacheHandles.size(); ++i) {
+    if (fileCacheHandles[i].path == path) {
+      unsigned long start = micros();
+      File file = fileCacheHandles[i].file;
+      fileCacheHandles.erase(fileCacheHandles.begin() + i);
+      file.seek(0);
+      fileCacheHandleHits++;
+      uint32_t spent = micros() - start;
+      fileCacheSavedMicros += fileCacheOpenMicros > spent ? fileCacheOpenMicros - spent : 0;
+      return file;
+    }
+  }
+
+  size_t size;
+  if (!fileCacheStat(path, size)) {
+    return File();  // Known missing: no walk, no "does not exist" log from the VFS
+  }
+  fileCacheHandleMisses++;
+  unsigned long start = micros();
+  File file = SD.open(path, FILE_READ);
+  fileCacheOpenMicros = fileCacheAverage(fileCacheOpenMicros, micros() - start);
+  if (!file) {
+    fileCacheRememberEntry(path, false, 0);
+  }
+  return file;
+}
+
+// Returns a handle to the idle pool, unless something was written since it was checked out
+void fileCacheRelease(const String& path, File file, uint32_t epoch) {
+  if (!file) {
+    return;
+  }
+  if (epoch != fileCacheEpoch) {
+    file.close();
+    return;
+  }
+  if (fileCacheHandles.size() >= FILE_CACHE_HANDLES) {
+    auto oldest = std::min_element(fileCacheHandles.begin(), fileCacheHandles.end(),
+                                   [](const CachedHandle& a, const CachedHandle& b) { return a.lastUsed < b.lastUsed; });
+    oldest->file.close();
+    fileCacheHandles.erase(oldest);
+  }
+  fileCacheHandles.push_back({path, file, ++fileCacheClock});
+}
+
+// Drops anything cached for path or, when path is a directory, anything below it
+void fileCacheInvalidate(const String& path) {
+  fileCacheEpoch++;
+  hotCacheInvalidate(path);
+  String prefix = path.endsWith("/") ? path : path + "/";
+  for (size_t i = 0; i < fileCacheHandles.size();) {
+    const String& cached = fileCacheHandles[i].path;
+    if (cached == path || cached.startsWith(prefix)) {
+      fileCacheHandles[i].file.close();
+      fileCacheHandles.erase(fileCacheHandles.begin() + i);
+    } else {
+      ++i;
+    }
+  }
+  for (size_t i = 0; i < fileCacheEntries.size();) {
+    const String& cached = fileCacheEntries[i].path;
+    if (cached == path || cached.startsWith(prefix)) {
+      fileCacheEntries.erase(fileCacheEntries.begin() + i);
+    } else {
+      ++i;
+    }
+  }
+}
+
+// ----- Download pipeline -----
+
+uint8_t* allocateStreamBuffer(size_t size) {
+  uint8_t* buffer = nullptr;
+#if defined(ARDUINO_ARCH_ESP32)
+  if (psramFound()) {
+    buffer = static_cast<uint8_t*>(ps_malloc(size));
+  }
+#endif
+  if (!buffer) {
+    buffer = static_cast<uint8_t*>(malloc(size));
+  }
+  return buffer;
+}
+
+// Reads a buffer's worth from the pipeline file. The first read is shortened so every later
+// read starts on a buffer-size (cluster) boundary of the file.
+size_t downloadPipelineFill(DownloadPipeline& pipe, int index) {
+  size_t want = std::min(pipe.remaining, pipe.bufferSize - (pipe.file.position() % pipe.bufferSize));
+  size_t got = want > 0 ? pipe.file.read(pipe.buffers[index], want) : 0;
+  pipe.remaining -= std::min(pipe.remaining, got);
+  if (got == 0) {
+    pipe.remaining = 0;
+  }
+  pipe.lengths[index] = got;
+  return got;
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+void downloadReaderTask(void* arg) {
+  DownloadPipeline* pipe = static_cast<DownloadPipeline*>(arg);
+  while (true) {
+    int index;
+    unsigned long waitStart = micros();
+    xQueueReceive(pipe->empty, &index, portMAX_DELAY);
+    pipe->readerWaitUs += micros() - waitStart;
+    if (pipe->stopping || index < 0) {
+      break;
+    }
+    unsigned long readStart = micros();
+    size_t got = downloadPipelineFill(*pipe, index);
+    pipe->readUs += micros() - readStart;
+    xQueueSend(pipe->filled, &index, portMAX_DELAY);
+    if (got == 0) {
+      break;  // The zero-length buffer tells the sender it has everything
+    }
+  }
+  xSemaphoreGive(pipe->readerDone);
+  vTaskDelete(nullptr);
+}
+#endif
+
+bool downloadPipelineBegin(DownloadPipeline& pipe, File file, size_t length, size_t bufferSize, uint8_t depth) {
+  pipe.file = file;
+  pipe.name = file.name();
+  pipe.remaining = length;
+  pipe.bufferSize = bufferSize;
+  pipe.depth = std::max<uint8_t>(depth, 1);
+  pipe.startedAt = millis();
+  pipe.lastProgressAt = pipe.startedAt;
+
+  for (uint8_t i = 0; i < pipe.depth; ++i) {
+    uint8_t* buffer = allocateStreamBuffer(bufferSize);
+    if (!buffer) {
+      break;
+    }
+    pipe.buffers.push_back(buffer);
+    pipe.lengths.push_back(0);
+  }
+  if (pipe.buffers.empty()) {
+    Serial.println("[DL][ERROR] No memory for download buffers");
+    return false;
+  }
+  pipe.depth = pipe.buffers.size();
+
+#if defined(ARDUINO_ARCH_ESP32)
+  // Single buffer means nothing to overlap; read inline instead of paying for a task
+  if (pipe.depth > 1) {
+    pipe.filled = xQueueCreate(pipe.depth + 1, sizeof(int));
+    pipe.empty = xQueueCreate(pipe.depth + 1, sizeof(int));
+    pipe.readerDone = xSemaphoreCreateBinary();
+    if (pipe.filled && pipe.empty && pipe.readerDone) {
+      for (int i = 0; i < pipe.depth; ++i) {
+        xQueueSend(pipe.empty, &i, 0);
+      }
+      if (xTaskCreatePinnedToCore(downloadReaderTask, "dl-reader", 4096, &pipe, 2, nullptr,
+                                  DOWNLOAD_READER_CORE) == pdPASS) {
+        return true;
+      }
+    }
+    Serial.println("[DL] Reader task unavailable, reading inline");
+    if (pipe.filled) vQueueDelete(pipe.filled);
+    if (pipe.empty) vQueueDelete(pipe.empty);
+    if (pipe.readerDone) vSemaphoreDelete(pipe.readerDone);
+    pipe.filled = nullptr;
+    pipe.empty = nullptr;
+    pipe.readerDone = nullptr;
+  }
+#endif
+  return true;
+}
+
+// Takes the next filled buffer; false when none is ready within waitMs
+bool downloadPipelineAcquire(DownloadPipeline& pipe, uint32_t waitMs) {
+#if defined(ARDUINO_ARCH_ESP32)
+  if (pipe.filled) {
+    int index;
+    unsigned long waitStart = micros();
+    bool ready = xQueueReceive(pipe.filled, &index, pdMS_TO_TICKS(waitMs)) == pdTRUE;
+    pipe.senderWaitUs += micros() - waitStart;
+    if (!ready) {
+      return false;
+    }
+    pipe.current = index;
+    pipe.currentOffset = 0;
+    return true;
+  }
+#endif
+  (void)waitMs;
+  downloadPipelineFill(pipe, 0);
+  pipe.current = 0;
+  pipe.currentOffset = 0;
+  return true;
+}
+
+void downloadPipelineRelease(DownloadPipeline& pipe) {
+#if defined(ARDUINO_ARCH_ESP32)
+  if (pipe.empty) {
+    xQueueSend(pipe.empty, &pipe.current, portMAX_DELAY);
+  }
+#endif
+  pipe.current = -1;
+}
+
+// Writes what the socket accepts right now; 0 when its send buffer is full, -1 once the peer is gone
+int socketWriteNonBlocking(WiFiClient& client, const uint8_t* data, size_t length) {
+#if defined(ARDUINO_ARCH_ESP32)
+  int fd = client.fd();
+  if (fd < 0) {
+    return -1;
+  }
+  int written = send(fd, data, length, MSG_DONTWAIT);
+  if (written < 0) {
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  }
+  return written;
+#else
+  if (!client.connected()) {
+    return -1;
+  }
+  size_t room = client.availableForWrite();
+  return room > 0 ? client.write(data, std::min(room, length)) : 0;
+#endif
+}
+
+// Sends up to maxBytes from the read-ahead ring without blocking on the socket; returns bytes sent
+size_t downloadPipelineSend(DownloadPipeline& pipe, WiFiClient& client, size_t maxBytes, uint32_t waitMs) {
+  size_t total = 0;
+  while (total < maxBytes && !pipe.eof && !pipe.failed) {
+    if (pipe.current < 0 && !downloadPipelineAcquire(pipe, waitMs)) {
+      if (millis() - pipe.lastProgressAt > DOWNLOAD_STALL_TIMEOUT_MS) {
+        pipe.failed = true;
+      }
+      break;
+    }
+    size_t length = pipe.lengths[pipe.current];
+    if (length == 0) {
+      pipe.eof = true;
+      downloadPipelineRelease(pipe);
+      break;
+    }
+    size_t chunk = std::min(length - pipe.currentOffset, maxBytes - total);
+    int written = socketWriteNonBlocking(client, pipe.buffers[pipe.current] + pipe.currentOffset, chunk);
+    if (written <= 0) {
+      if (written < 0 || millis() - pipe.lastProgressAt > DOWNLOAD_STALL_TIMEOUT_MS) {
+        pipe.failed = true;
+      }
+      break;
+    }
+    pipe.lastProgressAt = millis();
+    if (pipe.trackCrc) {
+      pipe.crc = crc32Update(pipe.crc, pipe.buffers[pipe.current] + pipe.currentOffset, written);
+    }
+    if (pipe.fill && pipe.sent + written <= pipe.fillSize) {
+      memcpy(pipe.fill + pipe.sent, pipe.buffers[pipe.current] + pipe.currentOffset, written);
+    }
+    pipe.currentOffset += written;
+    pipe.sent += written;
+    total += written;
+    if (pipe.currentOffset >= length) {
+      downloadPipelineRelease(pipe);
+    }
+  }
+  return total;
+}
+
+void downloadPipelineEnd(DownloadPipeline& pipe) {
+#if defined(ARDUINO_ARCH_ESP32)
+  if (pipe.readerDone) {
+    // Wake the reader if it is parked on the empty queue, then wait for it to let go of the buffers
+    pipe.stopping = true;
+    int wake = -1;
+    xQueueSend(pipe.empty, &wake, 0);
+    xSemaphoreTake(pipe.readerDone, portMAX_DELAY);
+    vQueueDelete(pipe.filled);
+    vQueueDelete(pipe.empty);
+    vSemaphoreDelete(pipe.readerDone);
+    pipe.filled = nullptr;
+    pipe.empty = nullptr;
+    pipe.readerDone = nullptr;
+  }
+#endif
+  for (uint8_t* buffer : pipe.buffers) {
+    free(buffer);
+  }
+  pipe.buffers.clear();
+  pipe.lengths.clear();
+  if (pipe.fill) {
+    hotCacheReleaseFill(pipe.fillSize);
+    // Only a complete copy of a file nobody wrote to meanwhile goes into the hot cache
+    if (pipe.eof && pipe.sent == pipe.fillSize && pipe.cacheEpoch == fileCacheEpoch) {
+      hotCacheInsert(pipe.cachePath, pipe.fill, pipe.fillSize);
+    } else {
+      free(pipe.fill);
+    }
+    pipe.fill = nullptr;
+  }
+  if (pipe.cachePath.length() > 0 && pipe.eof) {
+    fileCacheRelease(pipe.cachePath, pipe.file, pipe.cacheEpoch);
+  } else {
+    pipe.file.close();
+  }
+
+  if (pipe.quiet) {
+    return;
+  }
+  unsigned long elapsed = std::max(1UL, millis() - pipe.startedAt);
+  downloadBytesTotal += pipe.sent;
+  if (pipe.eof) {
+    downloadsCompleted++;
+  } else {
+    downloadsFailed++;
+  }
+#if defined(ARDUINO_ARCH_ESP32)
+  Serial.printf("[DL] %s: %u bytes in %lu ms (%.2f MB/s, %ux%u KB, sd %lu ms, waited on sd %lu ms, on socket %lu ms)%s\n",
+                pipe.name.c_str(), static_cast<unsigned int>(pipe.sent), elapsed,
+                pipe.sent / 1048.576 / elapsed, pipe.depth, static_cast<unsigned int>(pipe.bufferSize / 1024),
+                static_cast<unsigned long>(pipe.readUs / 1000), static_cast<unsigned long>(pipe.senderWaitUs / 1000),
+                static_cast<unsigned long>(pipe.readerWaitUs / 1000), pipe.eof ? "" : " [aborted]");
+#else
+  Serial.printf("[DL] %s: %u bytes in %lu ms (%.2f MB/s)%s\n", pipe.name.c_str(),
+                static_cast<unsigned int>(pipe.sent), elapsed, pipe.sent / 1048.576 / elapsed,
+                pipe.eof ? "" : " [aborted]");
+#endif
+}
+
+// ----- Upload write-behind -----
+
+void uploadWriterBegin(UploadWriter& writer, size_t capacity) {
+  free(writer.data);
+  writer = UploadWriter();
+  writer.startedAt = millis();
+  if (capacity > 0) {
+    writer.data = allocateStreamBuffer(capacity);
+    writer.capacity = writer.data ? capacity : 0;
+  }
+}
+
+// Clusters a write took from the card, beyond what preallocation already reserved
+void uploadWriterAccount(const UploadWriter& writer, size_t before, size_t after) {
+  noteClustersResized(std::max(writer.preallocated, writer.startOffset + before),
+                      std::max(writer.preallocated, writer.startOffset + after));
+}
+
+bool uploadWriterFlush(UploadWriter& writer, File& file) {
+  if (writer.used == 0 || writer.failed) {
+    return !writer.failed;
+  }
+  unsigned long start = micros();
+  size_t written = file.write(writer.data, writer.used);
+  writer.writeMicros += micros() - start;
+  writer.writes++;
+  uploadWriterAccount(writer, writer.written, writer.written + written);
+  writer.written += written;
+  if (written != writer.used) {
+    Serial.printf("[UPLOAD][ERROR] Short write: %u of %u bytes\n", static_cast<unsigned int>(written),
+                  static_cast<unsigned int>(writer.used));
+    writer.failed = true;
+  }
+  writer.used = 0;
+  return !writer.failed;
+}
+
+// Blocks end on multiples of `capacity` in the file, so every flush after the first is cluster
+// aligned even when a resumed upload starts mid-cluster
+bool uploadWriterAppend(UploadWriter& writer, File& file, const uint8_t* data, size_t length) {
+  unsigned long crcStart = micros();
+  writer.crc = crc32Update(writer.crc, data, length);
+  writer.crcMicros += micros() - crcStart;
+  if (writer.capacity == 0) {
+    unsigned long start = micros();
+    size_t written = file.write(data, length);
+    writer.writeMicros += micros() - start;
+    writer.writes++;
+    uploadWriterAccount(writer, writer.written, writer.written + written);
+    writer.written += written;
+    writer.failed = writer.failed || written != length;
+    return !writer.failed;
+  }
+  while (length > 0 && !writer.failed) {
+    size_t position = writer.startOffset + writer.written + writer.used;
+    size_t chunk = std::min(length, writer.capacity - position % writer.capacity);
+    memcpy(writer.data + writer.used, data, chunk);
+    writer.used += chunk;
+    data += chunk;
+    length -= chunk;
+    if ((position + chunk) % writer.capacity == 0) {
+      uploadWriterFlush(writer, file);
+    }
+  }
+  return !writer.failed;
+}
+
+// Reserves the whole cluster chain in one go by seeking to the announced end and writing a byte.
+// FatFs allocates the chain in a single pass from its free-cluster hint, so on a card with free
+// space the chain comes out contiguous and later appends never touch the FAT.
+bool uploadPreallocate(UploadWriter& writer, File& file, size_t size) {
+#if defined(ARDUINO_ARCH_ESP32)
+  if (size == 0 || (freeSpace.known && size >= sdFreeBytes())) {
+    return false;
+  }
+  unsigned long start = micros();
+  uint8_t zero = 0;
+  bool ok = file.seek(size - 1) && file.write(&zero, 1) == 1;
+  file.flush();
+  file.seek(0);
+  if (!ok || file.size() != size) {
+    Serial.printf("[UPLOAD] Preallocation of %u bytes failed; growing on demand\n", static_cast<unsigned int>(size));
+    writer.preallocated = file.size();
+    noteClustersResized(0, writer.preallocated);
+    return false;
+  }
+  writer.preallocated = size;
+  noteClustersResized(0, size);
+  Serial.printf("[UPLOAD] Preallocated %u bytes in %lu us\n", static_cast<unsigned int>(size), micros() - start);
+  return true;
+#else
+  (void)writer;
+  (void)file;
+  (void)size;
+  return false;  // ESP8266 SdFat can't seek past the end; keep growing cluster by cluster
+#endif
+}
+
+// Cuts a closed file back to length (the client announced more than it sent)
+bool truncateSdFile(const String& path, size_t length) {
+#if defined(ARDUINO_ARCH_ESP32)
+  return truncate((String(SD_MOUNT_POINT) + path).c_str(), length) == 0;
+#else
+  (void)path;
+  (void)length;
+  return false;
+#endif
+}
+
+// Releases the buffer; pending bytes are dropped, so flush first on success
+void uploadWriterEnd(UploadWriter& writer) {
+  uploadCrcBytes += writer.written + writer.used;
+  uploadCrcMicros += writer.crcMicros;
+  writer.crcMicros = 0;
+  free(writer.data);
+  writer.data = nullptr;
+  writer.capacity = 0;
+  writer.used = 0;
+}
+
+// True while a request body is being written to the card
+bool uploadInProgress() {
+  return uploadRequest && uploadRequest->file;
+}
+
+// Also true while a session holds a writer slot it has used recently: its next chunk may be
+// on the way. For jobs that must not share the card with uploads.
+bool uploadsActive() {
+  if (uploadInProgress()) {
+    return true;
+  }
+  unsigned long now = millis();
+  for (const auto& entry : uploadSessions) {
+    if (entry.second.writing && now - entry.second.touchedAt <= UPLOAD_SLOT_IDLE_MS) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Starts holding back the first bytes of a body for a type check; types without a rule skip it
+void uploadSniffBegin(UploadContext& ctx, const String& name) {
+  const FileType* type = fileTypeFor(name);
+  ctx.sniffType = type && type->sniff != SNIFF_NONE ? type : nullptr;
+  ctx.sniffed = 0;
+}
+
+// Copies body bytes into the hold until it is full. Returns how many were taken; the rest
+// belong after the held block.
+size_t uploadSniffHold(UploadContext& ctx, const uint8_t* data, size_t length) {
+  size_t take = std::min(length, UPLOAD_SNIFF_BYTES - ctx.sniffed);
+  memcpy(ctx.sniff + ctx.sniffed, data, take);
+  ctx.sniffed += take;
+  return take;
+}
+
+// Checks the held bytes against the registry and ends the hold. On a match the caller writes
+// ctx.sniff out ahead of the rest of the body; on a mismatch nothing has touched the card.
+bool uploadSniffCheck(UploadContext& ctx, const String& name) {
+  const FileType* type = ctx.sniffType;
+  ctx.sniffType = nullptr;
+  if (fileContentMatches(*type, ctx.sniff, ctx.sniffed)) {
+    return true;
+  }
+  uploadsSniffRejected++;
+  Serial.printf("[UPLOAD] Rejected %s: content is not %s (starts %02x %02x %02x %02x)\n", name.c_str(), type->ext,
+                ctx.sniffed > 0 ? ctx.sniff[0] : 0, ctx.sniffed > 1 ? ctx.sniff[1] : 0,
+                ctx.sniffed > 2 ? ctx.sniff[2] : 0, ctx.sniffed > 3 ? ctx.sniff[3] : 0);
+  return false;
+}
+
+// ----- Upload temp files -----
+
+// In-progress multipart uploads stream into ".<name>.tmp" beside their destination. The dot
+// and the extension keep them out of listings and library scans until the commit rename.
+String uploadTempPath(const String& sdPath) {
+  int slash = sdPath.lastIndexOf('/');
+  return sdPath.substring(0, slash + 1) + "." + sdPath.substring(slash + 1) + ".tmp";
+}
+
+// Where commitUpload parks the book it replaces until the new copy is in place
+String uploadBackupPath(const String& sdPath) {
+  int slash = sdPath.lastIndexOf('/');
+  return sdPath.substring(0, slash + 1) + "." + sdPath.substring(slash + 1) + ".old";
+}
+
+bool isUploadTempName(const String& name) {
+  return name.startsWith(".") && name.endsWith(".tmp");
+}
+
+// Deletes temp files a reboot stranded mid-write: upload bodies and gzip sidecars in the
+// library tree, and session sidecars caught between write and rename. A book commitUpload had
+// moved aside goes back unless its replacement made it into place.
+void sweepUploadTemps() {
+  unsigned long start = millis();
+  std::vector<String> stale;
+  std::vector<String> sidecars;
+  std::vector<String> backups;
+  LibraryScanCursor cursor;
+  cursor.allFiles = true;
+  if (libraryScanBegin(cursor, "/Alexandria")) {
+    LibraryFileEntry entry;
+    LibraryScanResult result;
+    while ((result = libraryScanStep(cursor, entry)) != LIBRARY_SCAN_DONE) {
+      if (result != LIBRARY_SCAN_FILE) {
+        continue;
+      }
+      String name = entry.sdPath.substring(entry.sdPath.lastIndexOf('/') + 1);
+      if (isUploadTempName(name) || name.endsWith(".gz.tmp")) {
+        stale.push_back(entry.sdPath);
+      } else if (name.startsWith(".") && name.endsWith(".old")) {
+        backups.push_back(entry.sdPath);
+      }
+    }
+    libraryScanEnd(cursor);
+  }
+  if (libraryScanBegin(cursor, UPLOAD_SESSION_DIR)) {
+    LibraryFileEntry entry;
+    LibraryScanResult result;
+    while ((result = libraryScanStep(cursor, entry)) != LIBRARY_SCAN_DONE) {
+      if (result == LIBRARY_SCAN_FILE && entry.sdPath.endsWith(".meta.tmp")) {
+        sidecars.push_back(entry.sdPath);
+      }
+    }
+    libraryScanEnd(cursor);
+  }
+  // Directories are only changed once their scan is over
+  for (const String& path : sidecars) {
+    // Without its .meta the temp is the newer, complete copy (see writeUploadSessionMeta)
+    String metaPath = path.substring(0, path.length() - 4);
+    if (SD.exists(metaPath) || !SD.rename(path, metaPath)) {
+      stale.push_back(path);
+    }
+  }
+  for (const String& path : backups) {
+    int slash = path.lastIndexOf('/');
+    String bookPath = path.substring(0, slash + 1) + path.substring(slash + 2, path.length() - 4);
+    if (SD.exists(bookPath) || !SD.rename(path, bookPath)) {
+      stale.push_back(path);
+    } else {
+      Serial.println("[UPLOAD] Restored " + bookPath + " from an interrupted replace");
+    }
+  }
+  for (const String& path : stale) {
+    SD.remove(path);
+  }
+  Serial.printf("[UPLOAD] Swept %u stale temp files in %lu ms\n", static_cast<unsigned int>(stale.size()),
+                millis() - start);
+}
+
+// ----- Resumable upload sessions -----
+
+String uploadSessionPath(const String& id, const char* suffix) {
+  return String(UPLOAD_SESSION_DIR) + "/" + id + suffix;
+}
+
+// Length of the part file on the card; all of it when the part was preallocated
+size_t uploadSessionPartBytes(const String& id) {
+  File part = SD.open(uploadSessionPath(id, ".part"), FILE_READ);
+  if (!part) {
+    return 0;
+  }
+  size_t size = part.size();
+  part.close();
+  return size;
+}
+
+void dropUploadSession(const String& id) {
+  size_t partSize = uploadSessionPartBytes(id);
+  if (SD.remove(uploadSessionPath(id, ".part"))) {
+    noteClustersResized(partSize, 0);
+  }
+  SD.remove(uploadSessionPath(id, ".meta"));
+  SD.remove(uploadSessionPath(id, ".meta.tmp"));
+  uploadSessions.erase(id);
+}
+
+// Rebuilds the session table from the sidecars; parts without a sidecar can't be finalized
+void loadUploadSessions() {
+  uploadSessions.clear();
+  File dir = SD.open(UPLOAD_SESSION_DIR);
+  if (!dir) {
+    return;
+  }
+  std::vector<String> orphans;
+  while (true) {
+    File entry = dir.openNextFile();
+    if (!entry) {
+      break;
+    }
+    String name = entry.name();
+    entry.close();
+    if (name.endsWith(".part")) {
+      String id = name.substring(0, name.length() - 5);
+      if (!SD.exists(uploadSessionPath(id, ".meta"))) {
+        orphans.push_back(id);
+      }
+      continue;
+    }
+    if (!name.endsWith(".meta")) {
+      continue;
+    }
+    String id = name.substring(0, name.length() - 5);
+    File meta = SD.open(uploadSessionPath(id, ".meta"), FILE_READ);
+    String line = meta ? meta.readStringUntil('\n') : String();
+    if (meta) {
+      meta.close();
+    }
+    int tab1 = line.indexOf('\t');
+    int tab2 = tab1 > 0 ? line.indexOf('\t', tab1 + 1) : -1;
+    int tab3 = tab2 > 0 ? line.indexOf('\t', tab2 + 1) : -1;
+    int tab4 = tab3 > 0 ? line.indexOf('\t', tab3 + 1) : -1;
+    if (tab4 < 0) {
+      orphans.push_back(id);
+      continue;
+    }
+    UploadSession session;
+    session.name = line.substring(0, tab1);
+    session.size = strtoul(line.substring(tab1 + 1, tab2).c_str(), nullptr, 10);
+    String digest = line.substring(tab2 + 1, tab3);
+    session.hasDigest = digest != "-";
+    session.digest = strtoul(digest.c_str(), nullptr, 16);
+    session.crcBytes = strtoul(line.substring(tab3 + 1, tab4).c_str(), nullptr, 10);
+    session.crc = strtoul(line.substring(tab4 + 1).c_str(), nullptr, 16);
+    session.touchedAt = millis();  // The idle clock restarts with the boot
+    session.ticket = ++uploadSessionTickets;
+
+    // Bytes flushed after the last sidecar write aren't covered by its CRC; cut them off and
+    // let the client send them again. A preallocated part keeps its length and is overwritten.
+    size_t partSize = uploadSessionPartBytes(id);
+    session.preallocated = partSize == session.size;
+    if (partSize < session.crcBytes ||
+        (partSize > session.crcBytes && !session.preallocated &&
+         !truncateSdFile(uploadSessionPath(id, ".part"), session.crcBytes))) {
+      orphans.push_back(id);
+      continue;
+    }
+    uploadSessions[id] = session;
+  }
+  dir.close();
+
+  for (const String& id : orphans) {
+    dropUploadSession(id);
+  }
+  Serial.printf("[UPLOAD] Resumable sessions on card: %u\n", static_cast<unsigned int>(uploadSessions.size()));
+}
+
+// Expires idle sessions, then makes room for one more by dropping the least recently used one,
+// but only if it has been silent longer than a writer may be. False when every session is still
+// in use: an uploader picking more files than there are sessions waits instead of evicting its own.
+bool trimUploadSessions() {
+  unsigned long now = millis();
+  for (auto it = uploadSessions.begin(); it != uploadSessions.end();) {
+    String id = it->first;
+    bool idle = now - it->second.touchedAt > UPLOAD_SESSION_IDLE_MS;
+    ++it;
+    if (idle) {
+      Serial.println("[UPLOAD] Session expired: " + id);
+      dropUploadSession(id);
+    }
+  }
+  while (uploadSessions.size() >= UPLOAD_SESSION_MAX) {
+    auto oldest = uploadSessions.begin();
+    for (auto it = uploadSessions.begin(); it != uploadSessions.end(); ++it) {
+      if (now - it->second.touchedAt > now - oldest->second.touchedAt) {
+        oldest = it;
+      }
+    }
+    if (now - oldest->second.touchedAt <= UPLOAD_SLOT_IDLE_MS) {
+      return false;
+    }
+    Serial.println("[UPLOAD] Session evicted: " + oldest->first);
+    dropUploadSession(oldest->first);
+  }
+  return true;
+}
+
+// Replaces the sidecar through a temp file so a power cut leaves one version or the other
+bool writeUploadSessionMeta(const String& id, const UploadSession& session) {
+  String metaPath = uploadSessionPath(id, ".meta");
+  String tempPath = metaPath + ".tmp";
+  File meta = SD.open(tempPath, FILE_WRITE);
+  if (!meta) {
+    return false;
+  }
+  bool ok = meta.print(session.name + "\t" + String(static_cast<unsigned long>(session.size)) + "\t" +
+                       (session.hasDigest ? String(session.digest, HEX) : String("-")) + "\t" +
+                       String(static_cast<unsigned long>(session.crcBytes)) + "\t" + String(session.crc, HEX) +
+                       "\n") > 0;
+  meta.close();
+  SD.remove(metaPath);
+  return ok && SD.rename(tempPath, metaPath);
+}
+
+// Keeps at most uploadWriterSlots sessions writing; the rest wait in ticket order. A writer
+// that has gone quiet gives its slot up and rejoins the back of the line.
+void admitUploadSessions() {
+  unsigned long now = millis();
+  uint8_t writing = 0;
+  for (auto& entry : uploadSessions) {
+    UploadSession& session = entry.second;
+    if (session.writing && now - session.touchedAt > UPLOAD_SLOT_IDLE_MS) {
+      session.writing = false;
+      session.ticket = ++uploadSessionTickets;
+    }
+    writing += session.writing ? 1 : 0;
+  }
+  while (writing < uploadWriterSlots) {
+    UploadSession* next = nullptr;
+    for (auto& entry : uploadSessions) {
+      if (!entry.second.writing && (!next || entry.second.ticket < next->ticket)) {
+        next = &entry.second;
+      }
+    }
+    if (!next) {
+      break;
+    }
+    next->writing = true;
+    next->touchedAt = now;
+    writing++;
+  }
+}
+
+// 0 for a session holding a writer slot, otherwise its place in line starting at 1
+size_t uploadQueuePosition(const UploadSession& session) {
+  if (session.writing) {
+    return 0;
+  }
+  size_t position = 1;
+  for (const auto& entry : uploadSessions) {
+    if (!entry.second.writing && entry.second.ticket < session.ticket) {
+      position++;
+    }
+  }
+  return position;
+}
+
+// Whether an upload of this size fits beside what the open sessions still have to send, with
+// a little kept back for catalog writes. Always true until the first free-space count is in.
+bool uploadFits(uint64_t size) {
+  if (!freeSpace.known) {
+    return true;
+  }
+  uint64_t needed = clustersFor(size) + clustersFor(FREE_SPACE_RESERVE_BYTES);
+  for (const auto& entry : uploadSessions) {
+    if (!entry.second.preallocated) {
+      needed += clustersFor(entry.second.size) - clustersFor(entry.second.crcBytes);
+    }
+  }
+  return needed <= freeSpace.freeClusters;
+}
+
+// Returns the new session id, or "" when the card refused the files
+String createUploadSession(const String& name, size_t size, bool hasDigest, uint32_t digest) {
+  if (!SD.exists(UPLOAD_SESSION_DIR) && !SD.mkdir(UPLOAD_SESSION_DIR)) {
+    return "";
+  }
+
+  String id;
+  do {
+    id = String(static_cast<uint32_t>(random(0x10000000, 0x7FFFFFFF)), HEX);
+  } while (uploadSessions.count(id) > 0);
+
+  UploadSession session;
+  session.name = name;
+  session.size = size;
+  session.touchedAt = millis();
+  session.hasDigest = hasDigest;
+  session.digest = digest;
+  session.ticket = ++uploadSessionTickets;
+
+  // The size is known up front, so the whole chain is reserved now and the chunks fill it in
+  String partPath = uploadSessionPath(id, ".part");
+  File part = SD.open(partPath, FILE_WRITE);
+  UploadWriter reserve;
+  session.preallocated = part && uploadPreallocate(reserve, part, size);
+  bool ok = part && writeUploadSessionMeta(id, session);
+  if (part) {
+    part.close();
+  }
+  if (ok && !session.preallocated && reserve.preallocated > 0) {
+    // A partial reservation would look like unacknowledged bytes; start from an empty part
+    ok = truncateSdFile(partPath, 0);
+    if (ok) {
+      noteClustersResized(reserve.preallocated, 0);
+    }
+  }
+  if (!ok) {
+    dropUploadSession(id);
+    return "";
+  }
+  uploadSessions[id] = session;
+  Serial.printf("[UPLOAD] Session %s: %s (%u bytes)\n", id.c_str(), name.c_str(), static_cast<unsigned int>(size));
+  return id;
+}
+
+// ----- Upload integrity -----
+
+// Moves a file that failed its check out of the library tree, keeping it for inspection.
+// True when it had to be deleted instead, i.e. its bytes left the card.
+bool quarantineUpload(const String& sdPath, const String& name) {
+  fileCacheInvalidate(sdPath);
+  String target = String(UPLOAD_QUARANTINE_DIR) + "/" +
+                  (isSafeUploadName(name) ? name : "upload-" + String(static_cast<unsigned long>(millis())));
+  if ((SD.exists(UPLOAD_QUARANTINE_DIR) || SD.mkdir(UPLOAD_QUARANTINE_DIR)) &&
+      (!SD.exists(target) || SD.remove(target)) && SD.rename(sdPath, target)) {
+    Serial.println("[UPLOAD][WARN] Quarantined " + sdPath + " as " + target);
+    uploadsQuarantined++;
+    return false;
+  }
+  File doomed = SD.open(sdPath, FILE_READ);
+  size_t size = doomed ? doomed.size() : 0;
+  if (doomed) {
+    doomed.close();
+  }
+  bool deleted = SD.remove(sdPath);  // Never leave it where it would be served
+  if (deleted) {
+    noteClustersResized(size, 0);
+  }
+  Serial.println("[UPLOAD][WARN] Could not quarantine " + sdPath + "; deleted");
+  uploadsQuarantined++;
+  return deleted;
+}
+
+void endUploadVerify(UploadVerifyJob& job) {
+  if (job.file) {
+    job.file.close();
+  }
+  free(job.block);
+  job.block = nullptr;
+  job.done = 0;
+  job.crc = 0;
+}
+
+// A book replaced or deleted before its read-back must not be checked against the old CRC
+void cancelUploadVerify(const String& publicPath) {
+  UploadVerifyJob& job = uploadVerifyJob;
+  for (size_t i = job.queue.size(); i-- > 0;) {
+    if (job.queue[i].path == publicPath) {
+      if (i == 0) {
+        endUploadVerify(job);
+      }
+      job.queue.erase(job.queue.begin() + i);
+    }
+  }
+}
+
+void queueUploadVerify(const String& publicPath, size_t size, uint32_t crc) {
+  if (!uploadReadBack) {
+    return;
+  }
+  cancelUploadVerify(publicPath);
+  UploadVerify item;
+  item.path = publicPath;
+  item.size = size;
+  item.crc = crc;
+  uploadVerifyJob.queue.push_back(item);
+}
+
+// Re-reads the oldest unverified upload in bounded slices, at the same idle priority as gzip
+void processUploadVerify() {
+  UploadVerifyJob& job = uploadVerifyJob;
+  if (job.queue.empty() || !sdCardReady || !activeDownloads.empty() || uploadInProgress()) {
+    return;
+  }
+  UploadVerify item = job.queue.front();
+  if (!job.file) {
+    job.sdPath = libraryPhysicalPath(item.path);
+    job.file = SD.open(job.sdPath, FILE_READ);
+    job.block = job.file ? allocateStreamBuffer(UPLOAD_VERIFY_BLOCK) : nullptr;
+    if (!job.file || !job.block || job.file.size() != item.size) {
+      endUploadVerify(job);  // Gone or rewritten since it was queued
+      job.queue.erase(job.queue.begin());
+      return;
+    }
+  }
+
+  unsigned long start = micros();
+  size_t before = job.done;
+  bool readError = false;
+  while (job.done < item.size && micros() - start < UPLOAD_VERIFY_BUDGET_US) {
+    size_t got = job.file.read(job.block, std::min(UPLOAD_VERIFY_BLOCK, item.size - job.done));
+    if (got == 0) {
+      readError = true;
+      break;
+    }
+    job.crc = crc32Update(job.crc, job.block, got);
+    job.done += got;
+  }
+  uploadVerifyMicros += micros() - start;
+  uploadVerifyBytes += job.done - before;
+  if (job.done < item.size && !readError) {
+    return;
+  }
+
+  uint32_t crc = job.crc;
+  String sdPath = job.sdPath;
+  endUploadVerify(job);
+  job.queue.erase(job.queue.begin());
+  if (!readError && crc == item.crc) {
+    uploadVerifyPassed++;
+    Serial.println("[UPLOAD] Read-back verified: " + sdPath);
+    return;
+  }
+
+  uploadVerifyFailed++;
+  Serial.printf("[UPLOAD][ERROR] Read-back of %s: crc %08lx, uploaded %08lx%s\n", sdPath.c_str(),
+                static_cast<unsigned long>(crc), static_cast<unsigned long>(item.crc), readError ? " (read error)" : "");
+  dropGzipSidecar(item.path);
+  dropPageIndex(item.path);
+  if (quarantineUpload(sdPath, item.path.substring(item.path.lastIndexOf('/') + 1))) {
+    noteStorageRemoved(item.path, item.size);
+  } else {
+    // Out of the library but still on the card under /quarantine
+    if (libraryFileCount > 0) {
+      libraryFileCount--;
+    }
+    libraryTotalBytes -= std::min(libraryTotalBytes, static_cast<uint64_t>(item.size));
+  }
+  recordLibraryChange(LIBRARY_CHANGE_REMOVE, item.path);
+}
+
+// ----- Download statistics -----
+
+void loadDownloadStats() {
+  downloadStats.clear();
+  restoreSdTable(CATALOG_STATS_PATH);
+  File file = SD.open(CATALOG_STATS_PATH, FILE_READ);
+  if (!file) {
+    return;
+  }
+  while (file.available()) {
+    String line = file.readStringUntil('\n');
+    int tab1 = line.indexOf('\t');
+    int tab2 = tab1 >= 0 ? line.indexOf('\t', tab1 + 1) : -1;
+    int tab3 = tab2 >= 0 ? line.indexOf('\t', tab2 + 1) : -1;
+    if (tab3 < 0) {
+      continue;
+    }
+    DownloadStat stat;
+    stat.starts = line.substring(tab1 + 1, tab2).toInt();
+    stat.completes = line.substring(tab2 + 1, tab3).toInt();
+    stat.bytes = strtoull(line.substring(tab3 + 1).c_str(), nullptr, 10);
+    downloadStats[line.substring(0, tab1)] = stat;
+  }
+  file.close();
+
+  // Yesterday's favourites start out warm in the hot-cache admission sketch
+  for (const auto& stat : downloadStats) {
+    String sdPath = libraryPhysicalPath(stat.first);
+    for (uint32_t i = 0; i < std::min<uint32_t>(stat.second.completes, STATS_SEED_MAX); ++i) {
+      hotCacheTouch(sdPath);
+    }
+  }
+  Serial.printf("[STATS] Loaded counters for %u books\n", static_cast<unsigned int>(downloadStats.size()));
+}
+
+// Rewrites the whole table through a temp file; replaceSdTable keeps the old one until the new
+// one is in place, and loadDownloadStats restores whichever survived a power cut
+void flushDownloadStats() {
+  if (!downloadStatsDirty || !sdCardReady) {
+    return;
+  }
+  String tempPath = String(CATALOG_STATS_PATH) + ".tmp";
+  File file = SD.open(tempPath.c_str(), FILE_WRITE);
+  if (!file) {
+    Serial.println("[STATS][ERROR] Cannot write " + tempPath);
+    return;
+  }
+  for (const auto& stat : downloadStats) {
+    file.print(stat.first + "\t" + String(static_cast<unsigned long>(stat.second.starts)) + "\t" +
+               String(static_cast<unsigned long>(stat.second.completes)) + "\t" +
+               String(static_cast<unsigned long long>(stat.second.bytes)) + "\n");
+  }
+  size_t written = file.size();
+  file.close();
+  if (!replaceSdTable(CATALOG_STATS_PATH, written)) {
+    Serial.println("[STATS][ERROR] Cannot replace " + String(CATALOG_STATS_PATH));
+    return;
+  }
+  downloadStatsDirty = false;
+  downloadStatsFlushedAt = millis();
+  downloadStatsFlushes++;
+}
+
+void noteDownloadStart(const String& publicPath) {
+  uint32_t start = ESP.getCycleCount();
+  downloadStats[publicPath].starts++;
+  downloadStatsDirty = true;
+  downloadStatsCycles += ESP.getCycleCount() - start;
+  downloadStatsUpdates++;
+}
+
+void noteDownloadFinish(const String& publicPath, size_t bytes, bool complete) {
+  uint32_t start = ESP.getCycleCount();
+  auto stat = downloadStats.find(publicPath);
+  if (stat != downloadStats.end()) {
+    stat->second.bytes += bytes;
+    if (complete) {
+      stat->second.completes++;
+    }
+    downloadStatsDirty = true;
+  }
+  downloadStatsCycles += ESP.getCycleCount() - start;
+  downloadStatsUpdates++;
+}
+
+// Drops the counters of a book that is gone
+void dropDownloadStats(const String& path) {
+  if (downloadStats.erase(path) > 0) {
+    downloadStatsDirty = true;
+  }
+}
+
+void processDownloadStats() {
+  if (downloadStatsDirty && !uploadInProgress() && millis() - downloadStatsFlushedAt >= STATS_FLUSH_INTERVAL_MS) {
+    flushDownloadStats();
+  }
+}
+
+// ----- Hot-object cache -----
+
+uint16_t hotSketchSlot(const String& path, uint8_t row) {
+  uint32_t hash = 2166136261UL ^ (row * 0x9E3779B9UL);
+  for (size_t i = 0; i < path.length(); ++i) {
+    hash ^= static_cast<uint8_t>(path.charAt(i));
+    hash *= 16777619UL;
+  }
+  return (hash ^ (hash >> 16)) % HOT_SKETCH_WIDTH;
+}
+
+uint8_t hotFrequency(const String& path) {
+  uint8_t frequency = 255;
+  for (uint8_t row = 0; row < HOT_SKETCH_ROWS; ++row) {
+    frequency = std::min(frequency, hotSketch[row][hotSketchSlot(path, row)]);
+  }
+  return frequency;
+}
+
+// Counts a request; counters are halved periodically so old popularity fades
+void hotCacheTouch(const String& path) {
+  for (uint8_t row = 0; row < HOT_SKETCH_ROWS; ++row) {
+    uint8_t& counter = hotSketch[row][hotSketchSlot(path, row)];
+    if (counter < 255) {
+      counter++;
+    }
+  }
+  if (++hotSketchSamples >= HOT_SKETCH_AGE_EVERY) {
+    hotSketchSamples = 0;
+    for (uint8_t row = 0; row < HOT_SKETCH_ROWS; ++row) {
+      for (uint16_t i = 0; i < HOT_SKETCH_WIDTH; ++i) {
+        hotSketch[row][i] >>= 1;
+      }
+    }
+  }
+}
+
+std::shared_ptr<HotObject> hotCacheLookup(const String& path) {
+  hotCacheTouch(path);
+  for (auto& entry : hotCacheEntries) {
+    if (entry.path == path) {
+      entry.lastUsed = ++hotCacheClock;
+      hotCacheHits++;
+      return entry.object;
+    }
+  }
+  if (hotCacheCapacity > 0) {
+    hotCacheMisses++;
+  }
+  return nullptr;
+}
+
+// Picks LRU victims to make room for size bytes; false if any of them is at least as popular
+bool hotCacheVictims(const String& path, size_t size, std::vector<size_t>& victims) {
+  if (hotCacheCapacity == 0 || size == 0 || size > HOT_CACHE_MAX_OBJECT || size > hotCacheCapacity) {
+    return false;
+  }
+  uint8_t frequency = hotFrequency(path);
+  std::vector<size_t> order(hotCacheEntries.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(),
+            [](size_t a, size_t b) { return hotCacheEntries[a].lastUsed < hotCacheEntries[b].lastUsed; });
+  size_t freed = hotCacheCapacity - std::min(hotCacheCapacity, hotCacheBytes);
+  for (size_t i = 0; i < order.size() && freed < size; ++i) {
+    const HotCacheEntry& victim = hotCacheEntries[order[i]];
+    if (hotFrequency(victim.path) >= frequency) {
+      return false;
+    }
+    victims.push_back(order[i]);
+    freed += victim.object->size;
+  }
+  return freed >= size;
+}
+
+// Asked on a miss: is this download worth copying into PSRAM as it streams? A yes reserves
+// size bytes of the capacity until hotCacheReleaseFill, so concurrent misses can't each
+// allocate a whole book beyond it.
+bool hotCacheReserveFill(const String& path, size_t size) {
+  std::vector<size_t> victims;
+  if (hotCacheFilling + size <= hotCacheCapacity && hotCacheVictims(path, size, victims)) {
+    hotCacheFilling += size;
+    return true;
+  }
+  if (hotCacheCapacity > 0 && size > 0 && size <= HOT_CACHE_MAX_OBJECT) {
+    hotCacheRejected++;
+  }
+  return false;
+}
+
+void hotCacheReleaseFill(size_t size) {
+  hotCacheFilling -= std::min(hotCacheFilling, size);
+}
+
+// Takes ownership of data, a complete copy of path filled during its first download
+void hotCacheInsert(const String& path, uint8_t* data, size_t size) {
+  std::vector<size_t> victims;
+  bool present = false;
+  for (const auto& entry : hotCacheEntries) {
+    present = present || entry.path == path;
+  }
+  if (present || !hotCacheVictims(path, size, victims)) {
+    free(data);  // Filled twice concurrently, or the popular set moved on meanwhile
+    return;
+  }
+  std::sort(victims.rbegin(), victims.rend());
+  for (size_t index : victims) {
+    hotCacheBytes -= hotCacheEntries[index].object->size;
+    hotCacheEntries.erase(hotCacheEntries.begin() + index);
+  }
+  std::shared_ptr<HotObject> object(new HotObject{data, size});
+  hotCacheEntries.push_back({path, object, ++hotCacheClock});
+  hotCacheBytes += size;
+}
+
+// Same matching as fileCacheInvalidate, which calls it
+void hotCacheInvalidate(const String& path) {
+  String prefix = path.endsWith("/") ? path : path + "/";
+  for (size_t i = 0; i < hotCacheEntries.size();) {
+    const String& cached = hotCacheEntries[i].path;
+    if (cached == path || cached.startsWith(prefix)) {
+      hotCacheBytes -= hotCacheEntries[i].object->size;
+      hotCacheEntries.erase(hotCacheEntries.begin() + i);
+    } else {
+      ++i;
+    }
+  }
+}
+
+// Streams a cached object straight from PSRAM; the pipeline struct only tracks progress
+size_t hotCacheSend(ActiveDownload& download, size_t maxBytes) {
+  DownloadPipeline& pipe = download.pipe;
+  size_t total = 0;
+  while (total < maxBytes && pipe.remaining > 0) {
+    size_t chunk = std::min(pipe.remaining, maxBytes - total);
+    int written = socketWriteNonBlocking(download.client, download.hot->data + download.hotOffset, chunk);
+    if (written <= 0) {
+      if (written < 0 || millis() - pipe.lastProgressAt > DOWNLOAD_STALL_TIMEOUT_MS) {
+        pipe.failed = true;
+      }
+      break;
+    }
+    pipe.lastProgressAt = millis();
+    download.hotOffset += written;
+    pipe.remaining -= written;
+    pipe.sent += written;
+    total += written;
+  }
+  if (pipe.remaining == 0) {
+    pipe.eof = true;
+  }
+  hotCacheSavedBytes += total;
+  return total;
+}
+
+// ----- ZIP bundles -----
+
+void zipPut16(std::vector<uint8_t>& out, uint16_t value) {
+  out.push_back(value & 0xFF);
+  out.push_back(value >> 8);
+}
+
+void zipPut32(std::vector<uint8_t>& out, uint32_t value) {
+  zipPut16(out, value & 0xFFFF);
+  zipPut16(out, value >> 16);
+}
+
+void zipPutLocalHeader(std::vector<uint8_t>& out, const ZipBundleEntry& entry) {
+  zipPut32(out, 0x04034b50);
+  zipPut16(out, 20);  // Version needed: 2.0
+  zipPut16(out, ZIP_FLAGS);
+  zipPut16(out, 0);   // Stored
+  zipPut16(out, 0);
+  zipPut16(out, ZIP_DOS_DATE);
+  zipPut32(out, 0);   // CRC and sizes are in the data descriptor
+  zipPut32(out, 0);
+  zipPut32(out, 0);
+  zipPut16(out, entry.name.length());
+  zipPut16(out, 0);
+  out.insert(out.end(), entry.name.c_str(), entry.name.c_str() + entry.name.length());
+}
+
+void zipPutDescriptor(std::vector<uint8_t>& out, const ZipBundleEntry& entry) {
+  zipPut32(out, 0x08074b50);
+  zipPut32(out, entry.crc);
+  zipPut32(out, entry.size);
+  zipPut32(out, entry.size);
+}
+
+void zipPutCentralHeader(std::vector<uint8_t>& out, const ZipBundleEntry& entry) {
+  zipPut32(out, 0x02014b50);
+  zipPut16(out, 20);  // Made by: 2.0, MS-DOS attributes
+  zipPut16(out, 20);
+  zipPut16(out, ZIP_FLAGS);
+  zipPut16(out, 0);
+  zipPut16(out, 0);
+  zipPut16(out, ZIP_DOS_DATE);
+  zipPut32(out, entry.crc);
+  zipPut32(out, entry.size);
+  zipPut32(out, entry.size);
+  zipPut16(out, entry.name.length());
+  zipPut16(out, 0);   // Extra
+  zipPut16(out, 0);   // Comment
+  zipPut16(out, 0);   // Disk
+  zipPut16(out, 0);   // Internal attributes
+  zipPut32(out, 0);   // External attributes
+  zipPut32(out, entry.offset);
+  out.insert(out.end(), entry.name.c_str(), entry.name.c_str() + entry.name.length());
+}
+
+void zipPutEnd(std::vector<uint8_t>& out, uint16_t count, uint32_t centralSize, uint32_t centralStart) {
+  zipPut32(out, 0x06054b50);
+  zipPut16(out, 0);
+  zipPut16(out, 0);
+  zipPut16(out, count);
+  zipPut16(out, count);
+  zipPut32(out, centralSize);
+  zipPut32(out, centralStart);
+  zipPut16(out, 0);
+}
+
+// Archive size is known up front because store mode never changes a file's length
+uint64_t zipBundleLength(const ZipBundle& bundle) {
+  uint64_t length = 22;
+  for (const auto& entry : bundle.entries) {
+    length += 30 + 16 + 46 + 2 * entry.name.length() + static_cast<uint64_t>(entry.size);
+  }
+  return length;
+}
+
+bool downloadFinished(const ActiveDownload& download) {
+  if (download.bundle) {
+    return download.bundle->stage == ZIP_DONE || download.bundle->failed;
+  }
+  return download.pipe.eof || download.pipe.failed;
+}
+
+// Sends queued header bytes; false while some are still waiting for socket room
+bool zipSendPending(ActiveDownload& download, size_t& budget, size_t& total) {
+  ZipBundle& bundle = *download.bundle;
+  while (bundle.pendingOffset < bundle.pending.size()) {
+    if (budget == 0) {
+      return false;
+    }
+    size_t chunk = std::min(bundle.pending.size() - bundle.pendingOffset, budget);
+    int written = socketWriteNonBlocking(download.client, bundle.pending.data() + bundle.pendingOffset, chunk);
+    if (written < 0) {
+      bundle.failed = true;
+      return false;
+    }
+    if (written == 0) {
+      if (millis() - bundle.lastProgressAt > DOWNLOAD_STALL_TIMEOUT_MS) {
+        bundle.failed = true;
+      }
+      return false;
+    }
+    bundle.lastProgressAt = millis();
+    bundle.pendingOffset += written;
+    bundle.offset += written;
+    budget -= written;
+    total += written;
+  }
+  bundle.pending.clear();
+  bundle.pendingOffset = 0;
+  return true;
+}
+
+size_t zipBundleSend(ActiveDownload& download, size_t maxBytes) {
+  ZipBundle& bundle = *download.bundle;
+  size_t budget = maxBytes;
+  size_t total = 0;
+  while (!bundle.failed && bundle.stage != ZIP_DONE) {
+    if (!zipSendPending(download, budget, total)) {
+      break;
+    }
+    switch (bundle.stage) {
+      case ZIP_LOCAL_HEADER: {
+        if (bundle.index >= bundle.entries.size()) {
+          bundle.centralStart = bundle.offset;
+          bundle.index = 0;
+          bundle.stage = ZIP_CENTRAL;
+          break;
+        }
+        ZipBundleEntry& entry = bundle.entries[bundle.index];
+        File file = SD.open(entry.sdPath.c_str(), FILE_READ);
+        if (!file || file.size() != entry.size) {
+          // The Content-Length is already promised; a short archive beats a corrupt one
+          Serial.println("[ZIP][ERROR] Bundle member changed underneath us: " + entry.sdPath);
+          bundle.failed = true;
+          break;
+        }
+        download.pipe = DownloadPipeline();
+        download.pipe.trackCrc = true;
+        download.pipe.quiet = true;
+        if (!downloadPipelineBegin(download.pipe, file, entry.size, downloadBufferSize, downloadPipelineDepth)) {
+          file.close();
+          bundle.failed = true;
+          break;
+        }
+        bundle.pipeOpen = true;
+        entry.offset = bundle.offset;
+        zipPutLocalHeader(bundle.pending, entry);
+        bundle.stage = ZIP_DATA;
+        break;
+      }
+      case ZIP_DATA: {
+        size_t sent = downloadPipelineSend(download.pipe, download.client, budget, 0);
+        if (sent > 0) {
+          bundle.lastProgressAt = millis();
+        }
+        bundle.offset += sent;
+        budget -= sent;
+        total += sent;
+        if (download.pipe.failed) {
+          bundle.failed = true;
+          break;
+        }
+        if (!download.pipe.eof) {
+          return total;  // Out of budget, or waiting on SD or the socket
+        }
+        ZipBundleEntry& entry = bundle.entries[bundle.index];
+        entry.crc = download.pipe.crc;
+        bool complete = download.pipe.sent == entry.size;
+        downloadPipelineEnd(download.pipe);
+        bundle.pipeOpen = false;
+        if (!complete) {
+          bundle.failed = true;
+          break;
+        }
+        zipPutDescriptor(bundle.pending, entry);
+        bundle.stage = ZIP_DESCRIPTOR;
+        break;
+      }
+      case ZIP_DESCRIPTOR:
+        bundle.index++;
+        bundle.stage = ZIP_LOCAL_HEADER;
+        break;
+      case ZIP_CENTRAL:
+        if (bundle.index < bundle.entries.size()) {
+          zipPutCentralHeader(bundle.pending, bundle.entries[bundle.index++]);
+        } else {
+          zipPutEnd(bundle.pending, bundle.entries.size(), bundle.offset - bundle.centralStart, bundle.centralStart);
+          bundle.stage = ZIP_FINISHING;
+        }
+        break;
+      case ZIP_FINISHING:
+        bundle.stage = ZIP_DONE;
+        break;
+      case ZIP_DONE:
+        break;
+    }
+    if (budget == 0) {
+      break;
+    }
+  }
+  return total;
+}
+
+// Adds a library book by public path; false when it is missing, not a book, or already in the bundle
+bool addBundleEntry(ZipBundle& bundle, const String& publicPath, const String& name) {
+  if (bundle.entries.size() >= BUNDLE_MAX_FILES || !isAllowedFile(name.substring(name.lastIndexOf('/') + 1))) {
+    return false;
+  }
+  for (const auto& entry : bundle.entries) {
+    if (entry.name.equalsIgnoreCase(name)) {
+      return false;
+    }
+  }
+  ZipBundleEntry entry;
+  entry.sdPath = libraryPhysicalPath(resolveLibraryPath(publicPath));
+  size_t size;
+  if (!fileCacheStat(entry.sdPath, size)) {
+    return false;
+  }
+  entry.name = name;
+  entry.size = size;
+  entry.crc = 0;
+  entry.offset = 0;
+  bundle.entries.push_back(entry);
+  return true;
+}
+
+// ----- Download scheduler -----
+
+bool downloadSlotAvailable() {
+  return activeDownloads.size() < downloadSlots;
+}
+
+// Takes over the request's connection after its headers went out; loop() streams the body
+void activateDownload(ActiveDownload* download, uint16_t weight) {
+  download->weight = std::max<uint16_t>(weight, 1);
+  download->idleAtStart[0] = benchIdleCount[0];
+  download->idleAtStart[1] = benchIdleCount[1];
+
+  // The socket is reference counted: our copy keeps it open, and stopping the server's copy lets
+  // the server go straight back to accepting requests instead of waiting for this one to close.
+  // On ESP8266 stop() closes the shared connection itself; there the server's copy is simply
+  // dropped when the handler returns.
+  download->client = server.client();
+#if defined(ARDUINO_ARCH_ESP32)
+  server.client().stop();
+#endif
+
+  activeDownloads.push_back(download);
+}
+
+// Sets up the read pipeline before anything is sent, so a request that can't get buffers can
+// still be answered with a 503. activateDownload() takes it over once the headers are out.
+ActiveDownload* prepareDownload(File file, size_t length, size_t bufferSize, uint8_t depth) {
+  ActiveDownload* download = new ActiveDownload();
+  if (!downloadPipelineBegin(download->pipe, file, length, bufferSize, depth)) {
+    file.close();
+    delete download;
+    return nullptr;
+  }
+  return download;
+}
+
+// Serves length bytes of a hot-cache object from offset, with no SD access at all
+ActiveDownload* scheduleHotDownload(const String& path, std::shared_ptr<HotObject> object, size_t offset,
+                                    size_t length, uint16_t weight) {
+  ActiveDownload* download = new ActiveDownload();
+  download->hot = object;
+  download->hotOffset = offset;
+  download->pipe.name = path;
+  download->pipe.remaining = length;
+  download->pipe.startedAt = millis();
+  download->pipe.lastProgressAt = download->pipe.startedAt;
+  activateDownload(download, weight);
+  return download;
+}
+
+// Same hand-off as a file download; the bundle opens each member itself as it goes
+ActiveDownload* scheduleBundle(ZipBundle* bundle, uint16_t weight) {
+  ActiveDownload* download = new ActiveDownload();
+  download->bundle = bundle;
+  download->bundleStartedAt = millis();
+  bundle->lastProgressAt = download->bundleStartedAt;
+  activateDownload(download, weight);
+  return download;
+}
+
+void finishDownload(ActiveDownload* download) {
+  size_t sent = download->pipe.sent;
+  unsigned long elapsed = millis() - download->pipe.startedAt;
+  if (download->bundle) {
+    ZipBundle& bundle = *download->bundle;
+    if (bundle.pipeOpen) {
+      downloadPipelineEnd(download->pipe);
+    }
+    elapsed = std::max(1UL, millis() - download->bundleStartedAt);
+    downloadBytesTotal += bundle.offset;
+    if (bundle.stage == ZIP_DONE) {
+      downloadsCompleted++;
+    } else {
+      downloadsFailed++;
+    }
+    Serial.printf("[ZIP] %s: %u files, %lu bytes in %lu ms (%.2f MB/s)%s\n", bundle.name.c_str(),
+                  static_cast<unsigned int>(bundle.entries.size()), static_cast<unsigned long>(bundle.offset), elapsed,
+                  bundle.offset / 1048.576 / elapsed, bundle.stage == ZIP_DONE ? "" : " [aborted]");
+    delete download->bundle;
+  } else {
+    downloadPipelineEnd(download->pipe);
+  }
+  if (download->statsPath.length() > 0) {
+    noteDownloadFinish(download->statsPath, sent, download->pipe.eof);
+  }
+  download->client.stop();
+
+  if (download->benchRunId != 0 && download->benchRunId == benchRun.id) {
+    benchRun.transfers++;
+    benchRun.bytes += sent;
+    benchRun.serverMs += elapsed;
+    benchRun.idleWindowMs += elapsed;
+    for (int core = 0; core < 2; ++core) {
+      benchRun.idleCount[core] += benchIdleCount[core] - download->idleAtStart[core];
+    }
+  }
+  delete download;
+}
+
+void processDownloads() {
+  if (activeDownloads.empty()) {
+    downloadTokensRefilledAt = millis();
+    return;
+  }
+
+  // Refill the global bucket; bursts are bounded to 100 ms worth of the cap
+  unsigned long now = millis();
+  if (downloadRateCap > 0) {
+    uint64_t refill = static_cast<uint64_t>(downloadRateCap) * (now - downloadTokensRefilledAt) / 1000;
+    downloadTokens = std::min<uint64_t>(downloadTokens + refill, downloadRateCap / 10);
+  }
+  downloadTokensRefilledAt = now;
+
+  size_t count = activeDownloads.size();
+  unsigned long startMicros = micros();
+  bool progress = true;
+  while (progress && micros() - startMicros < DOWNLOAD_PUMP_BUDGET_US) {
+    progress = false;
+    for (size_t i = 0; i < count; ++i) {
+      ActiveDownload& download = *activeDownloads[(downloadRoundStart + i) % count];
+      if (downloadFinished(download)) {
+        continue;
+      }
+      size_t quantum = DOWNLOAD_QUANTUM * download.weight;
+      download.deficit = std::min(download.deficit + quantum, quantum * 4);
+      size_t allowance = download.deficit;
+      if (downloadRateCap > 0) {
+        allowance = std::min<size_t>(allowance, downloadTokens);
+      }
+      if (allowance == 0) {
+        continue;
+      }
+      size_t sent = download.bundle ? zipBundleSend(download, allowance)
+                    : download.hot ? hotCacheSend(download, allowance)
+                                   : downloadPipelineSend(download.pipe, download.client, allowance, 0);
+      download.deficit -= sent;
+      if (downloadRateCap > 0) {
+        downloadTokens -= sent;
+      }
+      if (sent > 0) {
+        progress = true;
+      }
+      if (sent < allowance) {
+        download.deficit = 0;  // Blocked on SD or the socket: idle flows don't bank credit
+      }
+    }
+    downloadRounds++;
+  }
+  downloadRoundStart++;
+
+  for (size_t i = 0; i < activeDownloads.size();) {
+    ActiveDownload* download = activeDownloads[i];
+    if (downloadFinished(*download)) {
+      activeDownloads.erase(activeDownloads.begin() + i);
+      finishDownload(download);
+    } else {
+      ++i;
+    }
+  }
+}
+
+// ----- Benchmark support -----
+
+#if defined(ARDUINO_ARCH_ESP32)
+bool benchIdleHookCore0() {
+  benchIdleCount[0]++;
+  return false;  // Keep spinning so the count tracks idle time instead of sleeping in WAITI
+}
+
+bool benchIdleHookCore1() {
+  benchIdleCount[1]++;
+  return false;
+}
+#endif
+
+// Installs the idle counters and measures their unloaded rate; the loop task sleeps meanwhile
+void benchCalibrateIdle() {
+#if defined(ARDUINO_ARCH_ESP32)
+  if (!benchIdleHooksInstalled) {
+    esp_register_freertos_idle_hook_for_cpu(benchIdleHookCore0, 0);
+    esp_register_freertos_idle_hook_for_cpu(benchIdleHookCore1, 1);
+    benchIdleHooksInstalled = true;
+  }
+  uint32_t before[2] = {benchIdleCount[0], benchIdleCount[1]};
+  unsigned long start = millis();
+  delay(200);
+  unsigned long elapsed = std::max(1UL, millis() - start);
+  for (int core = 0; core < 2; ++core) {
+    benchIdleRate[core] = static_cast<float>(benchIdleCount[core] - before[core]) / elapsed;
+  }
+  Serial.printf("[BENCH] Idle rate: core0 %.1f/ms, core1 %.1f/ms\n", benchIdleRate[0], benchIdleRate[1]);
+#endif
+}
+
+void benchReleaseIdle() {
+#if defined(ARDUINO_ARCH_ESP32)
+  if (benchIdleHooksInstalled) {
+    esp_deregister_freertos_idle_hook_for_cpu(benchIdleHookCore0, 0);
+    esp_deregister_freertos_idle_hook_for_cpu(benchIdleHookCore1, 1);
+    benchIdleHooksInstalled = false;
+  }
+#endif
+}
+
+bool benchDownloadsActive() {
+  for (const ActiveDownload* download : activeDownloads) {
+    if (download->benchRunId != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void benchPrepareEnd() {
+  benchPrepare.file.close();
+  benchPrepare.active = false;
+  noteStorageAdded(benchPrepare.path, benchPrepare.written);
+  noteClustersResized(0, benchPrepare.written);
+}
+
+// Writes the file /bench/prepare asked for, yielding to transfers like the other background
+// jobs, and takes the idle hooks off when a run was abandoned without its closing clock reset
+void processBench() {
+  if (benchIdleHooksInstalled && !benchDownloadsActive() && millis() - benchTouchedAt > BENCH_IDLE_HOOK_TIMEOUT_MS) {
+    Serial.println("[BENCH] No bench requests for a while; idle hooks removed");
+    benchReleaseIdle();
+  }
+  if (!benchPrepare.active || !sdCardReady || !activeDownloads.empty() || uploadInProgress()) {
+    return;
+  }
+  static uint8_t pattern[4096];
+  static bool patternReady = false;
+  if (!patternReady) {
+    for (size_t i = 0; i < sizeof(pattern); ++i) {
+      pattern[i] = static_cast<uint8_t>(i * 131 + 7);
+    }
+    patternReady = true;
+  }
+  unsigned long startMicros = micros();
+  while (benchPrepare.written < benchPrepare.size && micros() - startMicros < BENCH_PREPARE_BUDGET_US) {
+    size_t chunk = std::min(benchPrepare.size - benchPrepare.written, sizeof(pattern));
+    size_t wrote = benchPrepare.file.write(pattern, chunk);
+    benchPrepare.written += wrote;
+    if (wrote != chunk) {
+      Serial.printf("[BENCH][ERROR] Short write preparing %s\n", benchPrepare.path.c_str());
+      benchPrepare.failed = true;
+      benchPrepareEnd();
+      return;
+    }
+  }
+  if (benchPrepare.written >= benchPrepare.size) {
+    benchPrepareEnd();
+    Serial.printf("[BENCH] Prepared %s\n", benchPrepare.path.c_str());
+  }
+}
+
+size_t freeInternalHeap() {
+#if defined(ARDUINO_ARCH_ESP32)
+  return heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+#else
+  return ESP.getFreeHeap();
+#endif
+}
+
+size_t freePsram() {
+#if defined(ARDUINO_ARCH_ESP32)
+  return heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+#else
+  return 0;
+#endif
+}
+
+// Lowest free heap seen during an upload benchmark; sampled per loop pass and per body block
+void noteUploadBenchHeap() {
+  if (!uploadBench.active) {
+    return;
+  }
+  uploadBench.heapLow = std::min(uploadBench.heapLow, freeInternalHeap());
+  uploadBench.psramLow = std::min(uploadBench.psramLow, freePsram());
+}
+
+// A request body is read inside handleClient(), so a slow uploader shows up as a long gap
+// between loop passes: nothing else (downloads, pages, jobs) runs during it
+void noteUploadBenchPass() {
+  if (!uploadBench.active) {
+    return;
+  }
+  unsigned long now = micros();
+  if (uploadBench.passes++ > 0) {
+    uint32_t gap = now - uploadBench.lastPassAt;
+    uploadBench.maxGapUs = std::max(uploadBench.maxGapUs, gap);
+    if (gap > UPLOAD_BENCH_BLOCKED_US) {
+      uploadBench.blockedUs += gap;
+    }
+  }
+  uploadBench.lastPassAt = now;
+  noteUploadBenchHeap();
+}
+
+// Closes every handle the background jobs keep across loop passes; each job restarts its pass later
+void suspendStorageJobs() {
+  releaseMetadataFile();
+  libraryScanEnd(metadataJob.cursor);
+  metadataJob.phase = META_IDLE;
+  metadataJob.rescanRequested = true;
+
+  if (fingerprintJob.file) {
+    fingerprintJob.file.close();
+    contentHashFinish(fingerprintJob.hasher);
+  }
+  libraryScanEnd(fingerprintJob.cursor);
+  fingerprintJob.active = false;
+  fingerprintJob.rescanRequested = true;
+
+  libraryScanEnd(libraryMetricsScan.cursor);
+  libraryMetricsScan.active = false;
+
+  endUploadVerify(uploadVerifyJob);  // Current read-back starts over
+  freeSpace.counting = false;        // So does a free-space count
+  if (benchPrepare.active) {
+    benchPrepareEnd();               // The short file is rewritten on the next /bench/prepare
+  }
+  abortGzipBook(gzipJob);            // Current book is compressed again from the start
+  libraryScanEnd(gzipJob.cursor);
+  gzipJob.active = false;
+  gzipJob.rescanRequested = true;
+
+  fileCacheInvalidate("/");          // Cached handles and sizes belong to the old mount
+}
+
+bool remountSdCard(uint32_t clockHz) {
+#if defined(ARDUINO_ARCH_ESP32)
+  suspendStorageJobs();
+  SD.end();
+  sdCardReady = SD.begin(SD_CS_PIN, SPI, clockHz, SD_MOUNT_POINT, SD_MAX_OPEN_FILES);
+  if (sdCardReady) {
+    sdSpiClockHz = clockHz;
+  } else {
+    Serial.printf("[SD][WARN] Mount at %lu Hz failed, back to %lu Hz\n", static_cast<unsigned long>(clockHz),
+                  static_cast<unsigned long>(sdSpiClockHz));
+    sdCardReady = SD.begin(SD_CS_PIN, SPI, sdSpiClockHz, SD_MOUNT_POINT, SD_MAX_OPEN_FILES);
+  }
+  Serial.printf("[SD] Remounted at %lu Hz\n", static_cast<unsigned long>(sdSpiClockHz));
+  return sdCardReady && sdSpiClockHz == clockHz;
+#else
+  (void)clockHz;
+  return false;
+#endif
+}
+
+// ----- Library storage layout -----
+
+String librarySectionName(int index) {
+  if (index == 0) {
+    return "0-9";
+  }
+  if (index == 1) {
+    return "#@";
+  }
+  return String(static_cast<char>('A' + index - 2));
+}
+
+// FNV-1a over the lower-cased name; FAT names are case-insensitive so case variants share a bucket.
+// Sidecars (".gz", ".pgx") hash like their book so they always sit in the same bucket.
+String libraryShardBucket(const String& fileName) {
+  size_t length = fileName.length();
+  if (length > 3 && fileName.endsWith(".gz")) {
+    length -= 3;
+  } else if (length > 4 && fileName.endsWith(PAGE_INDEX_SUFFIX)) {
+    length -= 4;
+  }
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= static_cast<uint8_t>(tolower(fileName.charAt(i)));
+    hash *= 16777619UL;
+  }
+  const char* digits = "0123456789abcdef";
+  String bucket = "~";
+  bucket += digits[hash % LIBRARY_SHARD_BUCKETS];
+  return bucket;
+}
+
+// "/Alexandria/<section>/<name>" -> "/Alexandria/<section>/~x/<name>"; other paths pass through
+String libraryShardedPath(const String& publicPath) {
+  const String prefix = "/Alexandria/";
+  if (!publicPath.startsWith(prefix)) {
+    return publicPath;
+  }
+  int slash = publicPath.indexOf('/', prefix.length());
+  if (slash < 0 || publicPath.indexOf('/', slash + 1) >= 0) {
+    return publicPath;
+  }
+  String fileName = publicPath.substring(slash + 1);
+  return publicPath.substring(0, slash + 1) + libraryShardBucket(fileName) + "/" + fileName;
+}
+
+String libraryPhysicalPath(const String& publicPath) {
+  if (libraryLayout == LIBRARY_LAYOUT_FLAT) {
+    return publicPath;
+  }
+  String sharded = libraryShardedPath(publicPath);
+  // Mid-migration a book may not have been moved yet
+  size_t size;
+  if (libraryLayout == LIBRARY_LAYOUT_MIGRATING && sharded != publicPath && !fileCacheStat(sharded, size)) {
+    return publicPath;
+  }
+  return sharded;
+}
+
+String libraryPublicPath(const String& sdPath) {
+  const String prefix = "/Alexandria/";
+  if (!sdPath.startsWith(prefix)) {
+    return sdPath;
+  }
+  int slash = sdPath.indexOf('/', prefix.length());
+  if (slash < 0 || sdPath.length() < static_cast<unsigned int>(slash) + 4 || sdPath.charAt(slash + 1) != '~' ||
+      sdPath.charAt(slash + 3) != '/') {
+    return sdPath;
+  }
+  return sdPath.substring(0, slash + 1) + sdPath.substring(slash + 4);
+}
+
+// Losing the marker would put a sharded library back to flat, so it is swapped like the tables
+void saveLibraryLayout() {
+  String tempPath = String(CATALOG_LAYOUT_PATH) + ".tmp";
+  File file = SD.open(tempPath.c_str(), FILE_WRITE);
+  if (!file) {
+    Serial.println("[SHARD][ERROR] Failed to write layout marker");
+    return;
+  }
+  size_t written = file.println(libraryLayout == LIBRARY_LAYOUT_SHARDED ? "sharded" :
+                                libraryLayout == LIBRARY_LAYOUT_MIGRATING ? "migrating" : "flat");
+  file.close();
+  if (!replaceSdTable(CATALOG_LAYOUT_PATH, written)) {
+    Serial.println("[SHARD][ERROR] Failed to replace layout marker");
+  }
+}
+
+void loadLibraryLayout() {
+  restoreSdTable(CATALOG_LAYOUT_PATH);
+  File file = SD.open(CATALOG_LAYOUT_PATH, FILE_READ);
+  if (!file) {
+    libraryLayout = LIBRARY_LAYOUT_FLAT;
+    return;
+  }
+  String mode = file.readStringUntil('\n');
+  file.close();
+  mode.trim();
+  if (mode == "sharded") {
+    libraryLayout = LIBRARY_LAYOUT_SHARDED;
+  } else if (mode == "migrating") {
+    // An interrupted migration simply picks up where it left off
+    libraryLayout = LIBRARY_LAYOUT_MIGRATING;
+    shardMigration = ShardMigrationJob();
+    shardMigration.startedAt = millis();
+  } else {
+    libraryLayout = LIBRARY_LAYOUT_FLAT;
+  }
+  Serial.printf("[SHARD] Library layout: %s\n", mode.c_str());
+}
+
+bool startShardMigration() {
+  if (libraryLayout != LIBRARY_LAYOUT_FLAT) {
+    return false;
+  }
+  libraryLayout = LIBRARY_LAYOUT_MIGRATING;
+  shardMigration = ShardMigrationJob();
+  shardMigration.startedAt = millis();
+  saveLibraryLayout();
+  // The compressor holds a book open and writes its sidecar beside it; it waits for the move
+  abortGzipBook(gzipJob);
+  libraryScanEnd(gzipJob.cursor);
+  gzipJob.active = false;
+  gzipJob.rescanRequested = true;
+  Serial.println("[SHARD] Migration to sharded layout started");
+  return true;
+}
+
+// Moves books and their .gz/.pgx sidecars from the section root into their bucket, a small
+// batch per directory reopen so renames never race the directory iterator. Public paths don't
+// change, so catalogs stay valid. The layout only turns sharded after a pass that moved
+// everything: until then libraryPhysicalPath still finds a book left in the section root.
+void processShardMigration() {
+  if (libraryLayout != LIBRARY_LAYOUT_MIGRATING || !sdCardReady ||
+      (shardMigration.retryAt != 0 && static_cast<long>(millis() - shardMigration.retryAt) < 0)) {
+    return;
+  }
+
+  unsigned long startMicros = micros();
+  while (micros() - startMicros < SHARD_MIGRATION_BUDGET_US) {
+    if (shardMigration.section >= LIBRARY_SECTION_COUNT) {
+      if (shardMigration.skipped > 0) {
+        Serial.printf("[SHARD][WARN] %lu files left in section roots; next pass in %lu s\n", shardMigration.skipped,
+                      SHARD_MIGRATION_RETRY_MS / 1000);
+        shardMigration.section = 0;
+        shardMigration.skipped = 0;
+        shardMigration.retryAt = millis() + SHARD_MIGRATION_RETRY_MS;
+        return;
+      }
+      libraryLayout = LIBRARY_LAYOUT_SHARDED;
+      saveLibraryLayout();
+      Serial.printf("[SHARD] Migration complete: %lu files moved in %lu ms\n", shardMigration.moved,
+                    millis() - shardMigration.startedAt);
+      return;
+    }
+
+    String sectionPath = "/Alexandria/" + librarySectionName(shardMigration.section);
+    File dir = SD.open(sectionPath.c_str());
+    if (!dir || !dir.isDirectory()) {
+      if (dir) {
+        dir.close();
+      }
+      shardMigration.section++;
+      continue;
+    }
+
+    std::vector<String> batch;
+    while (batch.size() < SHARD_MIGRATION_BATCH) {
+      File entry = dir.openNextFile();
+      if (!entry) {
+        break;
+      }
+      // Sidecars go with their book (libraryShardBucket hashes them alike); only files still being
+      // written or parked by an interrupted swap stay, and sweepUploadTemps deals with those
+      String name = entry.name();
+      bool temp = isUploadTempName(name) || name.endsWith(".gz.tmp") || (name.startsWith(".") && name.endsWith(".old"));
+      if (!entry.isDirectory() && !temp &&
+          std::find(shardMigration.failed.begin(), shardMigration.failed.end(), name) == shardMigration.failed.end()) {
+        batch.push_back(name);
+      }
+      entry.close();
+    }
+    dir.close();
+
+    if (batch.empty()) {
+      shardMigration.section++;
+      shardMigration.failed.clear();
+      continue;
+    }
+
+    for (const String& name : batch) {
+      String from = sectionPath + "/" + name;
+      String bucketPath = sectionPath + "/" + libraryShardBucket(name);
+      String to = bucketPath + "/" + name;
+      fileCacheInvalidate(from);
+      fileCacheInvalidate(to);
+      if (!SD.exists(bucketPath) && !SD.mkdir(bucketPath)) {
+        Serial.println("[SHARD][ERROR] Failed to create bucket: " + bucketPath);
+        shardMigration.failed.push_back(name);
+        shardMigration.skipped++;
+        continue;
+      }
+      if (SD.exists(to)) {
+        // A newer upload (or its sidecar) already landed in the bucket; the flat copy is stale
+        size_t staleSize = sdFileBytes(from.c_str());
+        if (SD.remove(from)) {
+          noteStorageRemoved(from, staleSize);
+          noteClustersResized(staleSize, 0);
+        } else {
+          Serial.println("[SHARD][ERROR] Failed to remove stale " + from);
+          shardMigration.failed.push_back(name);
+          shardMigration.skipped++;
+          continue;
+        }
+      } else if (!SD.rename(from, to)) {
+        Serial.println("[SHARD][ERROR] Failed to move " + from);
+        shardMigration.failed.push_back(name);
+        shardMigration.skipped++;
+        continue;
+      }
+      shardMigration.moved++;
+    }
+  }
+}
+
+// ----- Library catalog -----
+
+String sanitizeCatalogField(const String& value) {
+  String clean;
+  clean.reserve(value.length());
+  bool lastSpace = true;
+  for (size_t i = 0; i < value.length() && clean.length() < METADATA_FIELD_LIMIT; ++i) {
+    char c = value.charAt(i);
+    if (c == '\t' || c == '\r' || c == '\n' || c == ' ') {
+      if (!lastSpace) {
+        clean += ' ';
+      }
+      lastSpace = true;
+      continue;
+    }
+    clean += c;
+    lastSpace = false;
+  }
+  clean.trim();
+  return clean;
+}
+
+void loadLibraryCatalog() {
+  libraryCatalog.clear();
+  restoreSdTable(CATALOG_METADATA_PATH);
+  File catalogFile = SD.open(CATALOG_METADATA_PATH, FILE_READ);
+  if (!catalogFile) {
+    Serial.println("[META] No catalog yet; metadata will be extracted in the background");
+    return;
+  }
+
+  // Format: path \t size \t title \t author \t language; later lines win, a "-" size drops the book
+  size_t rows = 0;
+  while (catalogFile.available()) {
+    String line = catalogFile.readStringUntil('\n');
+    int tab1 = line.indexOf('\t');
+    int tab2 = tab1 >= 0 ? line.indexOf('\t', tab1 + 1) : -1;
+    int tab3 = tab2 >= 0 ? line.indexOf('\t', tab2 + 1) : -1;
+    int tab4 = tab3 >= 0 ? line.indexOf('\t', tab3 + 1) : -1;
+    if (tab4 < 0) {
+      continue;
+    }
+    rows++;
+    if (line.substring(tab1 + 1, tab2) == "-") {
+      libraryCatalog.erase(line.substring(0, tab1));
+      continue;
+    }
+    BookMetadata meta;
+    meta.size = static_cast<size_t>(line.substring(tab1 + 1, tab2).toInt());
+    meta.title = line.substring(tab2 + 1, tab3);
+    meta.author = line.substring(tab3 + 1, tab4);
+    meta.language = line.substring(tab4 + 1);
+    meta.language.trim();
+    libraryCatalog[line.substring(0, tab1)] = meta;
+  }
+  catalogFile.close();
+  Serial.printf("[META] Catalog loaded: %u entries\n", static_cast<unsigned int>(libraryCatalog.size()));
+  if (rows >= CATALOG_COMPACT_MIN_ROWS && rows - libraryCatalog.size() > libraryCatalog.size()) {
+    compactLibraryCatalog(rows);
+  }
+}
+
+// Rewrites the catalog with one row per live book, through a temp file
+void compactLibraryCatalog(size_t rows) {
+  String tempPath = String(CATALOG_METADATA_PATH) + ".tmp";
+  File file = SD.open(tempPath.c_str(), FILE_WRITE);
+  if (!file) {
+    Serial.println("[META][ERROR] Cannot write " + tempPath);
+    return;
+  }
+  for (const auto& entry : libraryCatalog) {
+    file.printf("%s\t%lu\t%s\t%s\t%s\n",
+                entry.first.c_str(),
+                static_cast<unsigned long>(entry.second.size),
+                entry.second.title.c_str(),
+                entry.second.author.c_str(),
+                entry.second.language.c_str());
+  }
+  size_t written = file.size();
+  file.close();
+  if (!replaceSdTable(CATALOG_METADATA_PATH, written)) {
+    Serial.println("[META][ERROR] Cannot replace " + String(CATALOG_METADATA_PATH));
+    return;
+  }
+  Serial.printf("[META] Catalog compacted: %u rows -> %u\n", static_cast<unsigned int>(rows),
+                static_cast<unsigned int>(libraryCatalog.size()));
+}
+
+void appendCatalogEntry(const String& path, const BookMetadata& meta) {
+  libraryCatalog[path] = meta;
+  bumpSectionGeneration(path);  // Listings show the extracted titles
+  File catalogFile = SD.open(CATALOG_METADATA_PATH, FILE_APPEND);
+  if (!catalogFile) {
+    Serial.println("[META][ERROR] Failed to append to catalog");
+    return;
+  }
+  size_t written = catalogFile.printf("%s\t%lu\t%s\t%s\t%s\n",
+                                     path.c_str(),
+                                     static_cast<unsigned long>(meta.size),
+                                     meta.title.c_str(),
+                                     meta.author.c_str(),
+                                     meta.language.c_str());
+  catalogFile.close();
+  noteStorageAdded(CATALOG_METADATA_PATH, written);
+}
+
+// Forgets a removed book; the tombstone row keeps the next boot from resurrecting it
+void dropCatalogEntry(const String& path) {
+  if (libraryCatalog.erase(path) == 0 || !sdCardReady) {
+    return;
+  }
+  File catalogFile = SD.open(CATALOG_METADATA_PATH, FILE_APPEND);
+  if (!catalogFile) {
+    Serial.println("[META][ERROR] Failed to append to catalog");
+    return;
+  }
+  noteStorageAdded(CATALOG_METADATA_PATH, catalogFile.printf("%s\t-\t\t\t\n", path.c_str()));
+  catalogFile.close();
+}
+
+const BookMetadata* findBookMetadata(const String& path) {
+  auto it = libraryCatalog.find(path);
+  if (it == libraryCatalog.end() || it->second.title.length() == 0) {
+    return nullptr;
+  }
+  return &it->second;
+}
+
+// ----- Content hashing and deduplication -----
+
+void contentHashBegin(ContentHasher& hasher) {
+#if defined(ARDUINO_ARCH_ESP32)
+  mbedtls_sha256_init(&hasher.ctx);
+  mbedtls_sha256_starts(&hasher.ctx, 0);
+#else
+  br_sha256_init(&hasher.ctx);
+#endif
+}
+
+void contentHashUpdate(ContentHasher& hasher, const uint8_t* data, size_t length) {
+#if defined(ARDUINO_ARCH_ESP32)
+  mbedtls_sha256_update(&hasher.ctx, data, length);
+#else
+  br_sha256_update(&hasher.ctx, data, length);
+#endif
+}
+
+String contentHashFinish(ContentHasher& hasher) {
+  uint8_t digest[32];
+#if defined(ARDUINO_ARCH_ESP32)
+  mbedtls_sha256_finish(&hasher.ctx, digest);
+  mbedtls_sha256_free(&hasher.ctx);
+#else
+  br_sha256_out(&hasher.ctx, digest);
+#endif
+  const char hex[] = "0123456789abcdef";
+  String out;
+  out.reserve(64);
+  for (uint8_t b : digest) {
+    out += hex[b >> 4];
+    out += hex[b & 0x0F];
+  }
+  return out;
+}
+
+void appendTsvLine(const char* path, const String& line) {
+  File file = SD.open(path, FILE_APPEND);
+  if (!file) {
+    Serial.printf("[HASH][ERROR] Failed to append to %s\n", path);
+    return;
+  }
+  size_t written = file.print(line);
+  written += file.print('\n');
+  file.close();
+  noteStorageAdded(path, written);
+}
+
+void recordFingerprint(const String& path, const String& hash, size_t size) {
+  auto previous = pathFingerprints.find(path);
+  if (previous != pathFingerprints.end() && previous->second.hash != hash) {
+    auto indexed = contentHashIndex.find(previous->second.hash);
+    if (indexed != contentHashIndex.end() && indexed->second == path) {
+      contentHashIndex.erase(indexed);
+    }
+  }
+  pathFingerprints[path] = ContentFingerprint{hash, size};
+  if (contentHashIndex.find(hash) == contentHashIndex.end()) {
+    contentHashIndex[hash] = path;
+  }
+  appendTsvLine(CATALOG_HASHES_PATH, path + "\t" + hash + "\t" + String(static_cast<unsigned long>(size)));
+}
+
+void forgetFingerprint(const String& path) {
+  auto it = pathFingerprints.find(path);
+  if (it == pathFingerprints.end()) {
+    return;
+  }
+  auto indexed = contentHashIndex.find(it->second.hash);
+  if (indexed != contentHashIndex.end() && indexed->second == path) {
+    contentHashIndex.erase(indexed);
+  }
+  pathFingerprints.erase(it);
+  // A "-" hash tombstones the path for the next boot
+  appendTsvLine(CATALOG_HASHES_PATH, path + "\t-\t0");
+}
+
+void recordAlias(const String& aliasPath, const String& targetPath) {
+  libraryAliases[aliasPath] = targetPath;
+  appendTsvLine(CATALOG_ALIASES_PATH, aliasPath + "\t" + targetPath);
+}
+
+void removeAlias(const String& aliasPath) {
+  if (libraryAliases.erase(aliasPath) > 0) {
+    appendTsvLine(CATALOG_ALIASES_PATH, aliasPath + "\t-");
+  }
+}
+
+// Rewrites a whole table through "<path>.tmp" and replaceSdTable, the way the catalog is compacted
+void replaceTsvTable(const char* path, const std::vector<String>& lines) {
+  String tempPath = String(path) + ".tmp";
+  File file = SD.open(tempPath.c_str(), FILE_WRITE);
+  if (!file) {
+    Serial.println("[HASH][ERROR] Cannot write " + tempPath);
+    return;
+  }
+  for (const String& line : lines) {
+    file.print(line);
+    file.print('\n');
+  }
+  size_t written = file.size();
+  file.close();
+  if (!replaceSdTable(path, written)) {
+    Serial.printf("[HASH][ERROR] Cannot replace %s\n", path);
+  }
+}
+
+void loadContentIndex() {
+  pathFingerprints.clear();
+  contentHashIndex.clear();
+  libraryAliases.clear();
+  restoreSdTable(CATALOG_HASHES_PATH);
+  restoreSdTable(CATALOG_ALIASES_PATH);
+
+  size_t hashRows = 0;
+  File hashes = SD.open(CATALOG_HASHES_PATH, FILE_READ);
+  if (hashes) {
+    while (hashes.available()) {
+      String line = hashes.readStringUntil('\n');
+      int tab1 = line.indexOf('\t');
+      int tab2 = tab1 >= 0 ? line.indexOf('\t', tab1 + 1) : -1;
+      if (tab2 < 0) {
+        continue;
+      }
+      hashRows++;
+      String path = line.substring(0, tab1);
+      String hash = line.substring(tab1 + 1, tab2);
+      if (hash == "-") {
+        pathFingerprints.erase(path);
+      } else {
+        pathFingerprints[path] = ContentFingerprint{hash, static_cast<size_t>(line.substring(tab2 + 1).toInt())};
+      }
+    }
+    hashes.close();
+  }
+  for (const auto& entry : pathFingerprints) {
+    if (contentHashIndex.find(entry.second.hash) == contentHashIndex.end()) {
+      contentHashIndex[entry.second.hash] = entry.first;
+    }
+  }
+
+  size_t aliasRows = 0;
+  File aliases = SD.open(CATALOG_ALIASES_PATH, FILE_READ);
+  if (aliases) {
+    while (aliases.available()) {
+      String line = aliases.readStringUntil('\n');
+      line.trim();
+      int tab = line.indexOf('\t');
+      if (tab < 0) {
+        continue;
+      }
+      aliasRows++;
+      String target = line.substring(tab + 1);
+      if (target == "-") {
+        libraryAliases.erase(line.substring(0, tab));
+      } else {
+        libraryAliases[line.substring(0, tab)] = target;
+      }
+    }
+    aliases.close();
+  }
+
+  Serial.printf("[HASH] Index loaded: %u fingerprints, %u aliases\n",
+                static_cast<unsigned int>(pathFingerprints.size()),
+                static_cast<unsigned int>(libraryAliases.size()));
+
+  // Both tables only ever grow; once dead rows outnumber live ones, write the live ones back
+  if (hashRows >= CATALOG_COMPACT_MIN_ROWS && hashRows - pathFingerprints.size() > pathFingerprints.size()) {
+    std::vector<String> lines;
+    lines.reserve(pathFingerprints.size());
+    for (const auto& entry : pathFingerprints) {
+      lines.push_back(entry.first + "\t" + entry.second.hash + "\t" + String(static_cast<unsigned long>(entry.second.size)));
+    }
+    replaceTsvTable(CATALOG_HASHES_PATH, lines);
+    Serial.printf("[HASH] hashes.tsv compacted: %u rows -> %u\n", static_cast<unsigned int>(hashRows),
+                  static_cast<unsigned int>(lines.size()));
+  }
+  if (aliasRows >= CATALOG_COMPACT_MIN_ROWS && aliasRows - libraryAliases.size() > libraryAliases.size()) {
+    std::vector<String> lines;
+    lines.reserve(libraryAliases.size());
+    for (const auto& alias : libraryAliases) {
+      lines.push_back(alias.first + "\t" + alias.second);
+    }
+    replaceTsvTable(CATALOG_ALIASES_PATH, lines);
+    Serial.printf("[HASH] aliases.tsv compacted: %u rows -> %u\n", static_cast<unsigned int>(aliasRows),
+                  static_cast<unsigned int>(lines.size()));
+  }
+}
+
+// Returns true when the upload duplicated an existing book and was turned into an alias
+bool registerUploadFingerprint(const String& path, const String& hash, size_t size) {
+  auto existing = contentHashIndex.find(hash);
+  if (existing != contentHashIndex.end() && existing->second != path &&
+      SD.exists(libraryPhysicalPath(existing->second))) {
+    String target = existing->second;
+    fileCacheInvalidate(libraryPhysicalPath(path));
+    if (SD.remove(libraryPhysicalPath(path))) {
+      noteStorageRemoved(path, size);
+      noteClustersResized(size, 0);
+      pathFingerprints.erase(path);
+      recordAlias(path, target);
+      recordLibraryChange(LIBRARY_CHANGE_ADD, path);
+      Serial.printf("[HASH] Duplicate upload %s stored as alias of %s (%lu bytes freed)\n",
+                    path.c_str(), target.c_str(), static_cast<unsigned long>(size));
+      return true;
+    }
+  }
+  removeAlias(path);
+  recordFingerprint(path, hash, size);
+  return false;
+}
+
+// A book is being removed or overwritten. Aliases that pointed at it move to another copy with
+// the same content if one is still on the card, otherwise they are removed with it.
+void releaseLibraryPath(const String& path) {
+  removeAlias(path);
+  auto fingerprint = pathFingerprints.find(path);
+  if (fingerprint == pathFingerprints.end()) {
+    return;
+  }
+  String hash = fingerprint->second.hash;
+  forgetFingerprint(path);
+
+  String replacement;
+  for (const auto& entry : pathFingerprints) {
+    if (entry.second.hash == hash && SD.exists(libraryPhysicalPath(entry.first))) {
+      replacement = entry.first;
+      contentHashIndex[hash] = replacement;
+      break;
+    }
+  }
+
+  std::vector<String> orphans;
+  for (const auto& alias : libraryAliases) {
+    if (alias.second == path) {
+      orphans.push_back(alias.first);
+    }
+  }
+  for (const String& alias : orphans) {
+    if (replacement.length() > 0) {
+      recordAlias(alias, replacement);
+      bumpSectionGeneration(alias);
+      Serial.printf("[HASH] Alias %s now points at %s\n", alias.c_str(), replacement.c_str());
+    } else {
+      removeAlias(alias);
+      recordLibraryChange(LIBRARY_CHANGE_REMOVE, alias);
+      Serial.printf("[HASH] Alias %s removed with %s\n", alias.c_str(), path.c_str());
+    }
+  }
+}
+
+String resolveLibraryPath(const String& path) {
+  auto alias = libraryAliases.find(path);
+  return alias != libraryAliases.end() ? alias->second : path;
+}
+
+void requestFingerprintRescan() {
+  fingerprintJob.rescanRequested = true;
+}
+
+void finishFingerprint() {
+  FingerprintJob& job = fingerprintJob;
+  job.file.close();
+  String hash = contentHashFinish(job.hasher);
+  auto existing = contentHashIndex.find(hash);
+  if (existing != contentHashIndex.end() && existing->second != job.path) {
+    job.duplicateFiles++;
+    job.duplicateBytes += job.size;
+    job.duplicates.push_back({job.path, existing->second});
+    Serial.printf("[HASH] Duplicate content: %s == %s (%lu bytes)\n",
+                  job.path.c_str(), existing->second.c_str(), static_cast<unsigned long>(job.size));
+  }
+  recordFingerprint(job.path, hash, job.size);
+}
+
+// Fingerprints books that are not in the index yet, a few KB per loop pass
+void processFingerprintJob() {
+  // Whole books go through SHA-256 here; transfers get the card first, the hash resumes after
+  if (!sdCardReady || !activeDownloads.empty() || uploadInProgress()) {
+    return;
+  }
+  FingerprintJob& job = fingerprintJob;
+  if (!job.active) {
+    if (!job.rescanRequested && millis() - job.lastPassEnd < FINGERPRINT_RESCAN_INTERVAL) {
+      return;
+    }
+    job.rescanRequested = false;
+    job.lastPassEnd = millis();
+    if (!libraryScanBegin(job.cursor, "/Alexandria")) {
+      return;
+    }
+    job.active = true;
+    job.duplicateFiles = 0;
+    job.duplicateBytes = 0;
+    job.duplicates.clear();
+  }
+
+  static uint8_t buf[FINGERPRINT_READ_CHUNK];
+  unsigned long startMicros = micros();
+  while (micros() - startMicros < FINGERPRINT_LOOP_BUDGET_US) {
+    if (job.file) {
+      size_t got = job.file.read(buf, sizeof(buf));
+      if (got > 0) {
+        contentHashUpdate(job.hasher, buf, got);
+        continue;
+      }
+      finishFingerprint();
+      continue;
+    }
+
+    LibraryFileEntry entry;
+    LibraryScanResult result = libraryScanStep(job.cursor, entry);
+    if (result == LIBRARY_SCAN_DONE) {
+      job.active = false;
+      job.lastPassEnd = millis();
+      Serial.printf("[HASH] Fingerprint pass complete: %u indexed, %lu duplicates (%llu bytes reclaimable)\n",
+                    static_cast<unsigned int>(pathFingerprints.size()),
+                    static_cast<unsigned long>(job.duplicateFiles),
+                    static_cast<unsigned long long>(job.duplicateBytes));
+      return;
+    }
+    if (result != LIBRARY_SCAN_FILE) {
+      continue;
+    }
+    auto known = pathFingerprints.find(entry.path);
+    if (known != pathFingerprints.end() && known->second.size == entry.size) {
+      continue;
+    }
+    job.file = SD.open(entry.sdPath.c_str(), FILE_READ);
+    if (!job.file) {
+      continue;
+    }
+    job.path = entry.path;
+    job.size = entry.size;
+    contentHashBegin(job.hasher);
+  }
+}
+
+// ----- Gzip sidecars -----
+
+uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t length) {
+#if defined(ARDUINO_ARCH_ESP32)
+  return esp_rom_crc32_le(crc, data, length);
+#else
+  crc = ~crc;
+  while (length--) {
+    crc ^= *data++;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ (0xEDB88320UL & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+#endif
+}
+
+bool isCompressibleBook(const String& path) {
+  const FileType* type = fileTypeFor(path);
+  return type && type->compressible;
+}
+
+void loadGzipCatalog() {
+  gzipSidecars.clear();
+  File catalog = SD.open(CATALOG_GZIP_PATH, FILE_READ);
+  if (!catalog) {
+    return;
+  }
+  while (catalog.available()) {
+    String line = catalog.readStringUntil('\n');
+    line.trim();
+    int tab1 = line.indexOf('\t');
+    int tab2 = tab1 >= 0 ? line.indexOf('\t', tab1 + 1) : -1;
+    if (tab1 < 0) {
+      continue;
+    }
+    String path = line.substring(0, tab1);
+    if (tab2 < 0) {
+      gzipSidecars.erase(path);  // "path\t-" tombstone
+      continue;
+    }
+    gzipSidecars[path] = GzipSidecar{static_cast<size_t>(line.substring(tab1 + 1, tab2).toInt()),
+                                     static_cast<size_t>(line.substring(tab2 + 1).toInt())};
+  }
+  catalog.close();
+  Serial.printf("[GZIP] Sidecar catalog loaded: %u entries\n", static_cast<unsigned int>(gzipSidecars.size()));
+}
+
+void recordGzipSidecar(const String& path, size_t sourceSize, size_t gzipSize) {
+  gzipSidecars[path] = GzipSidecar{sourceSize, gzipSize};
+  appendTsvLine(CATALOG_GZIP_PATH, path + "\t" + String(static_cast<unsigned long>(sourceSize)) + "\t" +
+                                       String(static_cast<unsigned long>(gzipSize)));
+}
+
+// Called when a book is replaced or removed; its sidecar no longer matches
+void dropGzipSidecar(const String& publicPath) {
+  if (gzipJob.path == publicPath) {
+    abortGzipBook(gzipJob);  // Compressing the old copy
+  }
+  auto sidecar = gzipSidecars.find(publicPath);
+  if (sidecar == gzipSidecars.end()) {
+    return;
+  }
+  if (sidecar->second.gzipSize > 0) {
+    String gzPath = libraryPhysicalPath(publicPath) + ".gz";
+    fileCacheInvalidate(gzPath);
+    if (SD.remove(gzPath)) {
+      noteStorageRemoved(gzPath, sidecar->second.gzipSize);
+      noteClustersResized(sidecar->second.gzipSize, 0);
+    }
+  }
+  gzipSidecars.erase(sidecar);
+  appendTsvLine(CATALOG_GZIP_PATH, publicPath + "\t-");
+}
+
+// Shifts the per-day buckets when the uptime day changes
+void rollGzipDays() {
+  unsigned long today = millis() / 86400000UL;
+  if (today != gzipCurrentDay) {
+    Serial.printf("[GZIP] Uptime day %lu: %llu bytes saved by sidecars\n", gzipCurrentDay,
+                  static_cast<unsigned long long>(gzipSavedBytesPerDay[0]));
+    unsigned long shift = std::min<unsigned long>(today - gzipCurrentDay, GZIP_DAYS_KEPT);
+    for (int i = GZIP_DAYS_KEPT - 1; i >= 0; --i) {
+      gzipSavedBytesPerDay[i] = i >= static_cast<int>(shift) ? gzipSavedBytesPerDay[i - shift] : 0;
+    }
+    gzipCurrentDay = today;
+  }
+}
+
+void noteGzipSaved(size_t bytes) {
+  rollGzipDays();
+  gzipSavedBytesPerDay[0] += bytes;
+  gzipSavedBytesTotal += bytes;
+  gzipServed++;
+}
+
+void gzipFlushOutput(GzipJob& job) {
+  if (job.outLen > 0) {
+    if (job.out.write(job.outBuf, job.outLen) != job.outLen) {
+      job.writeError = true;
+    }
+    job.outTotal += job.outLen;
+    job.outLen = 0;
+  }
+}
+
+void gzipPutByte(GzipJob& job, uint8_t value) {
+  job.outBuf[job.outLen++] = value;
+  if (job.outLen == sizeof(job.outBuf)) {
+    gzipFlushOutput(job);
+  }
+}
+
+// Deflate bit order: values go out LSB first
+void gzipPutBits(GzipJob& job, uint32_t value, uint8_t count) {
+  job.bitBuffer |= value << job.bitCount;
+  job.bitCount += count;
+  while (job.bitCount >= 8) {
+    gzipPutByte(job, job.bitBuffer & 0xFF);
+    job.bitBuffer >>= 8;
+    job.bitCount -= 8;
+  }
+}
+
+// Huffman codes go out MSB first, so reverse them into the LSB-first stream
+void gzipPutCode(GzipJob& job, uint32_t code, uint8_t length) {
+  uint32_t reversed = 0;
+  for (uint8_t i = 0; i < length; ++i) {
+    reversed = (reversed << 1) | ((code >> i) & 1);
+  }
+  gzipPutBits(job, reversed, length);
+}
+
+// Fixed literal/length code table from RFC 1951 section 3.2.6
+void gzipPutSymbol(GzipJob& job, uint16_t symbol) {
+  if (symbol < 144) {
+    gzipPutCode(job, 0x30 + symbol, 8);
+  } else if (symbol < 256) {
+    gzipPutCode(job, 0x190 + symbol - 144, 9);
+  } else if (symbol < 280) {
+    gzipPutCode(job, symbol - 256, 7);
+  } else {
+    gzipPutCode(job, 0xC0 + symbol - 280, 8);
+  }
+}
+
+void gzipPutMatch(GzipJob& job, uint16_t length, uint16_t distance) {
+  static const uint16_t LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27,
+                                           31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+  static const uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                           2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+  static const uint16_t DIST_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+                                         193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+                                         6145, 8193, 12289, 16385, 24577};
+  static const uint8_t DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                         6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+  int code = 28;
+  while (LENGTH_BASE[code] > length) {
+    code--;
+  }
+  gzipPutSymbol(job, 257 + code);
+  gzipPutBits(job, length - LENGTH_BASE[code], LENGTH_EXTRA[code]);
+
+  int dcode = 29;
+  while (DIST_BASE[dcode] > distance) {
+    dcode--;
+  }
+  gzipPutCode(job, dcode, 5);
+  gzipPutBits(job, distance - DIST_BASE[dcode], DIST_EXTRA[dcode]);
+}
+
+uint16_t gzipHash(const uint8_t* p) {
+  return ((p[0] << 8) ^ (p[1] << 4) ^ p[2]) & ((1 << GZIP_HASH_BITS) - 1);
+}
+
+// Links position pos into its hash chain; stored positions are offset by one so 0 means empty
+void gzipInsert(GzipJob& job, size_t pos) {
+  if (pos + 2 >= job.windowLen) {
+    return;
+  }
+  uint16_t h = gzipHash(job.window + pos);
+  job.prev[pos & (GZIP_WINDOW - 1)] = job.head[h];
+  job.head[h] = pos + 1;
+}
+
+size_t gzipLongestMatch(GzipJob& job, size_t& distance) {
+  size_t lookahead = job.windowLen - job.strStart;
+  size_t maxLength = std::min<size_t>(lookahead, 258);
+  if (maxLength < 3) {
+    return 0;
+  }
+  size_t best = 0;
+  uint16_t candidate = job.head[gzipHash(job.window + job.strStart)];
+  size_t limit = job.strStart > GZIP_WINDOW - GZIP_MIN_LOOKAHEAD ? job.strStart - (GZIP_WINDOW - GZIP_MIN_LOOKAHEAD) : 0;
+  const uint8_t* scan = job.window + job.strStart;
+  for (uint8_t chain = 0; candidate > 0 && chain < GZIP_MAX_CHAIN; ++chain) {
+    size_t pos = candidate - 1;
+    if (pos < limit || pos >= job.strStart) {
+      break;
+    }
+    const uint8_t* match = job.window + pos;
+    if (match[best] == scan[best] && match[0] == scan[0]) {
+      size_t length = 0;
+      while (length < maxLength && match[length] == scan[length]) {
+        length++;
+      }
+      if (length > best) {
+        best = length;
+        distance = job.strStart - pos;
+        if (length == maxLength) {
+          break;
+        }
+      }
+    }
+    candidate = job.prev[pos & (GZIP_WINDOW - 1)];
+  }
+  return best >= 3 ? best : 0;
+}
+
+void gzipSlideWindow(GzipJob& job) {
+  memmove(job.window, job.window + GZIP_WINDOW, GZIP_WINDOW);
+  job.windowLen -= GZIP_WINDOW;
+  job.strStart -= GZIP_WINDOW;
+  for (size_t i = 0; i < (1u << GZIP_HASH_BITS); ++i) {
+    job.head[i] = job.head[i] > GZIP_WINDOW ? job.head[i] - GZIP_WINDOW : 0;
+  }
+  for (size_t i = 0; i < GZIP_WINDOW; ++i) {
+    job.prev[i] = job.prev[i] > GZIP_WINDOW ? job.prev[i] - GZIP_WINDOW : 0;
+  }
+}
+
+void releaseGzipBook(GzipJob& job) {
+  if (job.in) {
+    job.in.close();
+  }
+  if (job.out) {
+    job.out.close();
+  }
+  free(job.window);
+  free(job.head);
+  free(job.prev);
+  job.window = nullptr;
+  job.head = nullptr;
+  job.prev = nullptr;
+}
+
+// Stops the book in progress and throws away its partial sidecar; the scan goes on
+void abortGzipBook(GzipJob& job) {
+  if (!job.in && !job.out) {
+    return;
+  }
+  releaseGzipBook(job);
+  SD.remove(job.sidecarPath + ".tmp");
+  Serial.println("[GZIP] Abandoned " + job.path);
+}
+
+bool beginGzipBook(GzipJob& job, const LibraryFileEntry& entry) {
+  job.path = entry.path;
+  job.sourceSize = entry.size;
+  job.sidecarPath = entry.sdPath + ".gz";
+  job.window = allocateStreamBuffer(GZIP_WINDOW * 2);
+  job.head = reinterpret_cast<uint16_t*>(calloc(1u << GZIP_HASH_BITS, sizeof(uint16_t)));
+  job.prev = reinterpret_cast<uint16_t*>(calloc(GZIP_WINDOW, sizeof(uint16_t)));
+  String tempPath = job.sidecarPath + ".tmp";
+  SD.remove(tempPath);  // Left over when a reboot interrupted this book
+  job.in = SD.open(entry.sdPath.c_str(), FILE_READ);
+  job.out = SD.open(tempPath.c_str(), FILE_WRITE);
+  if (!job.window || !job.head || !job.prev || !job.in || !job.out) {
+    releaseGzipBook(job);
+    SD.remove(tempPath);
+    return false;
+  }
+  job.windowLen = 0;
+  job.strStart = 0;
+  job.bitBuffer = 0;
+  job.bitCount = 0;
+  job.outLen = 0;
+  job.outTotal = 0;
+  job.crc = 0;
+  job.inputBytes = 0;
+  job.inputDone = false;
+  job.writeError = false;
+
+  // gzip member header: deflate, no flags, no mtime, unknown OS; then a final fixed-Huffman block
+  static const uint8_t header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+  for (uint8_t b : header) {
+    gzipPutByte(job, b);
+  }
+  gzipPutBits(job, 1, 1);
+  gzipPutBits(job, 1, 2);
+  return true;
+}
+
+void finishGzipBook(GzipJob& job) {
+  gzipPutSymbol(job, 256);
+  if (job.bitCount > 0) {
+    gzipPutBits(job, 0, 8 - job.bitCount);
+  }
+  for (int i = 0; i < 4; ++i) {
+    gzipPutByte(job, (job.crc >> (8 * i)) & 0xFF);
+  }
+  for (int i = 0; i < 4; ++i) {
+    gzipPutByte(job, (job.inputBytes >> (8 * i)) & 0xFF);
+  }
+  gzipFlushOutput(job);
+  size_t gzipSize = job.outTotal;
+  bool ok = !job.writeError && job.inputBytes == job.sourceSize;
+  releaseGzipBook(job);
+
+  String tempPath = job.sidecarPath + ".tmp";
+  if (!ok || gzipSize * 100 >= job.sourceSize * GZIP_MAX_RATIO_PERCENT) {
+    SD.remove(tempPath);
+    if (ok) {
+      recordGzipSidecar(job.path, job.sourceSize, 0);  // Remember not to try again
+    }
+    return;
+  }
+  fileCacheInvalidate(job.sidecarPath);
+  SD.remove(job.sidecarPath);
+  if (!SD.rename(tempPath, job.sidecarPath)) {
+    SD.remove(tempPath);
+    return;
+  }
+  noteStorageAdded(job.sidecarPath, gzipSize);
+  noteClustersResized(0, gzipSize);
+  recordGzipSidecar(job.path, job.sourceSize, gzipSize);
+  Serial.printf("[GZIP] %s: %u -> %u bytes\n", job.path.c_str(), static_cast<unsigned int>(job.sourceSize),
+                static_cast<unsigned int>(gzipSize));
+}
+
+// One compressor step: refill the window or emit one literal/match. False once the book is done.
+bool stepGzipBook(GzipJob& job) {
+  size_t lookahead = job.windowLen - job.strStart;
+  if (lookahead < GZIP_MIN_LOOKAHEAD && !job.inputDone) {
+    if (job.strStart >= GZIP_WINDOW * 2 - GZIP_MIN_LOOKAHEAD) {
+      gzipSlideWindow(job);
+    }
+    size_t room = std::min(GZIP_WINDOW * 2 - job.windowLen, GZIP_READ_CHUNK);
+    size_t got = room > 0 ? job.in.read(job.window + job.windowLen, room) : 0;
+    if (got == 0 && room > 0) {
+      job.inputDone = true;
+    }
+    job.crc = crc32Update(job.crc, job.window + job.windowLen, got);
+    job.inputBytes += got;
+    job.windowLen += got;
+    return true;
+  }
+  if (lookahead == 0) {
+    finishGzipBook(job);
+    return false;
+  }
+
+  size_t distance = 0;
+  size_t length = gzipLongestMatch(job, distance);
+  if (length > 0) {
+    gzipPutMatch(job, length, distance);
+    for (size_t i = 0; i < length; ++i) {
+      gzipInsert(job, job.strStart++);
+    }
+  } else {
+    gzipPutSymbol(job, job.window[job.strStart]);
+    gzipInsert(job, job.strStart++);
+  }
+  return true;
+}
+
+void processGzipJob() {
+  // Lowest priority: yield the card and CPU to transfers entirely, and sit out a shard
+  // migration so no sidecar is written beside a book that is about to move
+  if (!sdCardReady || !activeDownloads.empty() || uploadInProgress() ||
+      libraryLayout == LIBRARY_LAYOUT_MIGRATING) {
+    return;
+  }
+  GzipJob& job = gzipJob;
+  if (!job.active) {
+    if (!job.rescanRequested && millis() - job.lastPassEnd < GZIP_RESCAN_INTERVAL) {
+      return;
+    }
+    job.rescanRequested = false;
+    if (!libraryScanBegin(job.cursor, "/Alexandria")) {
+      job.lastPassEnd = millis();
+      return;
+    }
+    job.active = true;
+  }
+
+  unsigned long startMicros = micros();
+  uint16_t steps = 0;
+  while (true) {
+    if (job.in) {
+      if (!stepGzipBook(job)) {
+        continue;
+      }
+      // micros() per symbol would cost more than the symbol itself
+      if (++steps % 64 == 0 && micros() - startMicros >= GZIP_LOOP_BUDGET_US) {
+        return;
+      }
+      continue;
+    }
+    if (micros() - startMicros >= GZIP_LOOP_BUDGET_US) {
+      return;
+    }
+
+    LibraryFileEntry entry;
+    LibraryScanResult result = libraryScanStep(job.cursor, entry);
+    if (result == LIBRARY_SCAN_DONE) {
+      job.active = false;
+      job.lastPassEnd = millis();
+      return;
+    }
+    if (result != LIBRARY_SCAN_FILE || entry.size < GZIP_MIN_SOURCE || !isCompressibleBook(entry.path)) {
+      continue;
+    }
+    auto known = gzipSidecars.find(entry.path);
+    if (known != gzipSidecars.end() && known->second.sourceSize == entry.size) {
+      continue;
+    }
+    beginGzipBook(job, entry);
+  }
+}
+
+// ----- Paged reader -----
+
+ReaderFormat readerFormat(const String& path) {
+  const FileType* type = fileTypeFor(path);
+  return type ? type->reader : READER_NONE;
+}
+
+// Called when a book is replaced or removed; its page boundaries no longer apply
+void dropPageIndex(const String& publicPath) {
+  String indexPath = libraryPhysicalPath(publicPath) + PAGE_INDEX_SUFFIX;
+  fileCacheInvalidate(indexPath);
+  SD.remove(indexPath);
+}
+
+// The encoding comes from the book and ends up in a Content-Type header: charset names only
+void checkPageEncoding(char* encoding) {
+  bool ok = encoding[0] != '\0';
+  for (const char* c = encoding; *c && ok; ++c) {
+    ok = (*c >= 'a' && *c <= 'z') || (*c >= '0' && *c <= '9') || *c == '_' || *c == '-';
+  }
+  if (!ok) {
+    strcpy(encoding, "utf-8");
+  }
+}
+
+bool readPageIndexInfo(File& index, size_t sourceSize, PageIndexInfo& info) {
+  uint32_t header[3];
+  if (index.size() < PAGE_INDEX_HEADER + 4 || index.read(reinterpret_cast<uint8_t*>(header), 12) != 12 ||
+      header[0] != PAGE_INDEX_MAGIC || header[1] != sourceSize) {
+    return false;
+  }
+  info.format = header[2];
+  index.read(reinterpret_cast<uint8_t*>(info.encoding), sizeof(info.encoding));
+  info.encoding[sizeof(info.encoding) - 1] = '\0';
+  checkPageEncoding(info.encoding);
+
+  uint32_t entries = (index.size() - PAGE_INDEX_HEADER) / 4;
+  uint32_t tail;
+  index.seek(PAGE_INDEX_HEADER + (entries - 1) * 4);
+  index.read(reinterpret_cast<uint8_t*>(&tail), 4);
+  info.complete = tail == PAGE_INDEX_END;
+  info.boundaries = info.complete ? entries - 1 : entries;
+  index.seek(PAGE_INDEX_HEADER + (info.boundaries - 1) * 4);
+  index.read(reinterpret_cast<uint8_t*>(&info.lastOffset), 4);
+  return true;
+}
+
+// Starts an index: FB2 pages begin at <body> (the description is metadata) and carry their encoding
+bool createPageIndex(const String& indexPath, File& book, ReaderFormat format, PageIndexInfo& info) {
+  static uint8_t buffer[READER_PAGE_BYTES];  // Too big for the ESP8266's 4 KB stack
+  memset(info.encoding, 0, sizeof(info.encoding));
+  strcpy(info.encoding, "utf-8");
+  uint32_t start = 0;
+  if (format == READER_FB2) {
+    book.seek(0);
+    size_t got = book.read(buffer, sizeof(buffer));
+    int declaration = findBytes(buffer, got, "encoding=\"");
+    if (declaration >= 0) {
+      size_t i = declaration + 10;
+      size_t n = 0;
+      while (i < got && buffer[i] != '"' && n < sizeof(info.encoding) - 1) {
+        info.encoding[n++] = tolower(buffer[i++]);
+      }
+      info.encoding[n] = '\0';
+      checkPageEncoding(info.encoding);
+    }
+    // Overlap reads by a few bytes so a tag split across two reads is still found
+    for (uint32_t offset = 0; offset < READER_BODY_SEARCH && got > 5; offset += got - 5) {
+      book.seek(offset);
+      got = book.read(buffer, sizeof(buffer));
+      int body = findBytes(buffer, got, "<body");
+      if (body >= 0) {
+        start = offset + body;
+        break;
+      }
+    }
+  }
+
+  File index = SD.open(indexPath.c_str(), FILE_WRITE);
+  if (!index) {
+    return false;
+  }
+  uint32_t header[3] = {PAGE_INDEX_MAGIC, static_cast<uint32_t>(book.size()), static_cast<uint32_t>(format)};
+  bool ok = index.write(reinterpret_cast<uint8_t*>(header), 12) == 12 &&
+            index.write(reinterpret_cast<uint8_t*>(info.encoding), sizeof(info.encoding)) == sizeof(info.encoding) &&
+            index.write(reinterpret_cast<uint8_t*>(&start), 4) == 4;
+  index.close();
+  info.format = format;
+  info.boundaries = 1;
+  info.lastOffset = start;
+  info.complete = false;
+  return ok;
+}
+
+// Where the page starting at `start` should end: after a line break (text) or a tag (FB2),
+// never inside a UTF-8 sequence. `last` is set when the page reaches the end of readable text.
+uint32_t readerPageEnd(File& book, uint32_t start, ReaderFormat format, bool& last) {
+  static uint8_t buffer[READER_PAGE_BYTES + 1];  // One byte past the page to see what the next one starts with
+  book.seek(start);
+  size_t got = book.read(buffer, sizeof(buffer));
+  last = false;
+  if (format == READER_FB2) {
+    // Embedded images follow the text as base64 <binary> blocks
+    int binary = findBytes(buffer, got, "<binary");
+    if (binary >= 0) {
+      last = true;
+      return start + binary;
+    }
+  }
+  if (got <= READER_PAGE_BYTES) {
+    last = true;
+    return start + got;
+  }
+
+  const size_t window = READER_PAGE_BYTES;
+  size_t cut = 0;
+  for (size_t i = window; i > window / 2 && cut == 0; --i) {
+    if (format == READER_FB2 ? buffer[i - 1] == '>' : buffer[i - 1] == '\n') {
+      cut = i;
+    }
+  }
+  if (format == READER_TEXT) {
+    for (size_t i = window; i > window / 2 && cut == 0; --i) {
+      if (buffer[i - 1] == ' ') {
+        cut = i;
+      }
+    }
+  }
+  if (cut == 0) {
+    cut = window;
+    while (cut > 1 && (buffer[cut] & 0xC0) == 0x80) {
+      cut--;
+    }
+  }
+  return start + cut;
+}
+
+// Opens (or lazily creates) the index and extends it until `page` is bounded or the budget runs out
+bool ensurePageIndex(const String& sdPath, File& book, ReaderFormat format, uint32_t page, PageIndexInfo& info) {
+  String indexPath = sdPath + PAGE_INDEX_SUFFIX;
+  File index = SD.open(indexPath.c_str(), FILE_READ);
+  bool valid = index && readPageIndexInfo(index, book.size(), info);
+  if (index) {
+    index.close();
+  }
+  if (!valid) {
+    SD.remove(indexPath);
+    if (!createPageIndex(indexPath, book, format, info)) {
+      Serial.println("[READ][ERROR] Cannot create page index: " + indexPath);
+      return false;
+    }
+  }
+  if (info.complete || info.boundaries > page + 1) {
+    return true;
+  }
+
+  index = SD.open(indexPath.c_str(), FILE_APPEND);
+  if (!index) {
+    return false;
+  }
+  unsigned long startMicros = micros();
+  uint16_t added = 0;
+  while (!info.complete && info.boundaries <= page + 1 && added < READER_EXTEND_PAGES) {
+    bool last;
+    uint32_t end = readerPageEnd(book, info.lastOffset, format, last);
+    if (end > info.lastOffset) {
+      index.write(reinterpret_cast<uint8_t*>(&end), 4);
+      info.boundaries++;
+      info.lastOffset = end;
+      added++;
+    } else {
+      last = true;
+    }
+    if (last) {
+      uint32_t marker = PAGE_INDEX_END;
+      index.write(reinterpret_cast<uint8_t*>(&marker), 4);
+      info.complete = true;
+    }
+  }
+  index.close();
+  Serial.printf("[READ] Indexed %u pages of %s in %lu us%s\n", added, sdPath.c_str(), micros() - startMicros,
+                info.complete ? " (complete)" : "");
+  return true;
+}
+
+// ----- Metadata extraction helpers -----
+
+int findBytes(const uint8_t* haystack, size_t length, const char* needle) {
+  size_t needleLen = strlen(needle);
+  if (needleLen == 0 || length < needleLen) {
+    return -1;
+  }
+  for (size_t i = 0; i + needleLen <= length; ++i) {
+    if (memcmp(haystack + i, needle, needleLen) == 0) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+int findLastBytes(const uint8_t* haystack, size_t length, const char* needle) {
+  size_t needleLen = strlen(needle);
+  if (needleLen == 0 || length < needleLen) {
+    return -1;
+  }
+  for (size_t i = length - needleLen + 1; i-- > 0;) {
+    if (memcmp(haystack + i, needle, needleLen) == 0) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+uint16_t readLe16(const uint8_t* p) {
+  return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+uint32_t readLe32(const uint8_t* p) {
+  return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+         (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+size_t readFileAt(File& file, uint32_t offset, uint8_t* buf, size_t length) {
+  if (!file.seek(offset)) {
+    return 0;
+  }
+  size_t got = file.read(buf, length);
+  metadataJob.bytesRead += got;
+  return got;
+}
+
+void appendUtf8(String& out, uint32_t codepoint) {
+  if (codepoint < 0x80) {
+    out += static_cast<char>(codepoint);
+  } else if (codepoint < 0x800) {
+    out += static_cast<char>(0xC0 | (codepoint >> 6));
+    out += static_cast<char>(0x80 | (codepoint & 0x3F));
+  } else if (codepoint < 0x10000) {
+    out += static_cast<char>(0xE0 | (codepoint >> 12));
+    out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (codepoint & 0x3F));
+  } else {
+    out += static_cast<char>(0xF0 | (codepoint >> 18));
+    out += static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F));
+    out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (codepoint & 0x3F));
+  }
+}
+
+String decodeXmlText(const String& raw) {
+  String out;
+  out.reserve(raw.length());
+  for (size_t i = 0; i < raw.length(); ++i) {
+    char c = raw.charAt(i);
+    if (c != '&') {
+      out += c;
+      continue;
+    }
+    int semi = raw.indexOf(';', i);
+    if (semi < 0 || semi - static_cast<int>(i) > 10) {
+      out += c;
+      continue;
+    }
+    String entity = raw.substring(i + 1, semi);
+    if (entity == "amp") out += '&';
+    else if (entity == "lt") out += '<';
+    else if (entity == "gt") out += '>';
+    else if (entity == "quot") out += '"';
+    else if (entity == "apos") out += '\'';
+    else if (entity.startsWith("#x") || entity.startsWith("#X")) appendUtf8(out, strtoul(entity.c_str() + 2, nullptr, 16));
+    else if (entity.startsWith("#")) appendUtf8(out, strtoul(entity.c_str() + 1, nullptr, 10));
+    else out += "&" + entity + ";";
+    i = semi;
+  }
+  return out;
+}
+
+// Returns the text of the first <dc:name> (or unprefixed <name>) element
+String extractXmlElement(const String& xml, const char* name) {
+  String openTag = String("<dc:") + name;
+  int start = xml.indexOf(openTag);
+  if (start < 0) {
+    openTag = String("<") + name;
+    start = xml.indexOf(openTag + ">");
+    if (start < 0) {
+      start = xml.indexOf(openTag + " ");
+    }
+  }
+  if (start < 0) {
+    return "";
+  }
+  int contentStart = xml.indexOf('>', start);
+  if (contentStart < 0 || xml.charAt(contentStart - 1) == '/') {
+    return "";
+  }
+  int contentEnd = xml.indexOf('<', contentStart + 1);
+  if (contentEnd < 0) {
+    return "";
+  }
+  return sanitizeCatalogField(decodeXmlText(xml.substring(contentStart + 1, contentEnd)));
+}
+
+// Decodes a PDF literal "(...)" or hex "<...>" string starting at buf[pos]
+String decodePdfString(const uint8_t* buf, size_t length, size_t pos) {
+  String bytes;
+  if (pos >= length) {
+    return "";
+  }
+  if (buf[pos] == '(') {
+    int depth = 1;
+    for (size_t i = pos + 1; i < length && depth > 0; ++i) {
+      uint8_t c = buf[i];
+      if (c == '\\' && i + 1 < length) {
+        uint8_t e = buf[++i];
+        switch (e) {
+          case 'n': bytes += '\n'; break;
+          case 'r': bytes += '\r'; break;
+          case 't': bytes += '\t'; break;
+          case 'b': bytes += '\b'; break;
+          case 'f': bytes += '\f'; break;
+          case '\r': case '\n': break;
+          default:
+            if (e >= '0' && e <= '7') {
+              int value = e - '0';
+              for (int d = 0; d < 2 && i + 1 < length && buf[i + 1] >= '0' && buf[i + 1] <= '7'; ++d) {
+                value = value * 8 + (buf[++i] - '0');
+              }
+              bytes += static_cast<char>(value & 0xFF);
+            } else {
+              bytes += static_cast<char>(e);
+            }
+        }
+        continue;
+      }
+      if (c == '(') depth++;
+      if (c == ')' && --depth == 0) break;
+      bytes += static_cast<char>(c);
+    }
+  } else if (buf[pos] == '<' && pos + 1 < length && buf[pos + 1] != '<') {
+    int high = -1;
+    for (size_t i = pos + 1; i < length && buf[i] != '>'; ++i) {
+      int nibble = -1;
+      uint8_t c = buf[i];
+      if (c >= '0' && c <= '9') nibble = c - '0';
+      else if (c >= 'a' && c <= 'f') nibble = c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+      if (nibble < 0) continue;
+      if (high < 0) {
+        high = nibble;
+      } else {
+        bytes += static_cast<char>((high << 4) | nibble);
+        high = -1;
+      }
+    }
+  } else {
+    return "";
+  }
+
+  // UTF-16BE with BOM, otherwise treat PDFDocEncoding as Latin-1
+  String out;
+  size_t n = bytes.length();
+  if (n >= 2 && static_cast<uint8_t>(bytes.charAt(0)) == 0xFE && static_cast<uint8_t>(bytes.charAt(1)) == 0xFF) {
+    for (size_t i = 2; i + 1 < n; i += 2) {
+      uint32_t unit = (static_cast<uint8_t>(bytes.charAt(i)) << 8) | static_cast<uint8_t>(bytes.charAt(i + 1));
+      if (unit >= 0xD800 && unit <= 0xDBFF && i + 3 < n) {
+        uint32_t low = (static_cast<uint8_t>(bytes.charAt(i + 2)) << 8) | static_cast<uint8_t>(bytes.charAt(i + 3));
+        unit = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+        i += 2;
+      }
+      appendUtf8(out, unit);
+    }
+  } else {
+    for (size_t i = 0; i < n; ++i) {
+      appendUtf8(out, static_cast<uint8_t>(bytes.charAt(i)));
+    }
+  }
+  return sanitizeCatalogField(out);
+}
+
+// Parses "/Key N G R" and returns N, or -1
+long findPdfReference(const uint8_t* buf, size_t length, const char* key) {
+  int at = findLastBytes(buf, length, key);
+  if (at < 0) {
+    return -1;
+  }
+  size_t i = at + strlen(key);
+  while (i < length && isspace(buf[i])) i++;
+  long number = 0;
+  bool any = false;
+  while (i < length && isdigit(buf[i])) {
+    number = number * 10 + (buf[i++] - '0');
+    any = true;
+  }
+  return any ? number : -1;
+}
+
+String findPdfStringValue(const uint8_t* buf, size_t length, const char* key) {
+  int at = findBytes(buf, length, key);
+  if (at < 0) {
+    return "";
+  }
+  size_t i = at + strlen(key);
+  while (i < length && isspace(buf[i])) i++;
+  return decodePdfString(buf, length, i);
+}
+
+void releaseMetadataFile() {
+  if (metadataJob.file) {
+    metadataJob.file.close();
+  }
+  if (metadataJob.xmlBuf) {
+    free(metadataJob.xmlBuf);
+    metadataJob.xmlBuf = nullptr;
+  }
+#if HAS_ROM_INFLATE
+  if (metadataJob.inflator) {
+    free(metadataJob.inflator);
+    metadataJob.inflator = nullptr;
+  }
+#endif
+  metadataJob.xmlLen = 0;
+}
+
+void beginEpubEntryLookup(const String& entryName) {
+  metadataJob.entryName = entryName;
+  metadataJob.cdPos = metadataJob.cdOffset;
+  metadataJob.phase = META_EPUB_CENTRAL_DIR;
+}
+
+void beginPdfObjectLookup(long objectNumber) {
+  metadataJob.targetObj = objectNumber;
+  metadataJob.xrefPos = metadataJob.xrefOffset;
+  metadataJob.xrefSections = 0;
+  metadataJob.phase = META_PDF_XREF;
+}
+
+// Starts extraction for one file; returns false when the catalog is already current
+bool beginMetadataExtraction(const LibraryFileEntry& entry) {
+  auto cached = libraryCatalog.find(entry.path);
+  if (cached != libraryCatalog.end() && cached->second.size == entry.size) {
+    return false;
+  }
+
+  String lowerPath = entry.path;
+  lowerPath.toLowerCase();
+  bool isEpub = lowerPath.endsWith(".epub");
+  bool isPdf = lowerPath.endsWith(".pdf");
+
+  metadataJob.path = entry.path;
+  metadataJob.fileSize = entry.size;
+  metadataJob.result = BookMetadata{entry.size, "", "", ""};
+  metadataJob.readingOpf = false;
+  metadataJob.infoObj = -1;
+  metadataJob.rootObj = -1;
+  metadataJob.readingRoot = false;
+
+  if (!isEpub && !isPdf) {
+    metadataJob.phase = META_STORE;
+    return true;
+  }
+
+  metadataJob.file = SD.open(entry.sdPath.c_str(), FILE_READ);
+  if (!metadataJob.file) {
+    metadataJob.phase = META_STORE;
+    return true;
+  }
+  metadataJob.phase = isEpub ? META_EPUB_EOCD : META_PDF_TAIL;
+  return true;
+}
+
+void stepEpubEocd() {
+  uint8_t buf[METADATA_READ_CHUNK + 22];
+  size_t tail = std::min<size_t>(metadataJob.fileSize, sizeof(buf));
+  size_t got = readFileAt(metadataJob.file, metadataJob.fileSize - tail, buf, tail);
+  int at = findLastBytes(buf, got, "PK\x05\x06");
+  if (at < 0 || static_cast<size_t>(at) + 22 > got) {
+    metadataJob.phase = META_STORE;
+    return;
+  }
+  uint32_t cdSize = readLe32(buf + at + 12);
+  metadataJob.cdOffset = readLe32(buf + at + 16);
+  metadataJob.cdEnd = metadataJob.cdOffset + cdSize;
+  if (metadataJob.cdEnd > metadataJob.fileSize) {
+    metadataJob.phase = META_STORE;
+    return;
+  }
+  beginEpubEntryLookup("META-INF/container.xml");
+}
+
+void stepEpubCentralDirectory() {
+  if (metadataJob.cdPos >= metadataJob.cdEnd) {
+    metadataJob.phase = META_STORE;  // Entry not present
+    return;
+  }
+  uint8_t buf[METADATA_READ_CHUNK];
+  size_t want = std::min<size_t>(sizeof(buf), metadataJob.cdEnd - metadataJob.cdPos);
+  size_t got = readFileAt(metadataJob.file, metadataJob.cdPos, buf, want);
+
+  size_t offset = 0;
+  while (offset + 46 <= got) {
+    if (readLe32(buf + offset) != 0x02014b50) {
+      metadataJob.phase = META_STORE;
+      return;
+    }
+    uint16_t nameLen = readLe16(buf + offset + 28);
+    size_t total = 46 + nameLen + readLe16(buf + offset + 30) + readLe16(buf + offset + 32);
+    if (offset + 46 + nameLen > got) {
+      break;
+    }
+    if (nameLen == metadataJob.entryName.length() &&
+        memcmp(buf + offset + 46, metadataJob.entryName.c_str(), nameLen) == 0) {
+      metadataJob.entryMethod = readLe16(buf + offset + 10);
+      metadataJob.entryCompSize = readLe32(buf + offset + 20);
+      metadataJob.entryOffset = readLe32(buf + offset + 42);
+      metadataJob.phase = META_EPUB_LOCAL_HEADER;
+      return;
+    }
+    offset += total;
+  }
+
+  if (offset == 0) {
+    metadataJob.phase = META_STORE;  // Single entry larger than the read window
+    return;
+  }
+  metadataJob.cdPos += offset;
+}
+
+void stepEpubLocalHeader() {
+  uint8_t header[30];
+  if (readFileAt(metadataJob.file, metadataJob.entryOffset, header, sizeof(header)) != sizeof(header) ||
+      readLe32(header) != 0x04034b50) {
+    metadataJob.phase = META_STORE;
+    return;
+  }
+  metadataJob.entryOffset += sizeof(header) + readLe16(header + 26) + readLe16(header + 28);
+  metadataJob.entryPos = 0;
+  metadataJob.xmlLen = 0;
+
+  bool supported = metadataJob.entryMethod == 0;
+#if HAS_ROM_INFLATE
+  if (metadataJob.entryMethod == 8) {
+    if (!metadataJob.inflator) {
+      metadataJob.inflator = static_cast<tinfl_decompressor*>(malloc(sizeof(tinfl_decompressor)));
+    }
+    if (metadataJob.inflator) {
+      tinfl_init(metadataJob.inflator);
+      supported = true;
+    }
+  }
+#endif
+  if (!metadataJob.xmlBuf) {
+    metadataJob.xmlBuf = static_cast<uint8_t*>(malloc(METADATA_XML_LIMIT));
+  }
+  if (!supported || !metadataJob.xmlBuf) {
+    metadataJob.phase = META_STORE;
+    return;
+  }
+  metadataJob.phase = META_EPUB_READ_ENTRY;
+}
+
+void finishEpubEntry() {
+  String xml;
+  xml.reserve(metadataJob.xmlLen);
+  xml.concat(reinterpret_cast<const char*>(metadataJob.xmlBuf), metadataJob.xmlLen);
+
+  if (!metadataJob.readingOpf) {
+    int attr = xml.indexOf("full-path=\"");
+    if (attr < 0) {
+      metadataJob.phase = META_STORE;
+      return;
+    }
+    attr += 11;
+    int end = xml.indexOf('"', attr);
+    if (end < 0) {
+      metadataJob.phase = META_STORE;
+      return;
+    }
+    metadataJob.readingOpf = true;
+    beginEpubEntryLookup(xml.substring(attr, end));
+    return;
+  }
+
+  metadataJob.result.title = extractXmlElement(xml, "title");
+  metadataJob.result.author = extractXmlElement(xml, "creator");
+  metadataJob.result.language = extractXmlElement(xml, "language");
+  metadataJob.phase = META_STORE;
+}
+
+void stepEpubReadEntry() {
+  uint8_t buf[METADATA_READ_CHUNK];
+  uint32_t remaining = metadataJob.entryCompSize - metadataJob.entryPos;
+  size_t want = std::min<size_t>(sizeof(buf), remaining);
+  size_t got = want > 0 ? readFileAt(metadataJob.file, metadataJob.entryOffset + metadataJob.entryPos, buf, want) : 0;
+  bool finished = false;
+
+  if (metadataJob.entryMethod == 0) {
+    size_t copy = std::min(got, METADATA_XML_LIMIT - metadataJob.xmlLen);
+    memcpy(metadataJob.xmlBuf + metadataJob.xmlLen, buf, copy);
+    metadataJob.xmlLen += copy;
+    metadataJob.entryPos += got;
+    finished = got == 0 || metadataJob.entryPos >= metadataJob.entryCompSize || metadataJob.xmlLen >= METADATA_XML_LIMIT;
+  }
+#if HAS_ROM_INFLATE
+  else {
+    size_t inBytes = got;
+    size_t outBytes = METADATA_XML_LIMIT - metadataJob.xmlLen;
+    bool moreInput = metadataJob.entryPos + got < metadataJob.entryCompSize;
+    tinfl_status status = tinfl_decompress(metadataJob.inflator, buf, &inBytes,
+                                           metadataJob.xmlBuf, metadataJob.xmlBuf + metadataJob.xmlLen, &outBytes,
+                                           TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF |
+                                           (moreInput ? TINFL_FLAG_HAS_MORE_INPUT : 0));
+    metadataJob.entryPos += inBytes;
+    metadataJob.xmlLen += outBytes;
+    // HAS_MORE_OUTPUT means the bounded buffer is full; the metadata block sits near the top
+    finished = status != TINFL_STATUS_NEEDS_MORE_INPUT || got == 0 || metadataJob.xmlLen >= METADATA_XML_LIMIT;
+    if (status < TINFL_STATUS_DONE) {
+      metadataJob.phase = META_STORE;
+      return;
+    }
+  }
+#endif
+
+  if (finished) {
+    finishEpubEntry();
+  }
+}
+
+void stepPdfTail() {
+  uint8_t buf[METADATA_READ_CHUNK];
+  size_t tail = std::min<size_t>(metadataJob.fileSize, sizeof(buf));
+  size_t got = readFileAt(metadataJob.file, metadataJob.fileSize - tail, buf, tail);
+
+  int at = findLastBytes(buf, got, "startxref");
+  if (at < 0) {
+    metadataJob.phase = META_STORE;
+    return;
+  }
+  size_t i = at + 9;
+  while (i < got && isspace(buf[i])) i++;
+  uint32_t offset = 0;
+  while (i < got && isdigit(buf[i])) {
+    offset = offset * 10 + (buf[i++] - '0');
+  }
+  metadataJob.xrefOffset = offset;
+  metadataJob.infoObj = findPdfReference(buf, got, "/Info");
+  metadataJob.rootObj = findPdfReference(buf, got, "/Root");
+
+  // Only classic xref tables are followed; xref streams keep the file name as title
+  if (metadataJob.infoObj >= 0) {
+    beginPdfObjectLookup(metadataJob.infoObj);
+  } else if (metadataJob.rootObj >= 0) {
+    metadataJob.readingRoot = true;
+    beginPdfObjectLookup(metadataJob.rootObj);
+  } else {
+    metadataJob.phase = META_STORE;
+  }
+}
+
+void stepPdfXref() {
+  uint8_t buf[128];
+  size_t got = readFileAt(metadataJob.file, metadataJob.xrefPos, buf, sizeof(buf));
+  size_t i = 0;
+  if (metadataJob.xrefPos == metadataJob.xrefOffset) {
+    if (got < 4 || memcmp(buf, "xref", 4) != 0) {
+      metadataJob.phase = META_STORE;
+      return;
+    }
+    i = 4;
+  }
+  while (i < got && isspace(buf[i])) i++;
+  if (i < got && buf[i] == 't') {
+    metadataJob.phase = META_STORE;  // Reached "trailer" without finding the object
+    return;
+  }
+
+  long first = 0;
+  long count = 0;
+  while (i < got && isdigit(buf[i])) first = first * 10 + (buf[i++] - '0');
+  while (i < got && buf[i] == ' ') i++;
+  while (i < got && isdigit(buf[i])) count = count * 10 + (buf[i++] - '0');
+  while (i < got && isspace(buf[i])) i++;
+  if (i >= got || count <= 0) {
+    metadataJob.phase = META_STORE;
+    return;
+  }
+
+  uint32_t entriesStart = metadataJob.xrefPos + i;
+  if (metadataJob.targetObj >= first && metadataJob.targetObj < first + count) {
+    metadataJob.xrefPos = entriesStart + 20 * (metadataJob.targetObj - first);
+    metadataJob.phase = META_PDF_XREF_ENTRY;
+    return;
+  }
+  if (++metadataJob.xrefSections >= PDF_MAX_XREF_SECTIONS) {
+    metadataJob.phase = META_STORE;
+    return;
+  }
+  metadataJob.xrefPos = entriesStart + 20 * count;
+}
+
+void stepPdfXrefEntry() {
+  uint8_t entry[20];
+  if (readFileAt(metadataJob.file, metadataJob.xrefPos, entry, sizeof(entry)) != sizeof(entry) || entry[17] != 'n') {
+    metadataJob.phase = META_STORE;
+    return;
+  }
+  uint32_t offset = 0;
+  for (int i = 0; i < 10; ++i) {
+    offset = offset * 10 + (entry[i] - '0');
+  }
+  metadataJob.objectOffset = offset;
+  metadataJob.phase = META_PDF_OBJECT;
+}
+
+void stepPdfObject() {
+  uint8_t buf[METADATA_READ_CHUNK];
+  size_t got = readFileAt(metadataJob.file, metadataJob.objectOffset, buf, sizeof(buf));
+  int endObj = findBytes(buf, got, "endobj");
+  if (endObj >= 0) {
+    got = endObj;
+  }
+
+  if (!metadataJob.readingRoot) {
+    metadataJob.result.title = findPdfStringValue(buf, got, "/Title");
+    metadataJob.result.author = findPdfStringValue(buf, got, "/Author");
+    if (metadataJob.rootObj >= 0) {
+      metadataJob.readingRoot = true;
+      beginPdfObjectLookup(metadataJob.rootObj);
+      return;
+    }
+  } else {
+    metadataJob.result.language = findPdfStringValue(buf, got, "/Lang");
+  }
+  metadataJob.phase = META_STORE;
+}
+
+void storeMetadataResult() {
+  releaseMetadataFile();
+  appendCatalogEntry(metadataJob.path, metadataJob.result);
+  metadataJob.booksExtracted++;
+  if (metadataJob.result.title.length() > 0) {
+    Serial.printf("[META] %s -> \"%s\" / \"%s\" [%s]\n",
+                  metadataJob.path.c_str(),
+                  metadataJob.result.title.c_str(),
+                  metadataJob.result.author.c_str(),
+                  metadataJob.result.language.c_str());
+  }
+  metadataJob.phase = META_SCAN;
+}
+
+void requestMetadataRescan() {
+  metadataJob.rescanRequested = true;
+}
+
+// Runs bounded extraction steps until the per-loop budget is spent
+void processMetadataExtraction() {
+  if (!sdCardReady) {
+    return;
+  }
+
+  unsigned long now = millis();
+  if (metadataJob.phase == META_IDLE) {
+    if (!metadataJob.rescanRequested && now - metadataJob.lastPassEnd < METADATA_RESCAN_INTERVAL) {
+      return;
+    }
+    if (!libraryScanBegin(metadataJob.cursor, "/Alexandria")) {
+      metadataJob.rescanRequested = false;
+      metadataJob.lastPassEnd = now;
+      return;
+    }
+    metadataJob.rescanRequested = false;
+    metadataJob.passStart = now;
+    metadataJob.booksSeen = 0;
+    metadataJob.booksExtracted = 0;
+    metadataJob.bytesRead = 0;
+    metadataJob.busyMicros = 0;
+    metadataJob.phase = META_SCAN;
+  }
+
+  unsigned long startMicros = micros();
+  while (micros() - startMicros < METADATA_LOOP_BUDGET_US) {
+    switch (metadataJob.phase) {
+      case META_SCAN: {
+        LibraryFileEntry entry;
+        LibraryScanResult result = libraryScanStep(metadataJob.cursor, entry);
+        if (result == LIBRARY_SCAN_DONE) {
+          metadataJob.busyMicros += micros() - startMicros;
+          metadataJob.phase = META_IDLE;
+          metadataJob.lastPassEnd = millis();
+          unsigned long busyMs = static_cast<unsigned long>(metadataJob.busyMicros / 1000ULL);
+          Serial.printf("[META] Pass complete: %lu books, %lu extracted, %lu KB read, %lu ms busy (%.1f books/s busy)\n",
+                        static_cast<unsigned long>(metadataJob.booksSeen),
+                        static_cast<unsigned long>(metadataJob.booksExtracted),
+                        static_cast<unsigned long>(metadataJob.bytesRead / 1024ULL),
+                        busyMs,
+                        busyMs > 0 ? metadataJob.booksExtracted * 1000.0 / busyMs : 0.0);
+          return;
+        }
+        if (result == LIBRARY_SCAN_FILE) {
+          metadataJob.booksSeen++;
+          beginMetadataExtraction(entry);
+        }
+        break;
+      }
+      case META_EPUB_EOCD: stepEpubEocd(); break;
+      case META_EPUB_CENTRAL_DIR: stepEpubCentralDirectory(); break;
+      case META_EPUB_LOCAL_HEADER: stepEpubLocalHeader(); break;
+      case META_EPUB_READ_ENTRY: stepEpubReadEntry(); break;
+      case META_PDF_TAIL: stepPdfTail(); break;
+      case META_PDF_XREF: stepPdfXref(); break;
+      case META_PDF_XREF_ENTRY: stepPdfXrefEntry(); break;
+      case META_PDF_OBJECT: stepPdfObject(); break;
+      case META_STORE: storeMetadataResult(); break;
+      case META_IDLE: return;
+    }
+  }
+  metadataJob.busyMicros += micros() - startMicros;
+}
+
+bool initializeSdCard() {
+  Serial.println("[SD] ----- Initialization Start -----");
+  Serial.printf("[SD] Configured CS pin: %d\n", SD_CS_PIN);
+  Serial.println("[SD] Attempting to mount card...");
+
+  pinMode(SD_CS_PIN, OUTPUT);
+  digitalWrite(SD_CS_PIN, HIGH);
+
+#if defined(ARDUINO_ARCH_ESP32)
+  SPI.begin(SCK, MISO, MOSI, SD_CS_PIN);
+#else
+  SPI.begin();
+#endif
+
+  //#if HAS_SD2CARD_HELPER
+  //    Serial.println("[SD] Performing low-level card.init verification (SPI_HALF_SPEED)");
+  //    Sd2Card card;
+  //    if (!card.init(SPI_HALF_SPEED, SD_CS_PIN)) {
+  //        Serial.printf("[SD][ERROR] card.init failed (code=%u, data=%u)\n", card.errorCode(), card.errorData());
+  //        Serial.println("[SD][HINT] Check wiring, ensure the card is inserted, and verify CS pin wiring");
+  //        Serial.println("[SD] ----- Initialization Aborted -----");
+  //        return false;
+  //   }
+
+  // const uint8_t detectedType = card.type();
+  //const char* typeLabel = "Unknown";
+  //switch (detectedType) {
+  //   case SD_CARD_TYPE_SD1:
+  //      typeLabel = "SD1";
+  //     break;
+  //  case SD_CARD_TYPE_SD2:
+  //     typeLabel = "SD2";
+  //     break;
+  // case SD_CARD_TYPE_SDHC:
+  //     typeLabel = "SDHC";
+  //     break;
+  //  default:
+  //      break;
+  // }
+
+  //   Serial.printf("[SD] card.init succeeded; detected type: %s\n", typeLabel);
+  //#else
+  //   Serial.println("[SD][WARN] card.init helper unavailable; skipping low-level verification");
+  //#endif
+
+#if defined(ARDUINO_ARCH_ESP32)
+  if (!SD.begin(SD_CS_PIN, SPI, sdSpiClockHz, SD_MOUNT_POINT, SD_MAX_OPEN_FILES)) {
+#else
+  if (!SD.begin(SD_CS_PIN)) {
+#endif
+    Serial.println("[SD][ERROR] SD.begin failed; card not available");
+    Serial.println("[SD] ----- Initialization Aborted -----");
+    return false;
+  }
+
+  Serial.println("[SD] Card mounted successfully");
+  // Volume size, not raw card capacity; used space comes from the metrics scan
+#if defined(ARDUINO_ARCH_ESP32)
+  sdTotalBytes = SD.totalBytes();
+#else
+  sdTotalBytes = SD.size64();
+#endif
+
+  enum SdRequirementType { SD_REQ_DIRECTORY, SD_REQ_FILE };
+
+  struct SdRequirement {
     const char* path;
     SdRequirementType type;
     const char* description;
@@ -375,7 +5727,7 @@ bool initializeSdCard() {
   const SdRequirement requirements[] = {
     {"/forum", SD_REQ_DIRECTORY, "Forum root directory", nullptr},
     {"/forum/posts", SD_REQ_DIRECTORY, "Forum posts directory", nullptr},
-    {"/forum/threads.json", SD_REQ_FILE, "Forum threads index", "[]\n"}
+    {"/catalog", SD_REQ_DIRECTORY, "Library catalog directory", nullptr}
   };
 
   bool allOk = true;
@@ -419,12 +5771,33 @@ void setup() {
   pinMode(ledPin, OUTPUT);
   digitalWrite(ledPin, LOW);
 
+#if defined(ARDUINO_ARCH_ESP32)
+  // Deeper, cluster-sized download buffers when PSRAM can hold them
+  if (psramFound()) {
+    downloadBufferSize = DOWNLOAD_BUFFER_PSRAM;
+    downloadPipelineDepth = DOWNLOAD_DEPTH_PSRAM;
+    downloadSlots = DOWNLOAD_SLOTS_PSRAM;
+    hotCacheCapacity = HOT_CACHE_CAPACITY_PSRAM;
+    uploadBufferSize = UPLOAD_BUFFER_PSRAM;
+  }
+  Serial.printf("[SYS] Download pipeline: %u x %u KB buffers\n", downloadPipelineDepth,
+                static_cast<unsigned int>(downloadBufferSize / 1024));
+#endif
+
   // Initialize SD card and verify structure
   sdCardReady = initializeSdCard();
   if (!sdCardReady) {
     Serial.println("[SD][WARN] SD card initialization failed; storage features unavailable");
+  } else {
+    loadLibraryLayout();
+    loadLibraryCatalog();
+    loadContentIndex();
+    loadLibraryJournal();
+    loadGzipCatalog();
+    loadDownloadStats();
+    sweepUploadTemps();
+    loadUploadSessions();
   }
-
   // Set up Access Point
   randomSeed(analogRead(0));  // Initialize random seed
   int randomNum = random(0, 100);  // Generate random number 0-99
@@ -453,13 +5826,37 @@ void setup() {
   server.on("/toggle", handleToggle);
   server.on("/list", handleFileList);
   server.on("/download", handleFileDownload);
+  server.on("/bundle", HTTP_ANY, handleBundle);
+  server.on("/read", HTTP_GET, handleReader);
+  server.on("/read/page", HTTP_GET, handleReaderPage);
   server.on("/forum", handleForum);
   server.on("/forum/new", handleNewThread);
   server.on("/forum/thread", handleThread);
   server.on("/forum/post", handleNewPost);
   server.on("/thread", HTTP_GET, handleThreadAjax);
   server.on("/upload", HTTP_POST, handleUpload, handleFileUpload);
+  server.on("/upload/session", HTTP_ANY, handleUploadSession);
+  server.on("/upload/chunk", HTTP_PATCH, handleUploadChunk, handleUploadChunkBody);
+  server.on("/upload/finalize", HTTP_POST, handleUploadFinalize);
+  server.on("/upload/queue", HTTP_GET, handleUploadQueue);
   server.on("/node-files", handleNodeFiles);
+  server.on("/metrics", HTTP_GET, handleMetrics);
+  server.on("/duplicates", HTTP_GET, handleDuplicates);
+  server.on("/stats", HTTP_GET, handleStats);
+  server.on("/api/changes", HTTP_GET, handleLibraryChanges);
+  server.on("/reshard", HTTP_POST, handleReshard);
+  server.on("/bench/filetypes", HTTP_GET, handleFileTypeBenchmark);
+  server.on("/bench/open", HTTP_POST, handleOpenBenchmark);
+  server.on("/scheduler", HTTP_POST, handleScheduler);
+  server.on("/bench", HTTP_GET, handleBenchPage);
+  server.on("/bench/clock", HTTP_POST, handleBenchClock);
+  server.on("/bench/prepare", HTTP_POST, handleBenchPrepare);
+  server.on("/bench/file", HTTP_GET, handleBenchFile);
+  server.on("/bench/result", HTTP_GET, handleBenchResult);
+  server.on("/bench/cleanup", HTTP_POST, handleBenchCleanup);
+  server.on("/bench/upload", HTTP_GET, handleUploadBenchPage);
+  server.on("/bench/upload/start", HTTP_POST, handleUploadBenchStart);
+  server.on("/bench/upload/result", HTTP_GET, handleUploadBenchResult);
   server.on("/uploadpage", handleUploadPage); server.on("/", handleRoot);            // Main library page
   // server.on("/generate_204", handleCaptivePortal);  // Android
   //server.on("/gen_204", handleCaptivePortal);       // Android
@@ -492,6 +5889,10 @@ void setup() {
     handlePortal();
   });
 
+  // Request headers the handlers look at (the server drops all others)
+  static const char* collectedHeaders[] = {"If-None-Match", "Accept-Encoding", "Range"};
+  server.collectHeaders(collectedHeaders, sizeof(collectedHeaders) / sizeof(collectedHeaders[0]));
+
   server.begin();
   Serial.println("HTTP server started");
 
@@ -500,9 +5901,20 @@ void setup() {
 }
 
 void loop() {
+  noteUploadBenchPass();            // Loop gap tracking while /bench/upload runs
   dnsServer.processNextRequest();   // DNS
   server.handleClient();    //HTTP
   checkAndCleanupForum();
+  processMetadataExtraction();  // Idle-time catalog work, bounded per pass
+  updateLibraryMetrics();       // Incremental reconcile of the storage counters
+  processFingerprintJob();      // Hash books missing from the dedup index
+  processShardMigration();      // Moves books into hash buckets after /reshard
+  processDownloads();           // Fair-share pump for active downloads
+  processGzipJob();             // Precompress text-like books while nothing else runs
+  processDownloadStats();       // Batched counter writes
+  processUploadVerify();        // Read-back check of fresh uploads
+  processFreeSpaceCount();      // Free clusters off the FAT after mount and hourly
+  processBench();               // /bench file writes; idle hooks of abandoned runs
 }
 
 void checkAndCleanupForum() {
@@ -518,6 +5930,7 @@ void cleanupForum() {
     Serial.println("[SD][WARN] Skipping forum cleanup; SD card unavailable");
     return;
   }
+  fileCacheInvalidate("/forum");
   if (SD.exists("/forum")) {
     removeDirectory("/forum");
   }
@@ -525,20 +5938,15 @@ void cleanupForum() {
   SD.mkdir("/forum");
   SD.mkdir("/forum/posts");
 
-  File threadsFile = SD.open("/forum/threads.json", FILE_WRITE);
-  if (threadsFile) {
-    threadsFile.println("[]");
-    threadsFile.close();
-  }
-
   File logFile = SD.open("/forum/cleanup.log", FILE_WRITE);
   if (logFile) {
-    logFile.printf("Forum cleaned at: %lu\n", millis());
+    noteStorageAdded("/forum/cleanup.log", logFile.printf("Forum cleaned at: %lu\n", millis()));
     logFile.close();
   }
 }
 
 void removeDirectory(const char * path) {
+  fileCacheInvalidate(path);
   File dir = SD.open(path);
   if (!dir.isDirectory()) {
     return;
@@ -556,8 +5964,15 @@ void removeDirectory(const char * path) {
       entry.close();
       removeDirectory(entryPath.c_str());
     } else {
+      size_t entrySize = entry.size();
       entry.close();
-      SD.remove(entryPath.c_str());
+      if (SD.remove(entryPath.c_str())) {
+        noteStorageRemoved(entryPath, entrySize);
+        noteClustersResized(entrySize, 0);
+        if (entryPath.startsWith("/Alexandria/")) {
+          recordLibraryChange(LIBRARY_CHANGE_REMOVE, libraryPublicPath(entryPath));
+        }
+      }
     }
   }
   dir.close();
@@ -955,10 +6370,52 @@ void handleFileList() {
    finalizeChunkedResponse();
 }
 
+String libraryListItemHtml(const String& section, const String& sdPath, const String& fileName) {
+    int sectionIndex = librarySectionIndex(section);
+    String selected = (sectionIndex >= 0 ? librarySectionName(sectionIndex) : section) + "/" + fileName;
+    String html = "<div class='file-item'><input type='checkbox' name='f' form='bundleForm' value='" + htmlEscape(selected) + "'>";
+    html += "<a href='/download?file=";
+    html += urlEncodePath(section + "/" + fileName);
+    // Reader link goes inside the item, after the title and metadata lines
+    String readLink;
+    if (readerFormat(fileName) != READER_NONE) {
+        readLink = " <a href='/read?file=" + urlEncodePath(section + "/" + fileName) + "'>[R34D]</a>";
+    }
+    const BookMetadata* meta = findBookMetadata(sdPath);
+    if (meta) {
+        html += "' onclick='showLoading(true)'>&gt; " + htmlEscape(meta->title);
+        if (meta->author.length() > 0) {
+            html += " // " + htmlEscape(meta->author);
+        }
+        html += " &lt;</a><div class='file-meta'>" + htmlEscape(fileName);
+        if (meta->language.length() > 0) {
+            html += " [" + htmlEscape(meta->language) + "]";
+        }
+        html += "</div>" + readLink + "</div>";
+    } else {
+        html += "' onclick='showLoading(true)'>&gt; " + htmlEscape(fileName) + " &lt;</a>" + readLink + "</div>";
+    }
+    return html;
+}
+
 void handleNodeFiles() {
-    String nodeSSID = server.arg("node");
+    // Both come back into the page (titles, links), so only ever as escaped text
+    String nodeSSID = htmlEscape(server.arg("node"));
     String section = server.arg("section");
     bool isLocal = true; // local files only
+
+    // Section listings only change when their generation counter moves
+    int sectionIndex = librarySectionIndex(section);
+    if (sectionIndex >= 0) {
+        String etag = "\"" + String(libraryBootId, HEX) + "-" + String(sectionIndex) + "-" +
+                      String(static_cast<unsigned long>(sectionGenerations[sectionIndex])) + "\"";
+        if (server.header("If-None-Match") == etag) {
+            server.send(304);
+            return;
+        }
+        server.sendHeader("ETag", etag);
+        server.sendHeader("Cache-Control", "no-cache");
+    }
     
     // Start sending headers immediately to improve responsiveness
     server.setContentLength(CONTENT_LENGTH_UNKNOWN);
@@ -978,6 +6435,7 @@ void handleNodeFiles() {
       ".file-list::-webkit-scrollbar-thumb{background:#0f0}"
       ".file-item{border-left:3px solid #0f0;padding:8px;margin:5px 0;transition:all .2s;background:rgba(0,10,0,0.4)}"
       ".file-item:hover{background:#001500;transform:translateX(5px);box-shadow:0 0 10px #0f0}"
+      ".file-meta{color:#0a0;font-size:.8em;margin-left:15px}"
       ".nav-bar{display:flex;justify-content:space-between;align-items:center;margin:10px 0;padding:8px;border:1px solid #0f0;background:rgba(0,10,0,0.5)}"
       ".nav-button{padding:5px 15px;border:1px solid #0f0;transition:all .2s;background:rgba(0,20,0,0.6)}"
       ".nav-button:hover{background:#0f0;color:#000;box-shadow:0 0 10px #0f0}"
@@ -1057,7 +6515,7 @@ void handleNodeFiles() {
             sectionTitle = "[5YM80L5]";
         } else if (section.length() == 1) {
             dirPath += section;
-            sectionTitle = "[" + section + "]";
+            sectionTitle = "[" + htmlEscape(section) + "]";
         }
 
         // Navigation bar at top - send immediately
@@ -1070,27 +6528,38 @@ void handleNodeFiles() {
 
         // More efficient file reading with limited yields
         if (isLocal) {
-            File dir = SD.open(dirPath);
+            // Walk the section root plus, in the sharded layout, its hash buckets
+            LibraryScanCursor cursor;
+            cursor.maxDepth = 1;
             int fileCount = 0;
             
-            if (dir) {
+            if (libraryScanBegin(cursor, dirPath)) {
                 // First count how many files we have (faster than using vectors for large directories)
                 int totalFiles = 0;
-                while (File entry = dir.openNextFile()) {
-                    if (!entry.isDirectory() && isAllowedFile(String(entry.name()))) {
+                LibraryFileEntry entry;
+                LibraryScanResult result;
+                while ((result = libraryScanStep(cursor, entry)) != LIBRARY_SCAN_DONE) {
+                    if (result == LIBRARY_SCAN_FILE) {
                         totalFiles++;
-                    }
-                    entry.close();
-                    
-                    // Only yield occasionally during counting to maintain responsiveness
-                    if (totalFiles % 10 == 0) {
-                        yield();
+                        
+                        // Only yield occasionally during counting to maintain responsiveness
+                        if (totalFiles % 10 == 0) {
+                            yield();
+                        }
                     }
                 }
                 
+                std::vector<String> sectionAliases;
+                String aliasPrefix = dirPath + "/";
+                for (const auto& alias : libraryAliases) {
+                    if (alias.first.startsWith(aliasPrefix) && alias.first.indexOf('/', aliasPrefix.length()) < 0) {
+                        sectionAliases.push_back(alias.first);
+                    }
+                }
+                totalFiles += sectionAliases.size();
+
                 // Reset directory pointer
-                dir.close();
-                dir = SD.open(dirPath);
+                libraryScanBegin(cursor, dirPath);
                 
                 if (totalFiles == 0) {
                     // No files - send this information immediately
@@ -1100,28 +6569,26 @@ void handleNodeFiles() {
                     const int BATCH_SIZE = 10; // Process 10 files before yielding
                     int batchCount = 0;
                     
-                    while (File entry = dir.openNextFile()) {
-                        if (!entry.isDirectory()) {
-                            String fileName = String(entry.name());
-                            if (isAllowedFile(fileName)) {
-                                String fullPath = section + "/" + fileName;
-                                String encodedPath = urlEncodePath(fullPath);
-
-                                String html = "<div class='file-item'><a href='/download?file=";
-                                html += encodedPath;
-                                html += "' onclick='showLoading(true)'>&gt; " + fileName + " &lt;</a></div>";
-
-                                server.sendContent(html);
-                                fileCount++;
-
-                                batchCount++;
-                                if (batchCount >= BATCH_SIZE) {
-                                    yield();
-                                    batchCount = 0;
-                                }
-                            }
+                    while ((result = libraryScanStep(cursor, entry)) != LIBRARY_SCAN_DONE) {
+                        if (result != LIBRARY_SCAN_FILE) {
+                            continue;
                         }
-                        entry.close();
+                        String fileName = entry.path.substring(entry.path.lastIndexOf('/') + 1);
+                        server.sendContent(libraryListItemHtml(section, entry.path, fileName));
+                        fileCount++;
+
+                        batchCount++;
+                        if (batchCount >= BATCH_SIZE) {
+                            yield();
+                            batchCount = 0;
+                        }
+                    }
+
+                    // Deduplicated uploads live on as aliases of the original copy
+                    for (const String& aliasPath : sectionAliases) {
+                        String fileName = aliasPath.substring(aliasPath.lastIndexOf('/') + 1);
+                        server.sendContent(libraryListItemHtml(section, resolveLibraryPath(aliasPath), fileName));
+                        fileCount++;
                     }
                     
                     // Update section title with file count
@@ -1130,7 +6597,7 @@ void handleNodeFiles() {
                                        " F1L35]';</script>");
                 }
                 
-                dir.close();
+                libraryScanEnd(cursor);
             } else {
                 server.sendContent(F("<div class='file-item'>[D1R3C70RY N07 F0UND]</div>"));
             }
@@ -1142,66 +6609,419 @@ void handleNodeFiles() {
         server.sendContent("<div class='nav-bar'>");
         server.sendContent("<a href='/node-files?node=" + nodeSSID +
                            "' class='nav-button' onclick='showLoading(true)'>&lt;&lt; 53C710N5</a>");
+        server.sendContent("<form id='bundleForm' method='POST' action='/bundle' style='margin:0'>"
+                           "<button type='submit' class='nav-button' style='color:#0f0;font-family:monospace'>"
+                           "Z1P 53L3C73D</button></form>");
+        server.sendContent("<a href='/bundle?section=" + htmlEscape(section) + "' class='nav-button'>Z1P 53C710N</a>");
         server.sendContent("</div>");
     }
-
-    // Close container and HTML
-    server.sendContent(F("</div>"));
-    
-    // Add a script to hide loading indicator when page is loaded
-    server.sendContent(F("<script>window.onload = function(){showLoading(false)}</script>"));
-    server.sendContent(F("</body></html>"));
-    finalizeChunkedResponse();
+
+    // Close container and HTML
+    server.sendContent(F("</div>"));
+    
+    // Add a script to hide loading indicator when page is loaded
+    server.sendContent(F("<script>window.onload = function(){showLoading(false)}</script>"));
+    server.sendContent(F("</body></html>"));
+    finalizeChunkedResponse();
+}
+
+void handleFileDownload() {
+    if (!server.hasArg("file")) {
+        server.send(400, "text/plain", "File parameter missing");
+        return;
+    }
+
+    String fileName = server.arg("file");
+
+    // ✅ Strip path to get only the actual filename
+    String baseName = fileName.substring(fileName.lastIndexOf('/') + 1);
+
+    // ✅ Run extension check on the base filename only
+    const FileType* fileType = fileTypeFor(baseName);
+    if (!fileType) {
+        String allowed;
+        for (size_t i = 0; i < FILE_TYPE_COUNT; ++i) {
+            String ext = FILE_TYPES[i].ext;
+            ext.toUpperCase();
+            allowed += String(i == 0 ? "" : i + 1 == FILE_TYPE_COUNT ? ", and " : ", ") + ext;
+        }
+        server.send(400, "text/plain", "Invalid file type. Only " + allowed + " files are allowed.");
+        return;
+    }
+
+    String publicPath = resolveLibraryPath("/Alexandria/" + fileName);
+    String filePath = libraryPhysicalPath(publicPath);
+    size_t size;
+    if (!fileCacheStat(filePath, size)) {
+        server.send(404, "text/plain", "File not found");
+        return;
+    }
+
+    // Single byte range ("a-b", "a-" or "-n"), used by the EPUB reader to fetch one member at a time
+    size_t rangeStart = 0;
+    size_t rangeLength = size;
+    String contentRange;
+    String range = server.header("Range");
+    bool partial = range.startsWith("bytes=") && range.indexOf(',') < 0;
+    if (partial) {
+        int dash = range.indexOf('-');
+        String first = range.substring(6, dash);
+        String second = range.substring(dash + 1);
+        size_t rangeEnd = size - 1;
+        if (dash < 0 || (first.length() == 0 && second.length() == 0)) {
+            partial = false;
+        } else if (first.length() == 0) {
+            size_t suffix = std::min<size_t>(second.toInt(), size);
+            rangeStart = size - suffix;
+        } else {
+            rangeStart = first.toInt();
+            if (second.length() > 0) {
+                rangeEnd = std::min<size_t>(second.toInt(), size - 1);
+            }
+        }
+        if (partial && (size == 0 || rangeStart > rangeEnd || rangeStart >= size)) {
+            server.sendHeader("Content-Range", "bytes */" + String(static_cast<unsigned long>(size)));
+            server.send(416, "text/plain", "Range not satisfiable");
+            return;
+        }
+        if (partial) {
+            rangeLength = rangeEnd - rangeStart + 1;
+            contentRange = "bytes " + String(static_cast<unsigned long>(rangeStart)) + "-" +
+                           String(static_cast<unsigned long>(rangeEnd)) + "/" + String(static_cast<unsigned long>(size));
+        }
+    }
+
+    // Precompressed sidecar, when the client takes gzip and it still matches the book
+    auto sidecar = gzipSidecars.find(publicPath);
+    size_t gzipSize;
+    size_t gzipSaved = 0;
+    bool gzip = false;
+    if (!partial && sidecar != gzipSidecars.end() && sidecar->second.gzipSize > 0 &&
+        sidecar->second.sourceSize == size && server.header("Accept-Encoding").indexOf("gzip") >= 0 &&
+        fileCacheStat(filePath + ".gz", gzipSize)) {
+        gzipSaved = sidecar->second.sourceSize - gzipSize;
+        filePath += ".gz";
+        size = gzipSize;
+        rangeLength = gzipSize;
+        gzip = true;
+    }
+
+    String contentType = fileType->mime;
+
+    if (!downloadSlotAvailable()) {
+        downloadsRejected++;
+        server.sendHeader("Retry-After", "5");
+        server.send(503, "text/plain", "All download slots are busy, try again shortly");
+        return;
+    }
+
+    // Popular books come straight out of PSRAM; a hit never touches the SD card
+    std::shared_ptr<HotObject> hot = hotCacheLookup(filePath);
+    ActiveDownload* download = nullptr;
+    uint32_t cacheEpoch = 0;
+    if (!hot || hot->size != size) {
+        hot = nullptr;
+        File file = fileCacheOpen(filePath, cacheEpoch);
+        if (!file) {
+            server.send(404, "text/plain", "File not found");
+            return;
+        }
+        file.seek(rangeStart);
+        // Buffers first: once the status line is out there is no taking it back
+        download = prepareDownload(file, rangeLength, downloadBufferSize, downloadPipelineDepth);
+        if (!download) {
+            downloadsRejected++;
+            server.sendHeader("Retry-After", "5");
+            server.send(503, "text/plain", "Out of memory for download buffers, try again shortly");
+            return;
+        }
+    }
+
+    if (partial) {
+        server.sendHeader("Content-Range", contentRange);
+    }
+    server.sendHeader("Accept-Ranges", "bytes");
+    if (gzip) {
+        server.sendHeader("Content-Encoding", "gzip");
+    }
+    if (isCompressibleBook(publicPath)) {
+        server.sendHeader("Vary", "Accept-Encoding");
+    }
+    server.sendHeader("Content-Disposition", "attachment; filename=" + baseName);
+    server.sendHeader("Connection", "close");
+    server.setContentLength(rangeLength);
+    server.send(partial ? 206 : 200, contentType, "");
+
+    // The body is streamed from loop() by the scheduler, sharing bandwidth with other downloads
+    if (hot) {
+        download = scheduleHotDownload(filePath, hot, rangeStart, rangeLength, DOWNLOAD_DEFAULT_WEIGHT);
+    } else {
+        activateDownload(download, DOWNLOAD_DEFAULT_WEIGHT);
+    }
+    if (gzip) {
+        noteGzipSaved(gzipSaved);  // Only once the sidecar is actually going out
+    }
+    // Reader range requests are page turns, not downloads
+    if (!partial) {
+        noteDownloadStart(publicPath);
+        download->statsPath = publicPath;
+    }
+    if (!hot) {
+        download->pipe.cachePath = filePath;
+        download->pipe.cacheEpoch = cacheEpoch;
+        // A miss the cache wants gets copied into PSRAM on its way out
+        if (!partial && hotCacheReserveFill(filePath, size)) {
+            download->pipe.fill = allocateStreamBuffer(size);
+            download->pipe.fillSize = download->pipe.fill ? size : 0;
+            if (!download->pipe.fill) {
+                hotCacheReleaseFill(size);
+            }
+        }
+    }
 }
 
-void handleFileDownload() {
-    if (!server.hasArg("file")) {
-        server.send(400, "text/plain", "File parameter missing");
-        return;
+// Pages through a book in the browser so only what is being read crosses the air
+void handleReader() {
+    static const char READER_PAGE[] PROGMEM = R"=====(<!DOCTYPE html>
+<html><head><meta name='viewport' content='width=device-width, initial-scale=1'><title>R34D3R</title>
+<style>
+body{font-family:'Courier New',monospace;background:#000;color:#0f0;margin:0;padding:10px}
+#page{white-space:pre-wrap;line-height:1.5;min-height:70vh;border:1px solid #0f0;padding:10px;overflow-wrap:break-word}
+#page.html{white-space:normal}#page img{display:none}
+.bar{display:flex;justify-content:space-between;align-items:center;margin:8px 0}
+button,a{background:#000;color:#0f0;border:1px solid #0f0;padding:8px 14px;text-decoration:none;font-family:monospace}
+#status{color:#0a0;text-align:center}
+</style></head><body>
+<div class='bar'><a href='javascript:history.back()'>&lt;&lt;</a><span id='status'>L04D1NG...</span><a id='dl'>D0WNL04D</a></div>
+<div id='page'></div>
+<div class='bar'><button onclick='go(-1)'>&lt; PR3V</button><button onclick='go(1)'>N3XT &gt;</button></div>
+<script>
+  const file=new URLSearchParams(location.search).get('file')||'';
+  const dl='/download?file='+encodeURIComponent(file).replace(/%2F/g,'/');
+  const kind=/\.epub$/i.test(file)?'epub':/\.fb2$/i.test(file)?'fb2':'text';
+  const key='read:'+file, el=document.getElementById('page');
+  let page=Number(localStorage.getItem(key))||0, total=0, known=0, zip=null, spine=null;
+  document.getElementById('dl').href=dl;
+  const setStatus=t=>document.getElementById('status').textContent=t;
+  const esc=t=>t.replace(/&/g,'&amp;').replace(/</g,'&lt;');
+  function fb2(t){
+    const ent={amp:'&',lt:'<',gt:'>',quot:'"',apos:"'"};
+    return t.replace(/<\/(p|title|subtitle|v)>|<empty-line\/>/g,'\n').replace(/<[^>]*>/g,'')
+      .replace(/&(#x?[0-9a-f]+|\w+);/gi,(m,e)=>e[0]=='#'?String.fromCodePoint(e[1]=='x'||e[1]=='X'?parseInt(e.slice(2),16):+e.slice(1)):(ent[e]||m));
+  }
+  async function textPage(n){
+    const r=await fetch('/read/page?file='+encodeURIComponent(file)+'&page='+n);
+    known=Number(r.headers.get('X-Pages-Known'))||known;
+    total=Number(r.headers.get('X-Page-Count'))||0;
+    if(!r.ok)return false;
+    const cs=(/charset=([\w-]+)/.exec(r.headers.get('Content-Type')||'')||[])[1]||'utf-8';
+    const t=new TextDecoder(cs).decode(await r.arrayBuffer());
+    el.className='';
+    el.innerHTML=esc(kind=='fb2'?fb2(t):t);
+    return true;
+  }
+  async function range(spec){
+    const r=await fetch(dl,{headers:{Range:'bytes='+spec}});
+    if(r.status!=206)throw new Error('range');
+    return {view:new DataView(await r.arrayBuffer()),size:Number((r.headers.get('Content-Range')||'').split('/')[1])};
+  }
+  async function openZip(){
+    const tail=(await range('-4096')).view;
+    let p=tail.byteLength-22;
+    while(p>=0&&tail.getUint32(p,true)!=0x06054b50)p--;
+    if(p<0)throw new Error('not a zip');
+    const cdSize=tail.getUint32(p+12,true),cdOff=tail.getUint32(p+16,true);
+    const cd=(await range(cdOff+'-'+(cdOff+cdSize-1))).view,dec=new TextDecoder(),entries={};
+    for(let q=0;q+46<=cd.byteLength&&cd.getUint32(q,true)==0x02014b50;){
+      const n=cd.getUint16(q+28,true),x=cd.getUint16(q+30,true),c=cd.getUint16(q+32,true);
+      const name=dec.decode(new Uint8Array(cd.buffer,q+46,n));
+      entries[name]={method:cd.getUint16(q+10,true),size:cd.getUint32(q+20,true),offset:cd.getUint32(q+42,true)};
+      q+=46+n+x+c;
     }
+    return entries;
+  }
+  async function member(name){
+    const e=zip[name];
+    if(!e)throw new Error('missing '+name);
+    if(e.size==0)return '';
+    const h=(await range(e.offset+'-'+(e.offset+29))).view;
+    const start=e.offset+30+h.getUint16(26,true)+h.getUint16(28,true);
+    const raw=new Uint8Array((await range(start+'-'+(start+e.size-1))).view.buffer);
+    let data=raw;
+    if(e.method==8){
+      if(!window.DecompressionStream)throw new Error('this browser cannot inflate EPUB, use D0WNL04D');
+      data=await new Response(new Blob([raw]).stream().pipeThrough(new DecompressionStream('deflate-raw'))).arrayBuffer();
+    }
+    return new TextDecoder().decode(data);
+  }
+  const xml=t=>new DOMParser().parseFromString(t,'application/xml');
+  async function openEpub(){
+    zip=await openZip();
+    const opfPath=xml(await member('META-INF/container.xml')).querySelector('rootfile').getAttribute('full-path');
+    const base=opfPath.slice(0,opfPath.lastIndexOf('/')+1),opf=xml(await member(opfPath)),items={};
+    opf.querySelectorAll('manifest>item').forEach(i=>items[i.getAttribute('id')]=i.getAttribute('href'));
+    spine=[...opf.querySelectorAll('spine>itemref')].map(i=>base+decodeURIComponent(items[i.getAttribute('idref')]||''));
+    total=known=spine.length;
+  }
+  // Chapters are copied node by node: text plus a few layout tags, never an attribute, so
+  // nothing in a book can run script or load a URL
+  const keep=new Set('p br h1 h2 h3 h4 h5 h6 em i b strong u s sub sup small blockquote pre code ul ol li dl dt dd hr table thead tbody tr th td div section span'.split(' '));
+  const skip=new Set('script style link img image svg math object embed iframe head title'.split(' '));
+  function copy(from,to){
+    for(const c of from.childNodes){
+      if(c.nodeType==3){to.appendChild(document.createTextNode(c.nodeValue));continue;}
+      if(c.nodeType!=1)continue;
+      const tag=c.localName.toLowerCase();
+      if(skip.has(tag))continue;
+      if(keep.has(tag))copy(c,to.appendChild(document.createElement(tag)));
+      else copy(c,to);
+    }
+  }
+  async function epubPage(n){
+    if(n>=spine.length)return false;
+    const t=await member(spine[n]);
+    let doc=new DOMParser().parseFromString(t,'application/xhtml+xml');
+    if(doc.querySelector('parsererror'))doc=new DOMParser().parseFromString(t,'text/html');
+    el.className='html';
+    el.textContent='';
+    if(doc.body)copy(doc.body,el);
+    else el.textContent=t;
+    return true;
+  }
+  async function go(step){
+    const n=Math.max(0,page+step);
+    setStatus('L04D1NG...');
+    try{
+      if(kind=='epub'&&!spine)await openEpub();
+      if(await(kind=='epub'?epubPage(n):textPage(n))){page=n;localStorage.setItem(key,page);scrollTo(0,0);}
+      setStatus('P4G3 '+(page+1)+' / '+(total||known+'+'));
+    }catch(e){setStatus('3RR0R: '+e.message);}
+  }
+  go(0);
+</script></body></html>)=====";
+    server.send_P(200, "text/html", READER_PAGE);
+}
 
+// One page of a text book, cut at boundaries from the lazily built page index next to it
+void handleReaderPage() {
     String fileName = server.arg("file");
-
-    // ✅ Strip path to get only the actual filename
-    String baseName = fileName.substring(fileName.lastIndexOf('/') + 1);
-
-    // ✅ Run extension check on the base filename only
-    if (!isAllowedFile(baseName)) {
-        server.send(400, "text/plain", "Invalid file type. Only PDF, EPUB, DOC, DOCX, RTF, and TXT files are allowed.");
+    ReaderFormat format = readerFormat(fileName);
+    if (fileName.length() == 0 || fileName.indexOf("..") >= 0 || (format != READER_TEXT && format != READER_FB2)) {
+        server.send(400, "text/plain", "Only TXT and FB2 books are paged on the server");
         return;
     }
+    uint32_t page = server.hasArg("page") ? static_cast<uint32_t>(server.arg("page").toInt()) : 0;
 
-    String filePath = "/Alexandria/" + fileName;
-    if (!SD.exists(filePath)) {
+    String sdPath = libraryPhysicalPath(resolveLibraryPath("/Alexandria/" + fileName));
+    uint32_t cacheEpoch;
+    File book = fileCacheOpen(sdPath, cacheEpoch);
+    if (!book) {
         server.send(404, "text/plain", "File not found");
         return;
     }
-
-    File file = SD.open(filePath, FILE_READ);
-    if (!file) {
-        server.send(500, "text/plain", "Failed to open file");
+    PageIndexInfo info;
+    if (!ensurePageIndex(sdPath, book, format, page, info)) {
+        fileCacheRelease(sdPath, book, cacheEpoch);
+        server.send(500, "text/plain", "Could not index book");
+        return;
+    }
+    uint32_t pages = info.boundaries - 1;
+    server.sendHeader("X-Pages-Known", String(static_cast<unsigned long>(pages)));
+    if (info.complete) {
+        server.sendHeader("X-Page-Count", String(static_cast<unsigned long>(pages)));
+    }
+    if (page >= pages) {
+        fileCacheRelease(sdPath, book, cacheEpoch);
+        server.send(404, "text/plain", "No such page");
         return;
     }
 
-    String contentType = "application/octet-stream";
-    if (baseName.endsWith(".pdf")) {
-        contentType = "application/pdf";
-    } else if (baseName.endsWith(".epub")) {
-        contentType = "application/epub+zip";
-    } else if (baseName.endsWith(".doc")) {
-        contentType = "application/msword";
-    } else if (baseName.endsWith(".docx")) {
-        contentType = "application/vnd.openxmlformats-officedocument.wordprocessingml.document";
-    } else if (baseName.endsWith(".rtf")) {
-        contentType = "application/rtf";
-    } else if (baseName.endsWith(".txt")) {
-        contentType = "text/plain";
+    uint32_t bounds[2] = {0, 0};
+    File index = SD.open((sdPath + PAGE_INDEX_SUFFIX).c_str(), FILE_READ);
+    if (index) {
+        index.seek(PAGE_INDEX_HEADER + page * 4);
+        index.read(reinterpret_cast<uint8_t*>(bounds), sizeof(bounds));
+        index.close();
     }
+    size_t length = bounds[1] > bounds[0] ? std::min<size_t>(bounds[1] - bounds[0], READER_PAGE_BYTES) : 0;
+    static uint8_t buffer[READER_PAGE_BYTES];  // Off the stack, like the indexer's
+    book.seek(bounds[0]);
+    length = book.read(buffer, length);
+    fileCacheRelease(sdPath, book, cacheEpoch);
+
+    server.sendHeader("Cache-Control", "no-cache");
+    server.setContentLength(length);
+    server.send(200, "text/plain; charset=" + String(info.encoding), "");
+    server.sendContent(reinterpret_cast<const char*>(buffer), length);
+}
 
-    server.sendHeader("Content-Disposition", "attachment; filename=" + baseName);
+// Streams a section (?section=A) or a selection (repeated f=<section>/<file>) as one stored ZIP
+void handleBundle() {
+    ZipBundle* bundle = new ZipBundle();
+    String section = server.arg("section");
+
+    if (section.length() > 0) {
+        int sectionIndex = librarySectionIndex(section);
+        if (sectionIndex < 0) {
+            delete bundle;
+            server.send(400, "text/plain", "Unknown section");
+            return;
+        }
+        String dirPath = "/Alexandria/" + librarySectionName(sectionIndex);
+        LibraryScanCursor cursor;
+        cursor.maxDepth = 1;
+        if (libraryScanBegin(cursor, dirPath)) {
+            LibraryFileEntry entry;
+            LibraryScanResult result;
+            while ((result = libraryScanStep(cursor, entry)) != LIBRARY_SCAN_DONE) {
+                if (result == LIBRARY_SCAN_FILE) {
+                    addBundleEntry(*bundle, entry.path, entry.path.substring(entry.path.lastIndexOf('/') + 1));
+                }
+            }
+            libraryScanEnd(cursor);
+        }
+        String aliasPrefix = dirPath + "/";
+        for (const auto& alias : libraryAliases) {
+            if (alias.first.startsWith(aliasPrefix) && alias.first.indexOf('/', aliasPrefix.length()) < 0) {
+                addBundleEntry(*bundle, alias.first, alias.first.substring(aliasPrefix.length()));
+            }
+        }
+        bundle->name = "Alexandria-" + librarySectionName(sectionIndex) + ".zip";
+    } else {
+        for (int i = 0; i < server.args(); i++) {
+            String selected = server.arg(i);
+            if (server.argName(i) != "f" || selected.indexOf("..") >= 0) {
+                continue;
+            }
+            addBundleEntry(*bundle, "/Alexandria/" + selected, selected);
+        }
+        bundle->name = "Alexandria-selection.zip";
+    }
+
+    if (bundle->entries.empty()) {
+        delete bundle;
+        server.send(404, "text/plain", "No books to bundle");
+        return;
+    }
+    uint64_t length = zipBundleLength(*bundle);
+    if (length > BUNDLE_MAX_BYTES) {
+        delete bundle;
+        server.send(413, "text/plain", "Bundle exceeds 4 GB; select fewer books");
+        return;
+    }
+    if (!downloadSlotAvailable()) {
+        delete bundle;
+        downloadsRejected++;
+        server.sendHeader("Retry-After", "5");
+        server.send(503, "text/plain", "All download slots are busy, try again shortly");
+        return;
+    }
+
+    server.sendHeader("Content-Disposition", "attachment; filename=" + bundle->name);
     server.sendHeader("Connection", "close");
-    server.streamFile(file, contentType);
-    file.close();
+    server.setContentLength(length);
+    server.send(200, "application/zip", "");
+    scheduleBundle(bundle, DOWNLOAD_DEFAULT_WEIGHT);
 }
 
 
@@ -1228,58 +7048,153 @@ void handleUploadPage() {
     html += "@keyframes pulse { 0% {opacity: 0.7;} 50% {opacity: 1;} 100% {opacity: 0.7;} }";
     html += "</style>";
 
-    // JavaScript for progress tracking and status messages
+    // JavaScript for progress tracking and status messages. Each picked file goes up in
+    // fixed-size chunks against its own resumable session; after a drop the page asks the
+    // server where it got to and carries on, and session ids survive a reload in localStorage.
+    // All files start at once; the server admits a few writers and the rest wait their turn.
     html += "<script>";
+    html += "const CHUNK = " + String(static_cast<unsigned long>(UPLOAD_CHUNK_BYTES)) + ";";
+    html += "function setStatus(text, cls) {";
+    html += "  const el = document.getElementById('statusMessage');";
+    html += "  el.className = cls || '';";
+    html += "  el.innerHTML = text;";
+    html += "}";
+    html += "function setProgress(done, total) {";
+    html += "  const percent = Math.round((done / total) * 100);";
+    html += "  document.getElementById('progressBar').style.width = percent + '%';";
+    html += "  document.getElementById('progressText').textContent = percent + '%';";
+    html += "}";
+    html += "function sleep(ms) { return new Promise(function(r) { setTimeout(r, ms); }); }";
+    html += "const CRC_TABLE = (function() {";
+    html += "  const t = new Uint32Array(256);";
+    html += "  for (let n = 0; n < 256; n++) {";
+    html += "    let c = n;";
+    html += "    for (let k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >>> 1) : c >>> 1;";
+    html += "    t[n] = c;";
+    html += "  }";
+    html += "  return t;";
+    html += "})();";
+    html += "async function fileCrc(file, report) {";  // The digest the server checks its own CRC against
+    html += "  let crc = 0xFFFFFFFF;";
+    html += "  for (let pos = 0; pos < file.size; pos += 1048576) {";
+    html += "    const bytes = new Uint8Array(await file.slice(pos, pos + 1048576).arrayBuffer());";
+    html += "    for (let i = 0; i < bytes.length; i++) crc = CRC_TABLE[(crc ^ bytes[i]) & 0xFF] ^ (crc >>> 8);";
+    html += "    report('CH3CKSUMM1NG... ' + Math.round(100 * (pos + bytes.length) / file.size) + '%');";
+    html += "  }";
+    html += "  return ((crc ^ 0xFFFFFFFF) >>> 0).toString(16);";
+    html += "}";
+    html += "async function openSession(file, key, report) {";
+    html += "  const saved = localStorage.getItem(key);";
+    html += "  if (saved) {";
+    html += "    const r = await fetch('/upload/session?id=' + saved);";
+    html += "    if (r.ok) return await r.json();";
+    html += "    if (r.status !== 404) throw new Error('session ' + r.status);";
+    html += "    localStorage.removeItem(key);";
+    html += "  }";
+    html += "  const crc = await fileCrc(file, report);";
+    html += "  const r = await fetch('/upload/session?name=' + encodeURIComponent(file.name) + '&size=' + file.size + '&crc=' + crc, {method: 'POST'});";
+    html += "  if (r.status === 415 || r.status === 507) return {refused: r.status};";
+    html += "  if (r.status === 429) return {busy: true};";  // Every session is in use; wait for one to finish
+    html += "  if (!r.ok) throw new Error('create ' + r.status);";
+    html += "  const s = await r.json();";
+    html += "  localStorage.setItem(key, s.id);";
+    html += "  return s;";
+    html += "}";
+    html += "async function sendFile(file, report) {";
+    html += "  const key = 'upload:' + file.name + ':' + file.size + ':' + file.lastModified;";
+    html += "  let s = null, failures = 0;";
+    html += "  for (;;) {";
+    html += "    try {";
+    html += "      if (!s) s = await openSession(file, key, report);";  // Re-reads the server's offset after a drop
+    html += "      if (s.refused) return s.refused === 507 ? 'full' : 'rejected';";
+    html += "      if (s.busy) {";
+    html += "        report('W4171NG F0R 4 5L07');";
+    html += "        await sleep(5000);";
+    html += "        s = null;";
+    html += "        continue;";
+    html += "      }";
+    html += "      if (s.queue > 0) {";
+    html += "        report('QU3U3D #' + s.queue, s.offset);";
+    html += "        await sleep(2000);";
+    html += "        s = null;";
+    html += "        continue;";
+    html += "      }";
+    html += "      report('UPL04D1NG ' + Math.round(100 * s.offset / file.size) + '%', s.offset);";
+    html += "      if (s.offset >= file.size) {";
+    html += "        const r = await fetch('/upload/finalize?id=' + s.id, {method: 'POST'});";
+    html += "        if (r.ok) { localStorage.removeItem(key); return 'ok'; }";
+    html += "        if (r.status === 422) { localStorage.removeItem(key); return 'corrupt'; }";
+    html += "        if (r.status === 404) { localStorage.removeItem(key); s = null; continue; }";
+    html += "        throw new Error('finalize ' + r.status);";
+    html += "      }";
+    html += "      const end = Math.min(s.offset + (s.chunk || CHUNK), file.size);";
+    html += "      const r = await fetch('/upload/chunk?id=' + s.id + '&offset=' + s.offset,";
+    html += "        {method: 'PATCH', headers: {'Content-Type': 'application/octet-stream'}, body: file.slice(s.offset, end)});";
+    html += "      if (r.status === 404) { localStorage.removeItem(key); s = null; continue; }";  // Session expired
+    html += "      if (r.status === 415) { localStorage.removeItem(key); return 'rejected'; }";  // Failed the type check
+    html += "      if (!r.ok && r.status !== 409 && r.status !== 429) throw new Error('chunk ' + r.status);";
+    html += "      s = await r.json();";  // 409 carries the offset to resume from, 429 the queue position
+    html += "      failures = 0;";
+    html += "    } catch (e) {";
+    html += "      console.log('Upload interrupted: ' + e);";
+    html += "      if (++failures > 20) return 'failed';";
+    html += "      s = null;";
+    html += "      report('R3C0NN3C71NG... (' + failures + ')');";
+    html += "      await sleep(Math.min(30000, 1000 * failures));";
+    html += "    }";
+    html += "  }";
+    html += "}";
     html += "function showProgress() {";
     html += "  document.getElementById('progressContainer').style.display = 'block';";
     html += "  document.getElementById('statusArea').style.display = 'block';";
-    html += "  document.getElementById('statusMessage').innerHTML = 'UPL04D1NG...';";
+    html += "  setStatus('UPL04D1NG...');";
     html += "  document.getElementById('submitBtn').disabled = true;";
     html += "  ";
-    html += "  const form = document.getElementById('uploadForm');";
-    html += "  const formData = new FormData(form);";
-    html += "  const fileName = document.getElementById('fileInput').files[0].name;";
-    html += "  const xhr = new XMLHttpRequest();";
-    html += "  ";
-    html += "  xhr.open('POST', '/upload', true);";
-    html += "  ";
-    html += "  // Track upload progress";
-    html += "  xhr.upload.onprogress = function(e) {";
-    html += "    if (e.lengthComputable) {";
-    html += "      const percent = Math.round((e.loaded / e.total) * 100);";
-    html += "      document.getElementById('progressBar').style.width = percent + '%';";
-    html += "      document.getElementById('progressText').textContent = percent + '%';";
-    html += "      console.log('Upload progress: ' + percent + '%');"; // Debug logging
-    html += "    }";
-    html += "  };";
-    html += "  ";
-    html += "  // Handle completion";
-    html += "  xhr.onload = function() {";
-    html += "    if (xhr.status === 200) {";
-    html += "      document.getElementById('statusMessage').innerHTML = 'V3R1FY1NG F1L3...';";
+    html += "  const files = Array.from(document.getElementById('fileInput').files);";
+    html += "  const list = document.getElementById('fileList');";
+    html += "  const total = files.reduce(function(n, f) { return n + f.size; }, 0);";
+    html += "  const sent = files.map(function() { return 0; });";
+    html += "  list.innerHTML = '';";
+    html += "  const uploads = files.map(function(file, i) {";
+    html += "    const row = document.createElement('div');";
+    html += "    list.appendChild(row);";
+    html += "    return sendFile(file, function(text, done) {";
+    html += "      row.textContent = file.name + ': ' + text;";
+    html += "      if (done !== undefined) {";
+    html += "        sent[i] = done;";
+    html += "        setProgress(sent.reduce(function(a, b) { return a + b; }, 0), total);";
+    html += "      }";
+    html += "    }).then(function(result) {";
+    html += "      row.textContent = file.name + ': ' + (result === 'ok' ? 'D0N3' : result === 'corrupt' ? 'QU4R4N71N3D' :";
+    html += "        result === 'rejected' ? 'R3J3C73D (C0N73N7 D035 N07 M47CH 7YP3)' :";
+    html += "        result === 'full' ? 'N07 3N0UGH SP4C3 0N C4RD' : 'F41L3D');";
+    html += "      return result;";
+    html += "    });";
+    html += "  });";
+    html += "  Promise.all(uploads).then(function(results) {";
+    html += "    if (results.every(function(r) { return r === 'ok'; })) {";
+    html += "      setStatus('V3R1FY1NG F1L3...');";
     html += "      setTimeout(function() {";
-    html += "        document.getElementById('statusMessage').className = 'verification-success';";
-    html += "        document.getElementById('statusMessage').innerHTML = 'F1L3 V3R1F13D SUC3SSFULLY!';";
-    html += "        // Wait longer before redirecting - 5 seconds";
+    html += "        setStatus('F1L3 V3R1F13D SUC3SSFULLY!', 'verification-success');";
+    html += "        /* Wait longer before redirecting - 5 seconds */";
     html += "        setTimeout(function() {";
-    html += "          window.location.href = '/?filename=' + encodeURIComponent(fileName);";
+    html += "          window.location.href = '/?filename=' + encodeURIComponent(files[0].name);";
     html += "        }, 5000);";
     html += "      }, 1500);";
+    html += "    } else if (results.indexOf('corrupt') >= 0) {";
+    html += "      setStatus('V3R1F1C4710N F41L3D! F1L3 QU4R4N71N3D.', 'verification-failed');";
+    html += "      document.getElementById('submitBtn').disabled = false;";
+    html += "    } else if (results.indexOf('full') >= 0) {";
+    html += "      setStatus('C4RD FULL! N07 3N0UGH SP4C3.', 'verification-failed');";
+    html += "      document.getElementById('submitBtn').disabled = false;";
+    html += "    } else if (results.indexOf('rejected') >= 0) {";
+    html += "      setStatus('F1L3 R3J3C73D! C0N73N7 D035 N07 M47CH 175 7YP3.', 'verification-failed');";
+    html += "      document.getElementById('submitBtn').disabled = false;";
     html += "    } else {";
-    html += "      document.getElementById('statusMessage').className = 'verification-failed';";
-    html += "      document.getElementById('statusMessage').innerHTML = 'V3R1F1C4710N F41L3D!';";
+    html += "      setStatus('UPL04D F41L3D! CH3CK C0NN3C710N.', 'verification-failed');";
     html += "      document.getElementById('submitBtn').disabled = false;";
     html += "    }";
-    html += "  };";
-    html += "  ";
-    html += "  // Handle errors";
-    html += "  xhr.onerror = function() {";
-    html += "    document.getElementById('statusMessage').className = 'verification-failed';";
-    html += "    document.getElementById('statusMessage').innerHTML = 'UPL04D F41L3D! CH3CK C0NN3C710N.';";
-    html += "    document.getElementById('submitBtn').disabled = false;";
-    html += "  };";
-    html += "  ";
-    html += "  xhr.send(formData);";
+    html += "  });";
     html += "  return false;"; // Prevent regular form submission
     html += "}";
     html += "</script>";
@@ -1292,7 +7207,11 @@ void handleUploadPage() {
     html += "<div class='formats'>[AZW|DOC|DOCX|EPUB|FB2]</div>";
     html += "<div class='formats'>[iBOOK|LIB|MOBI|PDB]</div>";
     html += "<div class='formats'>[PDF|PRC|RTF|TXT]</div>";
-    html += "<input id='fileInput' type='file' name='file' accept='.pdf,.txt,.rtf,.epub,.azw,.mobi,.lib,.fb2,.prc,.pdb,.ibook,.doc,.docx' required><br>";
+    html += "<input id='fileInput' type='file' name='file' accept='";
+    for (size_t i = 0; i < FILE_TYPE_COUNT; ++i) {
+        html += String(i > 0 ? ",." : ".") + FILE_TYPES[i].ext;
+    }
+    html += "' multiple required><br>";
     
     html += "<p style='color:#0ff; font-size:0.9em; padding: 10px; border: 1px dashed #0ff; border-radius: 10px;'>"
         "Trouble uploading? Open your browser of choice and navigate to 192.168.4.1"
@@ -1309,6 +7228,7 @@ void handleUploadPage() {
     // Status area with more visibility
     html += "<div id='statusArea' class='status-area'>";
     html += "<div id='statusMessage'>R34DY</div>";
+    html += "<div id='fileList'></div>";
     html += "</div>";
     
     html += "<input id='submitBtn' type='submit' value='UPLOAD'>";
@@ -1387,143 +7307,570 @@ void handleDisclaimer() {
     server.send(200, "text/html", html);
 }
 
+// Places an uploaded name in its letter section, creating directories as needed. Returns the
+// public library path and sets sdPath to the physical one; "" when mkdir fails.
+String prepareUploadTarget(const String& filename, String& sdPath) {
+    // Determine correct directory based on first character
+    String dirPath = "/Alexandria/";
+    char firstChar = toupper(filename.charAt(0));
+    
+    if (isdigit(firstChar)) {
+        dirPath += "0-9";
+    } else if (isalpha(firstChar)) {
+        dirPath += String(firstChar);
+    } else {
+        dirPath += "#@";
+    }
+
+    // Ensure directory exists
+    if (!SD.exists(dirPath)) {
+        Serial.println("Creating directory: " + dirPath);
+        if (!SD.mkdir(dirPath)) {
+            Serial.println("Failed to create directory: " + dirPath);
+            return "";
+        }
+    }
+
+    String publicPath = dirPath + "/" + filename;
+    sdPath = libraryLayout == LIBRARY_LAYOUT_FLAT ? publicPath : libraryShardedPath(publicPath);
+    Serial.println("Creating file: " + sdPath);
+
+    if (sdPath != publicPath) {
+        String bucketPath = sdPath.substring(0, sdPath.lastIndexOf('/'));
+        if (!SD.exists(bucketPath) && !SD.mkdir(bucketPath)) {
+            Serial.println("Failed to create directory: " + bucketPath);
+            return "";
+        }
+    }
+    
+    return publicPath;
+}
+
+// Swaps a finished temp file in for the book. FAT can't rename over an existing file, so the
+// old copy steps aside under a backup name first and is only deleted once the new one is in
+// place; if the final rename fails it goes back. Readers get the old book, the new one, or a
+// brief 404, never a partially written file. The temp file is left to the caller on failure.
+bool commitUpload(const String& publicPath, const String& sdPath, const String& tempPath) {
+    String existingPath = libraryPhysicalPath(publicPath);
+    cancelUploadVerify(publicPath);
+    fileCacheInvalidate(existingPath);
+    fileCacheInvalidate(sdPath);
+    dropGzipSidecar(publicPath);
+    dropPageIndex(publicPath);
+
+    String backupPath;
+    size_t existingSize = 0;
+    if (SD.exists(existingPath)) {
+        existingSize = sdFileBytes(existingPath.c_str());
+        backupPath = uploadBackupPath(existingPath);
+        SD.remove(backupPath);
+        if (!SD.rename(existingPath, backupPath)) {
+            Serial.println("[UPLOAD][ERROR] Cannot move " + existingPath + " aside");
+            return false;
+        }
+    }
+    if (sdPath != existingPath && SD.exists(sdPath)) {
+        SD.remove(sdPath);  // Stale copy at the other layout's location
+    }
+    bool ok = SD.rename(tempPath, sdPath);
+    fileCacheInvalidate(sdPath);
+    if (!ok) {
+        if (backupPath.length() > 0 && !SD.rename(backupPath, existingPath)) {
+            // sweepUploadTemps puts it back on the next boot
+            Serial.println("[UPLOAD][ERROR] Cannot restore " + existingPath + " from " + backupPath);
+        }
+        return false;
+    }
+
+    dropDownloadStats(publicPath);  // A new book starts from zero
+    if (backupPath.length() > 0) {
+        SD.remove(backupPath);
+        noteStorageRemoved(publicPath, existingSize);
+        noteClustersResized(existingSize, 0);
+        recordLibraryChange(LIBRARY_CHANGE_REMOVE, publicPath);
+    }
+    return true;
+}
+
+// Opens the multipart temp file once the part's first bytes check out and writes them ahead of
+// the rest. A mismatch ends the part there: no file, no preallocation, status 415.
+bool openUploadPart(UploadContext& ctx) {
+    if (ctx.sniffType && !uploadSniffCheck(ctx, ctx.publicPath)) {
+        uploadWriterEnd(ctx.writer);
+        contentHashFinish(ctx.hasher);
+        ctx.status = ctx.status == 200 ? 415 : ctx.status;
+        return false;
+    }
+
+    // The current version stays downloadable until the new one is complete
+    SD.remove(ctx.tempPath);
+    ctx.file = SD.open(ctx.tempPath, FILE_WRITE);
+    if (!ctx.file) {
+        Serial.println("Failed to open file for writing: " + ctx.tempPath);
+        uploadWriterEnd(ctx.writer);
+        contentHashFinish(ctx.hasher);
+        ctx.status = ctx.status == 200 ? 500 : ctx.status;
+        return false;
+    }
+    if (server.hasArg("size")) {
+        // Size sent by the upload page; without it the file grows as before
+        uploadPreallocate(ctx.writer, ctx.file, static_cast<size_t>(server.arg("size").toInt()));
+    }
+    uploadWriterAppend(ctx.writer, ctx.file, ctx.sniff, ctx.sniffed);
+    ctx.sniffed = 0;
+    return true;
+}
+
 void handleFileUpload() {
     if (server.uri() != "/upload") return;
    
     HTTPUpload& upload = server.upload();
-     Serial.printf("Status: %d | Filename: %s | Bytes: %d\n", 
-                upload.status, 
-                upload.filename.c_str(), 
-                upload.currentSize);
-    static String currentFilePath;
-    static size_t totalBytes = 0;
    
     if (upload.status == UPLOAD_FILE_START) {
+        // One context per POST; a multi-file form reuses it part by part, keeping the worst status
+        if (!uploadRequest || uploadRequest->sessionId.length() > 0) {
+            uploadRequest.reset(new UploadContext());
+        }
+        UploadContext& ctx = *uploadRequest;
+        if (ctx.status == 0) {
+            ctx.status = 200;
+        }
         String filename = upload.filename;
+        if (!isSafeUploadName(filename)) {
+            ctx.status = ctx.status == 200 ? 400 : ctx.status;
+            return;
+        }
         if (!isAllowedFile(filename)) {
             return;
         }
+        if (server.hasArg("size") && !uploadFits(strtoull(server.arg("size").c_str(), nullptr, 10))) {
+            uploadsRejectedFull++;
+            Serial.printf("[UPLOAD] Refused %s: %s bytes announced, %llu free\n", filename.c_str(),
+                          server.arg("size").c_str(), static_cast<unsigned long long>(sdFreeBytes()));
+            ctx.status = ctx.status == 200 ? 507 : ctx.status;
+            return;
+        }
 
-        // Determine correct directory based on first character
-        String dirPath = "/Alexandria/";
-        char firstChar = toupper(filename.charAt(0));
+        ctx.publicPath = prepareUploadTarget(filename, ctx.sdPath);
+        if (ctx.publicPath.length() == 0) {
+            return;
+        }
         
-        if (isdigit(firstChar)) {
-            dirPath += "0-9";
-        } else if (isalpha(firstChar)) {
-            dirPath += String(firstChar);
-        } else {
-            dirPath += "#@";
+        // The temp file is only opened once the first block has passed the type check
+        ctx.tempPath = uploadTempPath(ctx.sdPath);
+        ctx.received = 0;
+        contentHashBegin(ctx.hasher);
+        uploadWriterBegin(ctx.writer, uploadBufferSize);
+        uploadSniffBegin(ctx, filename);
+        if (!ctx.sniffType) {
+            openUploadPart(ctx);
         }
-
-        // Ensure directory exists
-        if (!SD.exists(dirPath)) {
-            Serial.println("Creating directory: " + dirPath);
-            if (!SD.mkdir(dirPath)) {
-                Serial.println("Failed to create directory: " + dirPath);
+        
+    } else if (!uploadRequest || (!uploadRequest->file && !uploadRequest->sniffType)) {
+        return;
+    } else if (upload.status == UPLOAD_FILE_WRITE) {
+        UploadContext& ctx = *uploadRequest;
+        ctx.received += upload.currentSize;
+        contentHashUpdate(ctx.hasher, upload.buf, upload.currentSize);
+        const uint8_t* data = upload.buf;
+        size_t length = upload.currentSize;
+        if (ctx.sniffType) {
+            size_t held = uploadSniffHold(ctx, data, length);
+            data += held;
+            length -= held;
+            if (ctx.sniffed < UPLOAD_SNIFF_BYTES || !openUploadPart(ctx)) {
                 return;
             }
         }
-
-        // Open file in correct directory
-        currentFilePath = dirPath + "/" + filename;
-        Serial.println("Creating file: " + currentFilePath);
-        
-        // Remove any existing file with same name
-        if (SD.exists(currentFilePath)) {
-            SD.remove(currentFilePath);
+        uploadWriterAppend(ctx.writer, ctx.file, data, length);
+    } else if (upload.status == UPLOAD_FILE_END) {
+        UploadContext& ctx = *uploadRequest;
+        if (ctx.sniffType && !openUploadPart(ctx)) {
+            return;  // Shorter than the hold and not what its name says
         }
-        
-        uploadFile = SD.open(currentFilePath, FILE_WRITE);
-        totalBytes = 0;
-        
-        if (!uploadFile) {
-            Serial.println("Failed to open file for writing: " + currentFilePath);
+        uploadWriterFlush(ctx.writer, ctx.file);
+        uint32_t crcMicros = ctx.writer.crcMicros;
+        uploadWriterEnd(ctx.writer);
+        ctx.file.close();
+        if (ctx.writer.preallocated > ctx.received) {
+            if (truncateSdFile(ctx.tempPath, ctx.received)) {
+                noteClustersResized(ctx.writer.preallocated, ctx.received);
+            } else {
+                Serial.println("[UPLOAD][ERROR] Failed to trim preallocated file: " + ctx.tempPath);
+            }
+        }
+
+        unsigned long elapsed = std::max(1UL, millis() - ctx.writer.startedAt);
+        uploadLastMBps = ctx.received / 1048.576f / elapsed;
+        uploadsCompleted++;
+        uploadBytesTotal += ctx.received;
+        Serial.printf("[UPLOAD] %s: %u bytes in %lu ms (%.2f MB/s, %lu writes, %lu ms writing, %lu ms crc)\n",
+                      ctx.sdPath.c_str(), static_cast<unsigned int>(ctx.received), elapsed, uploadLastMBps,
+                      static_cast<unsigned long>(ctx.writer.writes),
+                      static_cast<unsigned long>(ctx.writer.writeMicros / 1000),
+                      static_cast<unsigned long>(crcMicros / 1000));
+
+        // The page sends the CRC-32 it computed; a short write or a different CRC means the
+        // card doesn't hold what the reader meant to give us
+        bool digestMismatch = server.hasArg("crc") &&
+                              strtoul(server.arg("crc").c_str(), nullptr, 16) != ctx.writer.crc;
+        if (ctx.writer.failed || ctx.writer.written != ctx.received || digestMismatch) {
+            Serial.printf("[UPLOAD][ERROR] %s: wrote %u of %u bytes, crc %08lx, client %s\n",
+                          ctx.sdPath.c_str(), static_cast<unsigned int>(ctx.writer.written),
+                          static_cast<unsigned int>(ctx.received), static_cast<unsigned long>(ctx.writer.crc),
+                          server.hasArg("crc") ? server.arg("crc").c_str() : "-");
+            quarantineUpload(ctx.tempPath, upload.filename);
+            contentHashFinish(ctx.hasher);
+            ctx.status = 422;
             return;
         }
-        
-    } else if (upload.status == UPLOAD_FILE_WRITE) {
-        if (uploadFile) {
-            size_t bytesWritten = uploadFile.write(upload.buf, upload.currentSize);
-            if (bytesWritten != upload.currentSize) {
-                Serial.println("Warning: Bytes written mismatch! Expected: " + 
-                               String(upload.currentSize) + ", Actual: " + String(bytesWritten));
+        if (!commitUpload(ctx.publicPath, ctx.sdPath, ctx.tempPath)) {
+            Serial.println("[UPLOAD][ERROR] Failed to move " + ctx.tempPath + " into place");
+            if (SD.remove(ctx.tempPath)) {
+                noteClustersResized(ctx.received, 0);
             }
-            totalBytes += bytesWritten;
+            contentHashFinish(ctx.hasher);
+            ctx.status = ctx.status == 200 ? 500 : ctx.status;
+            return;
         }
-    } else if (upload.status == UPLOAD_FILE_END) {
-        if (uploadFile) {
-            uploadFile.close();
-            Serial.println("Upload complete, file size: " + String(totalBytes) + " bytes");
-            
-            // Verify file is readable and has correct size
-            verifyUploadedFile(currentFilePath, totalBytes);
+        noteStorageAdded(ctx.publicPath, ctx.received);
+        queueUploadVerify(ctx.publicPath, ctx.received, ctx.writer.crc);
+
+        // Identical content already on the card becomes an alias instead of a second copy
+        if (!registerUploadFingerprint(ctx.publicPath, contentHashFinish(ctx.hasher), ctx.received)) {
+            recordLibraryChange(LIBRARY_CHANGE_ADD, ctx.publicPath);
+            requestMetadataRescan();
         }
     } else if (upload.status == UPLOAD_FILE_ABORTED) {
-        if (uploadFile) {
-            uploadFile.close();
-            SD.remove(currentFilePath);
-            Serial.println("Upload aborted, file deleted: " + currentFilePath);
+        UploadContext& ctx = *uploadRequest;
+        uploadWriterEnd(ctx.writer);  // Buffered tail is discarded with the file
+        ctx.file.close();
+        if (SD.remove(ctx.tempPath)) {
+            noteClustersResized(std::max(ctx.writer.preallocated, ctx.writer.written), 0);
         }
+        contentHashFinish(ctx.hasher);
+        Serial.println("Upload aborted, partial file deleted; " + ctx.sdPath + " left as it was");
+        uploadRequest.reset();
     }
 }
 
-bool verifyUploadedFile(String filePath, size_t expectedSize) {
-    File file = SD.open(filePath, FILE_READ);
-    if (!file) {
-        Serial.println("VERIFICATION FAILED: Cannot open file: " + filePath);
-        return false;
+void handleUpload() {
+    if (server.method() != HTTP_POST) {
+        server.send(405, "text/plain", "Method Not Allowed");
+        return;
     }
+    int status = uploadRequest && uploadRequest->status != 0 ? uploadRequest->status : 200;
+    uploadRequest.reset();
+   
+    String html = "<html><head>";
+    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+    html += "<style>body{background:#000;color:#0f0;font-family:monospace;text-align:center;margin-top:50px;}</style>";
+    html += "</head><body>";
     
-    size_t fileSize = file.size();
-    
-    // Check file size
-    if (fileSize != expectedSize) {
-        Serial.println("VERIFICATION FAILED: Size mismatch for " + filePath + 
-                      ". Expected: " + String(expectedSize) + ", Actual: " + String(fileSize));
-        file.close();
-        return false;
+    if (status == 507) {
+        html += "<h2>C4RD FULL!</h2>";
+        html += "<p>There isn't enough free space on the card for this file.</p>";
+    } else if (status == 415) {
+        html += "<h2>F1L3 R3J3C73D!</h2>";
+        html += "<p>The file's contents don't match its extension. Nothing was stored.</p>";
+    } else if (status == 400) {
+        html += "<h2>F1L3 R3J3C73D!</h2>";
+        html += "<p>File names can't contain slashes, control characters or \"..\", or start with a dot.</p>";
+    } else if (status != 200) {
+        html += "<h2>V3R1F1C4710N F41L3D!</h2>";
+        html += "<p>The file arrived damaged and was quarantined. Please upload it again.</p>";
+    } else if (server.hasArg("filename")) {
+        String filename = server.arg("filename");
+        html += "<h2>F1L3 UPL04D 5UCC355FUL!</h2>";
+        html += "<p>File '" + htmlEscape(filename) + "' was successfully uploaded and verified.</p>";
+    } else {
+        html += "<h2>F1L3 PR0C3553D</h2>";
+        html += "<p>Upload complete!</p>";
     }
     
-    // Read a few bytes to ensure file is readable
-    byte testBuf[16];
-    size_t bytesRead = file.read(testBuf, min(16, (int)fileSize));
-    
-    if (bytesRead <= 0 && fileSize > 0) {
-        Serial.println("VERIFICATION FAILED: Cannot read from file: " + filePath);
-        file.close();
-        return false;
+    html += "<p><a href='/'>Return to Terminal</a></p>";
+    html += "</body></html>";
+    server.send(status, "text/html", html);
+}
+
+String uploadSessionJson(const String& id, const UploadSession& session) {
+    return "{\"id\":\"" + id + "\",\"offset\":" + String(static_cast<unsigned long>(session.crcBytes)) +
+           ",\"size\":" + String(static_cast<unsigned long>(session.size)) +
+           ",\"chunk\":" + String(static_cast<unsigned long>(UPLOAD_CHUNK_BYTES)) +
+           ",\"queue\":" + String(static_cast<unsigned int>(uploadQueuePosition(session))) + "}";
+}
+
+// POST ?name=&size=[&crc=] opens a session, GET ?id= reports its offset and queue position,
+// DELETE ?id= discards it
+void handleUploadSession() {
+    if (!sdCardReady) {
+        server.send(503, "text/plain", "SD card unavailable");
+        return;
     }
-    
-    file.close();
-    Serial.println("VERIFICATION SUCCESSFUL: " + filePath + 
-                  " (Size: " + String(fileSize) + " bytes, readable: yes)");
-    return true;
+
+    if (server.method() == HTTP_POST) {
+        String name = server.arg("name");
+        size_t size = strtoul(server.arg("size").c_str(), nullptr, 10);
+        if (!isSafeUploadName(name) || size == 0) {
+            server.send(400, "text/plain", "A plain file name and size are required");
+            return;
+        }
+        if (!isAllowedFile(name)) {
+            server.send(415, "text/plain", "Unsupported file type");
+            return;
+        }
+        if (!uploadFits(size)) {
+            uploadsRejectedFull++;
+            Serial.printf("[UPLOAD] Refused session for %s: %u bytes, %llu free\n", name.c_str(),
+                          static_cast<unsigned int>(size), static_cast<unsigned long long>(sdFreeBytes()));
+            server.send(507, "text/plain", "Not enough free space on the card");
+            return;
+        }
+        if (!trimUploadSessions()) {
+            uploadSessionsRefused++;
+            server.sendHeader("Retry-After", "5");
+            server.send(429, "text/plain", "Too many uploads in progress, try again shortly");
+            return;
+        }
+        String id = createUploadSession(name, size, server.hasArg("crc"),
+                                        strtoul(server.arg("crc").c_str(), nullptr, 16));
+        if (id.length() == 0) {
+            server.send(500, "text/plain", "Failed to create upload session");
+            return;
+        }
+        admitUploadSessions();
+        server.send(201, "application/json", uploadSessionJson(id, uploadSessions[id]));
+        return;
+    }
+
+    auto session = uploadSessions.find(server.arg("id"));
+    if (session == uploadSessions.end()) {
+        server.send(404, "application/json", "{}");
+        return;
+    }
+    if (server.method() == HTTP_DELETE) {
+        Serial.println("[UPLOAD] Session cancelled: " + session->first);
+        dropUploadSession(session->first);
+        admitUploadSessions();
+        server.send(204, "text/plain", "");
+        return;
+    }
+    session->second.touchedAt = millis();
+    admitUploadSessions();
+    server.send(200, "application/json", uploadSessionJson(session->first, session->second));
 }
 
-void handleUpload() {
-    if (server.method() != HTTP_POST) {
-        server.send(405, "text/plain", "Method Not Allowed");
+// Streams one PATCH body onto the end of a session's part file. The body only counts when the
+// session holds a writer slot (429 otherwise) and it starts exactly at the part's current
+// length; anything else gets 409 and the real offset.
+void handleUploadChunkBody() {
+    HTTPRaw& raw = server.raw();
+
+    if (raw.status == RAW_START) {
+        uploadRequest.reset(new UploadContext());
+        UploadContext& ctx = *uploadRequest;
+        ctx.sessionId = server.arg("id");
+        auto session = uploadSessions.find(ctx.sessionId);
+        if (session == uploadSessions.end()) {
+            ctx.status = 404;
+            return;
+        }
+        admitUploadSessions();
+        if (!session->second.writing) {
+            ctx.status = 429;
+            return;
+        }
+        ctx.offset = strtoul(server.arg("offset").c_str(), nullptr, 10);
+#if defined(ARDUINO_ARCH_ESP32)
+        // Written in place: a preallocated part is already full length
+        ctx.file = SD.open(uploadSessionPath(ctx.sessionId, ".part"), "r+");
+#else
+        ctx.file = SD.open(uploadSessionPath(ctx.sessionId, ".part"), FILE_APPEND);
+#endif
+        if (!ctx.file) {
+            ctx.status = 500;
+            return;
+        }
+        size_t partBytes = session->second.preallocated ? session->second.size : ctx.offset;
+        if (ctx.file.size() != partBytes || session->second.crcBytes != ctx.offset || !ctx.file.seek(ctx.offset)) {
+            ctx.file.close();
+            ctx.status = 409;
+            return;
+        }
+        ctx.status = 200;
+        session->second.touchedAt = millis();
+        uploadWriterBegin(ctx.writer, uploadBufferSize);
+        ctx.writer.startOffset = ctx.offset;
+        ctx.writer.preallocated = session->second.preallocated ? session->second.size : 0;
+        ctx.writer.crc = session->second.crc;
+        if (ctx.offset == 0) {
+            uploadSniffBegin(ctx, session->second.name);
+        }
+        return;
+    }
+
+    if (!uploadRequest || !uploadRequest->file) {
+        return;
+    }
+    UploadContext& ctx = *uploadRequest;
+    if (raw.status == RAW_WRITE) {
+        noteUploadBenchHeap();
+        if (ctx.status != 200) {
+            return;
+        }
+        UploadSession& session = uploadSessions[ctx.sessionId];
+        size_t position = ctx.offset + ctx.received;
+        size_t length = std::min(raw.currentSize, session.size > position ? session.size - position : 0);
+        if (length < raw.currentSize) {
+            ctx.status = 413;  // Bytes past the announced size are dropped
+        }
+        ctx.received += length;
+        const uint8_t* data = raw.buf;
+        if (ctx.sniffType) {
+            // The first chunk of a session is held back until its start has been checked
+            size_t held = uploadSniffHold(ctx, data, length);
+            data += held;
+            length -= held;
+            if (ctx.sniffed < UPLOAD_SNIFF_BYTES && ctx.received < session.size) {
+                return;
+            }
+            if (!uploadSniffCheck(ctx, session.name)) {
+                ctx.status = 415;
+                return;
+            }
+            if (!uploadWriterAppend(ctx.writer, ctx.file, ctx.sniff, ctx.sniffed)) {
+                ctx.status = 500;
+            }
+        }
+        if (!uploadWriterAppend(ctx.writer, ctx.file, data, length)) {
+            ctx.status = 500;
+        }
+        return;
+    }
+
+    // RAW_END or RAW_ABORTED: whatever arrived intact is kept and the next PATCH resumes there.
+    // A body that ended inside the hold has its short start checked now; a dropped one resends.
+    if (ctx.sniffType && raw.status == RAW_END && ctx.status == 200) {
+        if (!uploadSniffCheck(ctx, uploadSessions[ctx.sessionId].name)) {
+            ctx.status = 415;
+        } else if (!uploadWriterAppend(ctx.writer, ctx.file, ctx.sniff, ctx.sniffed)) {
+            ctx.status = 500;
+        }
+    }
+    uploadWriterFlush(ctx.writer, ctx.file);
+    uploadWriterEnd(ctx.writer);
+    ctx.file.close();
+    uploadBytesTotal += ctx.writer.written;
+    if (ctx.status == 415) {
+        dropUploadSession(ctx.sessionId);  // Nothing of it reached the part file
+        admitUploadSessions();
+        if (raw.status == RAW_ABORTED) {
+            uploadRequest.reset();
+        }
+        return;
+    }
+
+    // The running CRC moves forward with the bytes on the card. After a short write the
+    // part goes back to the last point the CRC covers and the client resends from there.
+    UploadSession& session = uploadSessions[ctx.sessionId];
+    String partPath = uploadSessionPath(ctx.sessionId, ".part");
+    if (ctx.writer.failed) {
+        if (truncateSdFile(partPath, session.crcBytes)) {
+            noteClustersResized(std::max(ctx.writer.preallocated, ctx.offset + ctx.writer.written), session.crcBytes);
+            session.preallocated = false;  // Grows chunk by chunk from here
+        } else {
+            dropUploadSession(ctx.sessionId);
+        }
+    } else {
+        session.crc = ctx.writer.crc;
+        session.crcBytes = ctx.offset + ctx.writer.written;
+        if (!writeUploadSessionMeta(ctx.sessionId, session)) {
+            Serial.println("[UPLOAD][ERROR] Cannot update session " + ctx.sessionId);
+        }
+    }
+    if (raw.status == RAW_ABORTED) {
+        Serial.printf("[UPLOAD] Session %s dropped at %u bytes; kept for resume\n", ctx.sessionId.c_str(),
+                      static_cast<unsigned int>(ctx.offset + ctx.writer.written));
+        uploadRequest.reset();  // No reply follows an aborted body
+    }
+}
+
+void handleUploadChunk() {
+    std::unique_ptr<UploadContext> ctx = std::move(uploadRequest);
+    if (ctx && ctx->status == 415) {
+        uploadChunksRejected++;
+        server.send(415, "text/plain", "File contents do not match its type; upload discarded");
+        return;
+    }
+    auto session = ctx ? uploadSessions.find(ctx->sessionId) : uploadSessions.end();
+    if (!ctx || ctx->status == 0 || session == uploadSessions.end()) {
+        server.send(404, "application/json", "{}");
+        return;
+    }
+    if (ctx->status == 200) {
+        uploadChunksAccepted++;
+    } else {
+        uploadChunksRejected++;
+    }
+    server.send(ctx->status, "application/json", uploadSessionJson(session->first, session->second));
+}
+
+// One line per session: id, state (writing, or queued with its position), offset, size, name
+void handleUploadQueue() {
+    admitUploadSessions();
+    String body;
+    for (const auto& entry : uploadSessions) {
+        const UploadSession& session = entry.second;
+        size_t position = uploadQueuePosition(session);
+        body += entry.first + "\t" + (position == 0 ? String("writing") : "queued " + String(position)) + "\t" +
+                String(static_cast<unsigned long>(session.crcBytes)) + "\t" +
+                String(static_cast<unsigned long>(session.size)) + "\t" + session.name + "\n";
+    }
+    server.send(200, "text/plain", body);
+}
+
+// Moves a complete part file into the library under the session's name
+void handleUploadFinalize() {
+    auto session = uploadSessions.find(server.arg("id"));
+    if (session == uploadSessions.end()) {
+        server.send(404, "application/json", "{}");
+        return;
+    }
+    String id = session->first;
+    UploadSession finished = session->second;
+    if (uploadSessionPartBytes(id) != finished.size || finished.crcBytes != finished.size) {
+        server.send(409, "application/json", uploadSessionJson(id, finished));
         return;
     }
-   
-    String html = "<html><head>";
-    html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-    html += "<style>body{background:#000;color:#0f0;font-family:monospace;text-align:center;margin-top:50px;}</style>";
-    html += "</head><body>";
-    
-    if (server.hasArg("filename")) {
-        String filename = server.arg("filename");
-        html += "<h2>F1L3 UPL04D 5UCC355FUL!</h2>";
-        html += "<p>File '" + filename + "' was successfully uploaded and verified.</p>";
-    } else {
-        html += "<h2>F1L3 PR0C3553D</h2>";
-        html += "<p>Upload complete!</p>";
+    if (finished.hasDigest && finished.crc != finished.digest) {
+        // Checked before the target is prepared, so the book it would have replaced stays put
+        Serial.printf("[UPLOAD][ERROR] Session %s: crc %08lx, client %08lx\n", id.c_str(),
+                      static_cast<unsigned long>(finished.crc), static_cast<unsigned long>(finished.digest));
+        quarantineUpload(uploadSessionPath(id, ".part"), finished.name);
+        dropUploadSession(id);
+        server.send(422, "text/plain", "Checksum mismatch; upload quarantined");
+        return;
     }
-    
-    html += "<p><a href='/'>Return to Terminal</a></p>";
-    html += "</body></html>";
-    server.send(200, "text/html", html);
+
+    String sdPath;
+    String publicPath = prepareUploadTarget(finished.name, sdPath);
+    if (publicPath.length() == 0 || !commitUpload(publicPath, sdPath, uploadSessionPath(id, ".part"))) {
+        Serial.println("[UPLOAD][ERROR] Failed to finalize session " + id + " as " + sdPath);
+        server.send(500, "text/plain", "Failed to store upload");
+        return;
+    }
+    SD.remove(uploadSessionPath(id, ".meta"));
+    uploadSessions.erase(id);
+
+    uploadsCompleted++;
+    noteStorageAdded(publicPath, finished.size);
+    queueUploadVerify(publicPath, finished.size, finished.crc);
+    recordLibraryChange(LIBRARY_CHANGE_ADD, publicPath);
+    requestMetadataRescan();
+    requestFingerprintRescan();  // Duplicate detection happens in the background pass
+    Serial.printf("[UPLOAD] Session %s finalized: %s (%u bytes)\n", id.c_str(), sdPath.c_str(),
+                  static_cast<unsigned int>(finished.size));
+    server.send(200, "application/json", "{\"path\":\"" + jsonEscape(publicPath) + "\"}");
 }
 
 void handleForum() {
@@ -1564,40 +7911,24 @@ void handleForum() {
 
     // Read and display threads
    
-    File threadsFile = SD.open("/forum/threads.json", FILE_READ);
+    uint32_t cacheEpoch;
+    File threadsFile = fileCacheOpen(FORUM_THREADS_LOG, cacheEpoch);
     if (threadsFile) {
-        String threads = threadsFile.readString();
-        threadsFile.close();
-
-        int start = threads.indexOf('[');
-        int end = threads.lastIndexOf(']');
-        if (start >= 0 && end >= 0) {
-            threads = threads.substring(start + 1, end);
-            while (threads.length() > 0) {
-                int threadEnd = threads.indexOf('}');
-                if (threadEnd < 0) break;
-               
-                String threadData = threads.substring(0, threadEnd + 1);
-                String threadId = threadData.substring(threadData.indexOf("\"id\":\"") + 6);
-                threadId = threadId.substring(0, threadId.indexOf("\""));
-                String threadTitle = threadData.substring(threadData.indexOf("\"title\":\"") + 9);
-                threadTitle = threadTitle.substring(0, threadTitle.indexOf("\""));
-
-
-                html += "<div id='thread-list'>";
-                html += "<div class='thread'>";
-                html += "<div style='text-align: center;'>";
-                html += "<a href='/forum/thread?id=" + threadId + "'>";
-                html += "&gt; " + threadTitle + " &lt;";
-                html += "</a>";
-                html += "</div>";
-                html += "</div>";
-                html += "</div>";
-
-
-                threads = threads.substring(threadEnd + 2);
-            }
+        String record;
+        while (forumLogNext(threadsFile, record)) {
+            ForumThread thread = parseForumThread(record);
+
+            html += "<div id='thread-list'>";
+            html += "<div class='thread'>";
+            html += "<div style='text-align: center;'>";
+            html += "<a href='/forum/thread?id=" + thread.id + "'>";
+            html += "&gt; " + thread.title + " &lt;";
+            html += "</a>";
+            html += "</div>";
+            html += "</div>";
+            html += "</div>";
         }
+        fileCacheRelease(FORUM_THREADS_LOG, threadsFile, cacheEpoch);
     }
 
     html += "<div style='text-align: center;'>";
@@ -1668,18 +7999,18 @@ void handleThread() {
     html += "</head><body>";
 
     // Find thread title
-    File threadsFile = SD.open("/forum/threads.json", FILE_READ);
+    uint32_t cacheEpoch;
+    File threadsFile = fileCacheOpen(FORUM_THREADS_LOG, cacheEpoch);
     String threadTitle = "Unknown Thread";
     if (threadsFile) {
-        String threads = threadsFile.readString();
-        threadsFile.close();
-       
-        int threadStart = threads.indexOf("\"id\":\"" + threadId + "\"");
-        if (threadStart >= 0) {
-            int titleStart = threads.indexOf("\"title\":\"", threadStart) + 9;
-            int titleEnd = threads.indexOf("\"", titleStart);
-            threadTitle = threads.substring(titleStart, titleEnd);
+        String record;
+        while (forumLogNext(threadsFile, record)) {
+            if (forumRecordField(record, 0) == threadId) {
+                threadTitle = forumRecordField(record, 1);
+                break;
+            }
         }
+        fileCacheRelease(FORUM_THREADS_LOG, threadsFile, cacheEpoch);
     }
 
     html += "<h1>// " + threadTitle + " //</h1>";
@@ -1688,45 +8019,7 @@ void handleThread() {
     html += "<div class='posts-container'>";
     html += "<div class='posts-wrapper'>";
 
-    // Store posts in an array first
-    std::vector<String> postsList;
-    String postsPath = "/forum/posts/" + threadId + ".json";
-    File postsFile = SD.open(postsPath, FILE_READ);
-    if (postsFile) {
-        String posts = postsFile.readString();
-        postsFile.close();
-
-        int start = posts.indexOf('[');
-        int end = posts.lastIndexOf(']');
-        if (start >= 0 && end >= 0) {
-            posts = posts.substring(start + 1, end);
-            while (posts.length() > 0) {
-                int postEnd = posts.indexOf('}');
-                if (postEnd < 0) break;
-               
-                String postData = posts.substring(0, postEnd + 1);
-                postsList.push_back(postData);
-                posts = posts.substring(postEnd + 2);
-            }
-        }
-    }
-
-    // Display posts in chronological order
-    for (const String& postData : postsList) {
-        String author = postData.substring(postData.indexOf("\"author\":\"") + 10);
-        author = author.substring(0, author.indexOf("\""));
-        String content = postData.substring(postData.indexOf("\"content\":\"") + 11);
-        content = content.substring(0, content.indexOf("\""));
-        String timestamp = postData.substring(postData.indexOf("\"timestamp\":\"") + 13);
-        timestamp = timestamp.substring(0, timestamp.indexOf("\""));
-
-        html += "<div class='post'>";
-        html += "<div class='post-header'>";
-        html += "[ USER: " + author + " " + formatTimestamp(timestamp.toInt()) + " ]";
-        html += "</div>";
-        html += "<div class='post-content'>" + content + "</div>";
-        html += "</div>";
-    }
+    html += renderForumPosts(threadId);
 
     html += "</div>"; // Close posts-wrapper
     html += "</div>"; // Close posts-container
@@ -1748,55 +8041,36 @@ void handleThread() {
     server.send(200, "text/html", html);
 }
 
-void handleThreadAjax() {
-    if (!server.hasArg("ajax")) {
-        handleThread();
-        return;
-    }
-
-    String threadId = server.arg("id");
+// Posts of a thread in the order they were written, as the thread page and its refresh show them
+String renderForumPosts(const String& threadId) {
     String html = "";
-    std::vector<String> postsList;
-    String postsPath = "/forum/posts/" + threadId + ".json";
-   
-    File postsFile = SD.open(postsPath, FILE_READ);
-    if (postsFile) {
-        String posts = postsFile.readString();
-        postsFile.close();
-
-        int start = posts.indexOf('[');
-        int end = posts.lastIndexOf(']');
-        if (start >= 0 && end >= 0) {
-            posts = posts.substring(start + 1, end);
-            while (posts.length() > 0) {
-                int postEnd = posts.indexOf('}');
-                if (postEnd < 0) break;
-               
-                String postData = posts.substring(0, postEnd + 1);
-                postsList.push_back(postData);
-                posts = posts.substring(postEnd + 2);
-            }
-        }
+    String postsPath = forumPostsPath(threadId);
+    uint32_t cacheEpoch;
+    File postsFile = fileCacheOpen(postsPath, cacheEpoch);
+    if (!postsFile) {
+        return html;
     }
-
-    // Display posts in chronological order
-    for (const String& postData : postsList) {
-        String author = postData.substring(postData.indexOf("\"author\":\"") + 10);
-        author = author.substring(0, author.indexOf("\""));
-        String content = postData.substring(postData.indexOf("\"content\":\"") + 11);
-        content = content.substring(0, content.indexOf("\""));
-        String timestamp = postData.substring(postData.indexOf("\"timestamp\":\"") + 13);
-        timestamp = timestamp.substring(0, timestamp.indexOf("\""));
-
+    String record;
+    while (forumLogNext(postsFile, record)) {
+        ForumPost post = parseForumPost(record);
         html += "<div class='post'>";
         html += "<div class='post-header'>";
-        html += "[ USER: " + author + " " + formatTimestamp(timestamp.toInt()) + " ]";
+        html += "[ USER: " + post.author + " " + formatTimestamp(post.timestamp.toInt()) + " ]";
         html += "</div>";
-        html += "<div class='post-content'>" + content + "</div>";
+        html += "<div class='post-content'>" + post.content + "</div>";
         html += "</div>";
     }
-   
-    server.send(200, "text/html", html);
+    fileCacheRelease(postsPath, postsFile, cacheEpoch);
+    return html;
+}
+
+void handleThreadAjax() {
+    if (!server.hasArg("ajax")) {
+        handleThread();
+        return;
+    }
+
+    server.send(200, "text/html", renderForumPosts(server.arg("id")));
 }
 
 void handleNewThread() {
@@ -1850,68 +8124,43 @@ void handleNewThread() {
             }
         }
 
-        // Create threads.json if it doesn't exist
-        if (!SD.exists("/forum/threads.json")) {
-            File threadsFile = SD.open("/forum/threads.json", FILE_WRITE);
-            if (threadsFile) {
-                threadsFile.println("[]");
-                threadsFile.close();
-            }
-        }
-
-        // Read existing threads
-        String threads = "[]";
-        File threadsFile = SD.open("/forum/threads.json", FILE_READ);
-        if (threadsFile) {
-            threads = threadsFile.readString();
-            threadsFile.close();
-            threads.trim();
-            if (!threads.startsWith("[")) {
-                threads = "[]";
-            }
-        }
-
-        // Create new thread JSON
-        String newThreadData;
-        if (threads == "[]") {
-            newThreadData = "[{\"id\":\"" + threadId + "\",";
-        } else {
-            newThreadData = threads.substring(0, threads.length() - 1) + ",{\"id\":\"" + threadId + "\",";
-        }
-        newThreadData += "\"title\":\"" + title + "\",";
-        newThreadData += "\"author\":\"" + author + "\",";
-        newThreadData += "\"timestamp\":\"" + String(millis()) + "\"}]";
-
-        // Write new thread data
-        SD.remove("/forum/threads.json");
-        threadsFile = SD.open("/forum/threads.json", FILE_WRITE);
-        if (!threadsFile) {
-            Serial.println("Error: Failed to open threads.json for writing");
-            errorHtml += "<p>Failed to create thread file. Redirecting...</p></body></html>";
-            server.send(500, "text/html", errorHtml);
+        ForumPost firstPost;
+        firstPost.id = String(millis());
+        firstPost.author = author;
+        firstPost.content = content;
+        firstPost.timestamp = String(millis());
+        String postRecord = forumPostRecord(firstPost);
+
+        ForumThread thread;
+        thread.id = threadId;
+        thread.title = title;
+        thread.author = author;
+        thread.timestamp = String(millis());
+        String threadRecord = forumThreadRecord(thread);
+
+        if (postRecord.length() > FORUM_RECORD_MAX || threadRecord.length() > FORUM_RECORD_MAX) {
+            Serial.println("Error: Thread too long");
+            errorHtml += "<p>Thread too long. Redirecting...</p></body></html>";
+            server.send(413, "text/html", errorHtml);
             return;
         }
-       
-        threadsFile.print(newThreadData);
-        threadsFile.close();
 
-        // Create initial post file
-        String postPath = "/forum/posts/" + threadId + ".json";
-        File postFile = SD.open(postPath, FILE_WRITE);
-        if (!postFile) {
+        // Posts log first: a thread record only ever points at a log that exists
+        if (!forumLogAppend(forumPostsPath(threadId), postRecord)) {
             Serial.println("Error: Failed to create post file");
             errorHtml += "<p>Failed to create post file. Redirecting...</p></body></html>";
             server.send(500, "text/html", errorHtml);
             return;
         }
 
-        String postData = "[{\"id\":\"" + String(millis()) + "\",";
-        postData += "\"author\":\"" + author + "\",";
-        postData += "\"content\":\"" + content + "\",";
-        postData += "\"timestamp\":\"" + String(millis()) + "\"}]";
-       
-        postFile.print(postData);
-        postFile.close();
+        if (!forumLogAppend(FORUM_THREADS_LOG, threadRecord)) {
+            Serial.println("Error: Failed to append to threads log");
+            fileCacheInvalidate(forumPostsPath(threadId));
+            SD.remove(forumPostsPath(threadId));
+            errorHtml += "<p>Failed to create thread file. Redirecting...</p></body></html>";
+            server.send(500, "text/html", errorHtml);
+            return;
+        }
 
         // Success - redirect to new thread
         server.sendHeader("Location", "/forum/thread?id=" + threadId);
@@ -1961,48 +8210,28 @@ void handleNewPost() {
             return;
         }
        
-        String postsPath = "/forum/posts/" + threadId + ".json";
+        String postsPath = forumPostsPath(threadId);
        
         // Check if thread exists
-        if (!SD.exists(postsPath)) {
+        size_t postsSize;
+        if (!fileCacheStat(postsPath, postsSize)) {
             server.send(404, "text/plain", "Thread not found");
             return;
         }
        
-        // Read existing posts
-        File postsFile = SD.open(postsPath, FILE_READ);
-        String currentPosts = "[]";
-        if (postsFile) {
-            currentPosts = postsFile.readString();
-            postsFile.close();
-           
-            // Validate JSON format
-            currentPosts.trim();
-            if (!currentPosts.startsWith("[")) {
-                currentPosts = "[]";
-            }
-        }
-       
-        // Create new post JSON
-        String newPost = "{\"id\":\"" + String(millis()) + "\",";
-        newPost += "\"author\":\"" + author + "\",";
-        newPost += "\"content\":\"" + content + "\",";
-        newPost += "\"timestamp\":\"" + String(millis()) + "\"}";
-       
-        // Prepare updated JSON
-        String updatedPosts;
-        if (currentPosts == "[]") {
-            updatedPosts = "[" + newPost + "]";
-        } else {
-            updatedPosts = currentPosts.substring(0, currentPosts.length() - 1) + "," + newPost + "]";
+        ForumPost post;
+        post.id = String(millis());
+        post.author = author;
+        post.content = content;
+        post.timestamp = String(millis());
+        String record = forumPostRecord(post);
+        if (record.length() > FORUM_RECORD_MAX) {
+            server.send(413, "text/plain", "Post too long");
+            return;
         }
-       
-        // Write updated posts
-        SD.remove(postsPath); // Remove old file
-        postsFile = SD.open(postsPath, FILE_WRITE);
-        if (postsFile) {
-            postsFile.print(updatedPosts);
-            postsFile.close();
+
+        // One record appended to the thread's log; nothing already written is touched
+        if (forumLogAppend(postsPath, record)) {
             Serial.println("Post added successfully");
            
             server.sendHeader("Location", "/forum/thread?id=" + threadId + "&scroll=true#bottom");
@@ -2024,4 +8253,805 @@ void handleToggle() {
     digitalWrite(ledPin, ledState);
     server.sendHeader("Location", "/");
     server.send(303);
-}
\ No newline at end of file
+}
+void handleMetrics() {
+    // Plain "name value" lines; every value is a counter kept in RAM, nothing touches the card here
+    String body;
+    body.reserve(256);
+    body += "library_files " + String(static_cast<unsigned long>(libraryFileCount)) + "\n";
+    body += "library_bytes " + String(static_cast<unsigned long long>(libraryTotalBytes)) + "\n";
+    body += "sd_total_bytes " + String(static_cast<unsigned long long>(sdTotalBytes)) + "\n";
+    body += "sd_used_bytes " + String(static_cast<unsigned long long>(sdUsedBytes)) + "\n";
+    body += "sd_free_known " + String(freeSpace.known ? 1 : 0) + "\n";
+    body += "sd_free_bytes " + String(static_cast<unsigned long long>(sdFreeBytes())) + "\n";
+    body += "sd_free_clusters " + String(static_cast<unsigned long>(freeSpace.freeClusters)) + "\n";
+    body += "sd_cluster_bytes " + String(static_cast<unsigned long>(freeSpace.clusterBytes)) + "\n";
+    body += "sd_free_count_ms " + String(freeSpace.countMs) + "\n";
+    body += "library_metrics_reconciled " + String(libraryMetricsReconciled ? 1 : 0) + "\n";
+    body += "library_metrics_scan_active " + String(libraryMetricsScan.active ? 1 : 0) + "\n";
+    body += "catalog_entries " + String(static_cast<unsigned long>(libraryCatalog.size())) + "\n";
+    body += "content_fingerprints " + String(static_cast<unsigned long>(pathFingerprints.size())) + "\n";
+    body += "content_aliases " + String(static_cast<unsigned long>(libraryAliases.size())) + "\n";
+    body += "duplicate_files " + String(static_cast<unsigned long>(fingerprintJob.duplicateFiles)) + "\n";
+    body += "duplicate_bytes " + String(static_cast<unsigned long long>(fingerprintJob.duplicateBytes)) + "\n";
+    body += "uploads_completed " + String(uploadsCompleted) + "\n";
+    body += "upload_bytes_total " + String(static_cast<unsigned long long>(uploadBytesTotal)) + "\n";
+    body += "upload_last_mbps " + String(uploadLastMBps, 2) + "\n";
+    body += "upload_buffer_bytes " + String(static_cast<unsigned long>(uploadBufferSize)) + "\n";
+    body += "upload_sessions " + String(static_cast<unsigned int>(uploadSessions.size())) + "\n";
+    body += "upload_chunks_accepted " + String(uploadChunksAccepted) + "\n";
+    body += "upload_chunks_rejected " + String(uploadChunksRejected) + "\n";
+    body += "upload_sessions_refused " + String(uploadSessionsRefused) + "\n";
+    size_t uploadWriting = 0;
+    for (const auto& entry : uploadSessions) {
+        uploadWriting += entry.second.writing ? 1 : 0;
+    }
+    body += "upload_writers_active " + String(static_cast<unsigned int>(uploadWriting)) + "\n";
+    body += "upload_writers_max " + String(uploadWriterSlots) + "\n";
+    body += "upload_sessions_queued " + String(static_cast<unsigned int>(uploadSessions.size() - uploadWriting)) + "\n";
+    // Integrity costs as throughput: how fast the CRC and the read-back run on their own
+    body += "upload_crc_mbps " + String(uploadCrcMicros ? uploadCrcBytes / 1.048576 / uploadCrcMicros : 0.0, 2) + "\n";
+    body += "upload_verify_mbps " +
+            String(uploadVerifyMicros ? uploadVerifyBytes / 1.048576 / uploadVerifyMicros : 0.0, 2) + "\n";
+    body += "upload_verify_pending " + String(static_cast<unsigned int>(uploadVerifyJob.queue.size())) + "\n";
+    body += "upload_verify_passed " + String(uploadVerifyPassed) + "\n";
+    body += "upload_verify_failed " + String(uploadVerifyFailed) + "\n";
+    body += "upload_quarantined " + String(uploadsQuarantined) + "\n";
+    body += "upload_sniff_rejected " + String(uploadsSniffRejected) + "\n";
+    body += "upload_rejected_full " + String(uploadsRejectedFull) + "\n";
+    body += "downloads_completed " + String(downloadsCompleted) + "\n";
+    body += "downloads_failed " + String(downloadsFailed) + "\n";
+    body += "download_bytes_total " + String(static_cast<unsigned long long>(downloadBytesTotal)) + "\n";
+    body += "file_cache_handle_hits " + String(fileCacheHandleHits) + "\n";
+    body += "file_cache_handle_misses " + String(fileCacheHandleMisses) + "\n";
+    body += "file_cache_entry_hits " + String(fileCacheEntryHits) + "\n";
+    body += "file_cache_entry_misses " + String(fileCacheEntryMisses) + "\n";
+    body += "file_cache_saved_us " + String(static_cast<unsigned long long>(fileCacheSavedMicros)) + "\n";
+    unsigned long hotLookups = hotCacheHits + hotCacheMisses;
+    body += "hot_cache_objects " + String(static_cast<unsigned long>(hotCacheEntries.size())) + "\n";
+    body += "hot_cache_bytes " + String(static_cast<unsigned long>(hotCacheBytes)) + "\n";
+    body += "hot_cache_capacity_bytes " + String(static_cast<unsigned long>(hotCacheCapacity)) + "\n";
+    body += "hot_cache_filling_bytes " + String(static_cast<unsigned long>(hotCacheFilling)) + "\n";
+    body += "hot_cache_hits " + String(hotCacheHits) + "\n";
+    body += "hot_cache_misses " + String(hotCacheMisses) + "\n";
+    body += "hot_cache_hit_ratio " + String(hotLookups > 0 ? static_cast<float>(hotCacheHits) / hotLookups : 0.0f, 3) + "\n";
+    body += "hot_cache_rejected " + String(hotCacheRejected) + "\n";
+    body += "hot_cache_saved_bytes " + String(static_cast<unsigned long long>(hotCacheSavedBytes)) + "\n";
+    body += "download_stats_books " + String(static_cast<unsigned long>(downloadStats.size())) + "\n";
+    body += "download_stats_flushes " + String(downloadStatsFlushes) + "\n";
+    body += "download_stats_dirty " + String(downloadStatsDirty ? 1 : 0) + "\n";
+    body += "download_stats_update_ns " +
+            String(downloadStatsUpdates > 0
+                       ? static_cast<float>(downloadStatsCycles) * 1000.0f / ESP.getCpuFreqMHz() / downloadStatsUpdates
+                       : 0.0f, 0) + "\n";
+    body += "gzip_sidecars " + String(static_cast<unsigned long>(gzipSidecars.size())) + "\n";
+    body += "gzip_served " + String(gzipServed) + "\n";
+    body += "gzip_saved_bytes_total " + String(static_cast<unsigned long long>(gzipSavedBytesTotal)) + "\n";
+    rollGzipDays();
+    for (uint8_t day = 0; day < GZIP_DAYS_KEPT; ++day) {
+        body += "gzip_saved_bytes_day_" + String(day) + " " +
+                String(static_cast<unsigned long long>(gzipSavedBytesPerDay[day])) + "\n";
+    }
+    body += "download_active " + String(static_cast<unsigned long>(activeDownloads.size())) + "\n";
+    body += "download_slots " + String(downloadSlots) + "\n";
+    body += "download_rejected " + String(downloadsRejected) + "\n";
+    body += "download_rate_cap_bytes " + String(static_cast<unsigned long>(downloadRateCap)) + "\n";
+    body += "download_tokens " + String(static_cast<unsigned long>(downloadTokens)) + "\n";
+    body += "download_rounds " + String(downloadRounds) + "\n";
+    for (size_t i = 0; i < activeDownloads.size(); ++i) {
+        const ActiveDownload& download = *activeDownloads[i];
+        String prefix = "download_" + String(static_cast<unsigned long>(i)) + "_";
+        body += prefix + "sent " + String(static_cast<unsigned long>(download.pipe.sent)) + "\n";
+        body += prefix + "weight " + String(download.weight) + "\n";
+        body += prefix + "deficit " + String(static_cast<unsigned long>(download.deficit)) + "\n";
+    }
+    body += "library_layout_sharded " + String(libraryLayout == LIBRARY_LAYOUT_SHARDED ? 1 : 0) + "\n";
+    body += "shard_migration_active " + String(libraryLayout == LIBRARY_LAYOUT_MIGRATING ? 1 : 0) + "\n";
+    body += "shard_migration_moved " + String(shardMigration.moved) + "\n";
+    body += "shard_migration_skipped " + String(shardMigration.skipped) + "\n";
+    body += "forum_records_skipped " + String(forumRecordsSkipped) + "\n";
+    server.send(200, "text/plain", body);
+}
+
+void handleDuplicates() {
+    // Duplicates found by the last fingerprint pass, plus aliases created at upload time
+    String body = "# duplicate -> original\n";
+    for (const auto& dup : fingerprintJob.duplicates) {
+        body += dup.first + " -> " + dup.second + "\n";
+    }
+    body += "# alias -> original\n";
+    for (const auto& alias : libraryAliases) {
+        body += alias.first + " -> " + alias.second + "\n";
+    }
+    server.send(200, "text/plain", body);
+}
+
+void handleStats() {
+    // Most downloaded books (?n=, by completed downloads) and bytes served per section
+    size_t top = server.hasArg("n") ? static_cast<size_t>(server.arg("n").toInt()) : STATS_TOP_DEFAULT;
+    std::vector<std::pair<uint32_t, const String*>> ranking;
+    uint64_t sectionBytes[LIBRARY_SECTION_COUNT] = {0};
+    for (const auto& stat : downloadStats) {
+        ranking.push_back({stat.second.completes, &stat.first});
+        int section = librarySectionIndexForPath(stat.first);
+        if (section >= 0) {
+            sectionBytes[section] += stat.second.bytes;
+        }
+    }
+    top = std::min(top, ranking.size());
+    std::partial_sort(ranking.begin(), ranking.begin() + top, ranking.end(),
+                      [](const std::pair<uint32_t, const String*>& a, const std::pair<uint32_t, const String*>& b) {
+                          return a.first > b.first;
+                      });
+
+    String body = "# completes starts bytes path\n";
+    for (size_t i = 0; i < top; ++i) {
+        const DownloadStat& stat = downloadStats[*ranking[i].second];
+        body += String(static_cast<unsigned long>(stat.completes)) + " " +
+                String(static_cast<unsigned long>(stat.starts)) + " " +
+                String(static_cast<unsigned long long>(stat.bytes)) + " " + *ranking[i].second + "\n";
+    }
+    body += "# section bytes\n";
+    for (int section = 0; section < LIBRARY_SECTION_COUNT; ++section) {
+        if (sectionBytes[section] > 0) {
+            body += librarySectionName(section) + " " + String(static_cast<unsigned long long>(sectionBytes[section])) + "\n";
+        }
+    }
+    server.send(200, "text/plain", body);
+}
+
+void handleLibraryChanges() {
+    uint32_t since = server.hasArg("since") ? static_cast<uint32_t>(server.arg("since").toInt()) : 0;
+
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send(200, "application/json", "");
+    server.sendContent("{\"seq\":" + String(static_cast<unsigned long>(libraryJournalSeq)) +
+                       ",\"generation\":" + String(static_cast<unsigned long>(libraryGeneration)));
+
+    // Clients that fell behind a rotation have to rebuild from a full listing
+    if (since < libraryJournalBaseSeq) {
+        server.sendContent(",\"reset\":true,\"changes\":[]}");
+        finalizeChunkedResponse();
+        return;
+    }
+
+    server.sendContent(",\"changes\":[");
+    File journal = since < libraryJournalSeq ? SD.open(CATALOG_JOURNAL_PATH, FILE_READ) : File();
+    if (journal) {
+        // Jump to the last checkpoint at or before the first wanted record
+        for (const auto& checkpoint : journalCheckpoints) {
+            if (checkpoint.seq > since + 1) {
+                break;
+            }
+            journal.seek(checkpoint.offset);
+        }
+        bool first = true;
+        while (journal.available()) {
+            String line = journal.readStringUntil('\n');
+            uint32_t seq = line.toInt();
+            if (seq <= since) {
+                continue;
+            }
+            int tab1 = line.indexOf('\t');
+            int tab2 = tab1 >= 0 ? line.indexOf('\t', tab1 + 1) : -1;
+            if (tab2 < 0) {
+                continue;
+            }
+            String item = first ? "{" : ",{";
+            item += "\"seq\":" + String(static_cast<unsigned long>(seq));
+            item += ",\"op\":\"" + line.substring(tab1 + 1, tab2) + "\"";
+            item += ",\"path\":\"" + jsonEscape(line.substring(tab2 + 1)) + "\"";
+            item += "}";
+            server.sendContent(item);
+            first = false;
+        }
+        journal.close();
+    }
+    server.sendContent("]}");
+    finalizeChunkedResponse();
+}
+
+void handleReshard() {
+    if (!sdCardReady) {
+        server.send(503, "text/plain", "SD card not ready");
+        return;
+    }
+    if (!startShardMigration()) {
+        server.send(409, "text/plain", libraryLayout == LIBRARY_LAYOUT_SHARDED ? "Library is already sharded"
+                                                                                : "Migration already running");
+        return;
+    }
+    server.send(202, "text/plain", "Migration started; progress on /metrics");
+}
+
+// The extension check as it was before the file-type registry; only /bench/filetypes uses it
+bool legacyIsAllowedFile(const String& filename) {
+  String lowerFilename = filename;
+  lowerFilename.toLowerCase();
+  return lowerFilename.endsWith(".pdf") || lowerFilename.endsWith(".epub") || lowerFilename.endsWith(".doc") ||
+         lowerFilename.endsWith(".docx") || lowerFilename.endsWith(".rtf") || lowerFilename.endsWith(".txt") ||
+         lowerFilename.endsWith(".azw") || lowerFilename.endsWith(".mobi") || lowerFilename.endsWith(".lib") ||
+         lowerFilename.endsWith(".fb2") || lowerFilename.endsWith(".prc") || lowerFilename.endsWith(".pdb") ||
+         lowerFilename.endsWith(".ibook");
+}
+
+void handleFileTypeBenchmark() {
+    // Listing-style names: mostly books, some strays, mixed case
+    static const char* const NAMES[] = {"Dune.epub", "War and Peace.TXT", "notes.docx", "cover.jpg",
+                                        "Manual.Mobi", "threads.json", "Tolstoy - Anna Karenina.fb2", "README"};
+    const int ROUNDS = server.hasArg("rounds") ? constrain(static_cast<int>(server.arg("rounds").toInt()), 1, 100000) : 2000;
+    const int COUNT = sizeof(NAMES) / sizeof(NAMES[0]);
+    std::vector<String> names(NAMES, NAMES + COUNT);
+
+    unsigned long legacyMatches = 0;
+    unsigned long start = micros();
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (const String& name : names) {
+            legacyMatches += legacyIsAllowedFile(name);
+        }
+    }
+    unsigned long legacyMicros = micros() - start;
+
+    unsigned long registryMatches = 0;
+    start = micros();
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (const String& name : names) {
+            registryMatches += fileTypeFor(name) != nullptr;
+        }
+    }
+    unsigned long registryMicros = micros() - start;
+
+    float calls = static_cast<float>(ROUNDS) * COUNT;
+    server.send(200, "text/plain",
+                "# calls legacy_ns registry_ns legacy_matches registry_matches\n" + String(static_cast<unsigned long>(calls)) +
+                " " + String(legacyMicros * 1000.0f / calls, 1) + " " + String(registryMicros * 1000.0f / calls, 1) +
+                " " + String(legacyMatches) + " " + String(registryMatches) + "\n");
+}
+
+// Lookup latency against directory size, flat vs bucketed. Blocks the server while it runs.
+void handleOpenBenchmark() {
+    if (!sdCardReady) {
+        server.send(503, "text/plain", "SD card not ready");
+        return;
+    }
+    // Thousands of creates with the server blocked; not while anyone is using the card
+    if (!activeDownloads.empty() || uploadsActive()) {
+        server.send(409, "text/plain", "Transfers in progress");
+        return;
+    }
+    const char* root = "/bench-open";
+    const int BENCH_MAX_FILES = 4000;
+    const int BENCH_LOOKUPS = 64;
+    String sizes = server.hasArg("sizes") ? server.arg("sizes") : "100,500,1000,2000";
+
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send(200, "text/plain", "");
+    server.sendContent("# files flat_open_us sharded_open_us flat_miss_us sharded_miss_us\n");
+
+    removeDirectory(root);
+    SD.mkdir(root);
+    SD.mkdir(String(root) + "/flat");
+    SD.mkdir(String(root) + "/shard");
+    for (uint8_t b = 0; b < LIBRARY_SHARD_BUCKETS; ++b) {
+        SD.mkdir(String(root) + "/shard/~" + String(b, HEX));
+    }
+
+    int created = 0;
+    int start = 0;
+    while (start < static_cast<int>(sizes.length())) {
+        int comma = sizes.indexOf(',', start);
+        if (comma < 0) {
+            comma = sizes.length();
+        }
+        int target = std::min(static_cast<int>(sizes.substring(start, comma).toInt()), BENCH_MAX_FILES);
+        start = comma + 1;
+        if (target <= created) {
+            continue;
+        }
+
+        // Grow both trees to the target size
+        for (; created < target; ++created) {
+            String name = "book" + String(created) + ".txt";
+            File flat = SD.open(String(root) + "/flat/" + name, FILE_WRITE);
+            if (flat) {
+                flat.close();
+            }
+            File sharded = SD.open(String(root) + "/shard/" + libraryShardBucket(name) + "/" + name, FILE_WRITE);
+            if (sharded) {
+                sharded.close();
+            }
+            if (created % 50 == 0) {
+                yield();
+            }
+        }
+
+        unsigned long timings[4] = {0, 0, 0, 0};
+        for (int i = 0; i < BENCH_LOOKUPS; ++i) {
+            String hit = "book" + String(random(created)) + ".txt";
+            String miss = "missing" + String(i) + ".txt";
+            String paths[4] = {
+                String(root) + "/flat/" + hit,
+                String(root) + "/shard/" + libraryShardBucket(hit) + "/" + hit,
+                String(root) + "/flat/" + miss,
+                String(root) + "/shard/" + libraryShardBucket(miss) + "/" + miss,
+            };
+            for (int k = 0; k < 4; ++k) {
+                unsigned long t0 = micros();
+                if (k < 2) {
+                    File file = SD.open(paths[k], FILE_READ);
+                    if (file) {
+                        file.close();
+                    }
+                } else {
+                    SD.exists(paths[k]);
+                }
+                timings[k] += micros() - t0;
+            }
+        }
+
+        char line[96];
+        snprintf(line, sizeof(line), "%d %lu %lu %lu %lu\n", created, timings[0] / BENCH_LOOKUPS,
+                 timings[1] / BENCH_LOOKUPS, timings[2] / BENCH_LOOKUPS, timings[3] / BENCH_LOOKUPS);
+        server.sendContent(line);
+        Serial.printf("[SHARD] bench %s", line);
+    }
+
+    removeDirectory(root);
+    finalizeChunkedResponse();
+}
+
+// Browser-driven matrix: the page fetches synthetic files under each setting and times them
+void handleBenchPage() {
+    static const char BENCH_PAGE[] PROGMEM = R"=====(<!DOCTYPE html>
+<html><head><meta name='viewport' content='width=device-width, initial-scale=1'><title>B3NCH</title>
+<style>
+body{font-family:'Courier New',monospace;background:#000;color:#0f0;margin:20px}
+input{background:#000;color:#0f0;border:1px solid #0f0;width:100%;margin:2px 0 8px}
+button{background:#000;color:#0f0;border:1px solid #0f0;padding:8px 20px;cursor:pointer}
+table{border-collapse:collapse;margin-top:15px;width:100%}td,th{border:1px solid #0a0;padding:3px 6px;text-align:right}
+#status{color:#0a0;margin-top:10px}
+</style></head><body>
+<h2>//D0WNL04D B3NCH//</h2>
+File sizes (bytes)<input id='sizes' value='4096,65536,1048576,16777216,67108864'>
+Buffer sizes (bytes)<input id='bufs' value='4096,8192,16384,32768'>
+Pipeline depth<input id='depth' value='2'>
+SPI clocks (Hz)<input id='clocks' value='4000000,10000000,20000000,40000000'>
+Concurrent clients<input id='clients' value='1,2,4'>
+<button id='go' onclick='run()'>RUN</button><div id='status'></div>
+<table><thead><tr><th>spi MHz</th><th>size</th><th>buf</th><th>depth</th><th>clients</th><th>MB/s</th><th>server MB/s</th><th>cpu0 %</th><th>cpu1 %</th><th>heap KB</th><th>psram KB</th></tr></thead><tbody id='rows'></tbody></table>
+<script>
+  const list=id=>document.getElementById(id).value.split(',').map(Number).filter(x=>x>0);
+  const setStatus=t=>document.getElementById('status').textContent=t;
+  const sleep=ms=>new Promise(r=>setTimeout(r,ms));
+  async function prepare(size){
+    for(;;){
+      const r=await fetch('/bench/prepare?size='+size,{method:'POST'});
+      if(r.status!==202)return r.ok;
+      setStatus('Preparing '+size+' byte file: '+await r.text());
+      await sleep(500);
+    }
+  }
+  async function drain(url){const r=await fetch(url);const rd=r.body.getReader();let n=0;for(;;){const c=await rd.read();if(c.done)break;n+=c.value.length;}return n;}
+  async function run(){
+    document.getElementById('go').disabled=true;
+    const depth=Number(document.getElementById('depth').value)||2;
+    try{
+      for(const hz of list('clocks')){
+        setStatus('Mounting SD at '+hz+' Hz');
+        if(!(await fetch('/bench/clock?hz='+hz,{method:'POST'})).ok){setStatus('Clock '+hz+' rejected');continue;}
+        for(const size of list('sizes')){
+          setStatus('Preparing '+size+' byte file');
+          if(!(await prepare(size))){setStatus('Could not prepare '+size+' byte file');continue;}
+          for(const buf of list('bufs'))for(const n of list('clients')){
+            setStatus(`Running ${size} B, ${buf} B buffers, ${n} client(s)`);
+            const runId=Math.floor(Math.random()*1e9),t0=performance.now();
+            const got=await Promise.all(Array.from({length:n},()=>drain(`/bench/file?size=${size}&buf=${buf}&depth=${depth}&run=${runId}`)));
+            const ms=performance.now()-t0,bytes=got.reduce((a,b)=>a+b,0);
+            let r;
+            while((r=await fetch('/bench/result?run='+runId)).status===202)await sleep(50);
+            const s=await r.json();
+            const tr=document.createElement('tr');
+            [hz/1e6,size,buf,depth,n,(bytes/1048.576/ms).toFixed(2),(s.bytes/1048.576/Math.max(1,s.server_ms)).toFixed(2),s.cpu0,s.cpu1,(s.heap/1024).toFixed(1),(s.psram/1024).toFixed(1)]
+              .forEach(v=>{const td=document.createElement('td');td.textContent=v;tr.appendChild(td);});
+            document.getElementById('rows').appendChild(tr);
+          }
+        }
+      }
+    }finally{
+      await fetch('/bench/clock?hz=0',{method:'POST'});
+      await fetch('/bench/cleanup',{method:'POST'});
+      setStatus('Done');
+      document.getElementById('go').disabled=false;
+    }
+  }
+</script></body></html>)=====";
+    server.send_P(200, "text/html", BENCH_PAGE);
+}
+
+void handleBenchClock() {
+    uint32_t hz = server.hasArg("hz") ? static_cast<uint32_t>(server.arg("hz").toInt()) : 0;
+    if (hz == 0) {
+        // End of a run: back to the boot clock and no more idle hooks
+        hz = SD_SPI_CLOCK_DEFAULT;
+        benchReleaseIdle();
+    }
+    if (hz < 400000 || hz > 80000000) {
+        server.send(400, "text/plain", "hz out of range");
+        return;
+    }
+    if (!activeDownloads.empty() || uploadsActive()) {
+        server.send(409, "text/plain", "Transfers in progress");
+        return;
+    }
+    if (!remountSdCard(hz)) {
+        server.send(500, "text/plain", "SD card did not mount at " + String(static_cast<unsigned long>(hz)) + " Hz");
+        return;
+    }
+    // A run starts with its first clock; the idle counters go in then and come off with hz=0
+    benchTouchedAt = millis();
+    if (server.arg("hz").toInt() != 0 && !benchIdleHooksInstalled) {
+        benchCalibrateIdle();
+    }
+    server.send(200, "text/plain", "SD clock " + String(static_cast<unsigned long>(sdSpiClockHz)) + " Hz");
+}
+
+String benchFilePath(size_t size) {
+    return String(BENCH_DOWNLOAD_DIR) + "/" + String(static_cast<unsigned long>(size)) + ".bin";
+}
+
+// Starts writing the file and answers 202 until loop() has finished it, then 200
+void handleBenchPrepare() {
+    size_t size = server.hasArg("size") ? static_cast<size_t>(server.arg("size").toInt()) : 0;
+    if (!sdCardReady || size == 0 || size > BENCH_MAX_FILE_SIZE) {
+        server.send(400, "text/plain", "size must be 1.." + String(static_cast<unsigned long>(BENCH_MAX_FILE_SIZE)));
+        return;
+    }
+    benchTouchedAt = millis();
+    String path = benchFilePath(size);
+    if (benchPrepare.active) {
+        if (benchPrepare.path != path) {
+            server.send(409, "text/plain", "Another file is being prepared");
+            return;
+        }
+        server.send(202, "text/plain", String(static_cast<unsigned long>(benchPrepare.written)) + "/" +
+                                           String(static_cast<unsigned long>(size)));
+        return;
+    }
+    if (benchPrepare.failed && benchPrepare.path == path) {
+        benchPrepare.failed = false;
+        server.send(500, "text/plain", "short write");
+        return;
+    }
+    File existing = SD.open(path, FILE_READ);
+    if (existing && existing.size() == size) {
+        existing.close();
+        server.send(200, "text/plain", "ready");
+        return;
+    }
+    if (existing) {
+        size_t staleSize = existing.size();
+        existing.close();
+        if (SD.remove(path)) {
+            noteStorageRemoved(path, staleSize);
+            noteClustersResized(staleSize, 0);
+        }
+    }
+
+    if (!SD.exists(BENCH_DOWNLOAD_DIR)) {
+        SD.mkdir(BENCH_DOWNLOAD_DIR);
+    }
+    File file = SD.open(path, FILE_WRITE);
+    if (!file) {
+        server.send(500, "text/plain", "Cannot create " + path);
+        return;
+    }
+    benchPrepare = BenchPrepareJob();
+    benchPrepare.active = true;
+    benchPrepare.path = path;
+    benchPrepare.size = size;
+    benchPrepare.file = file;
+    server.send(202, "text/plain", "0/" + String(static_cast<unsigned long>(size)));
+}
+
+// Deletes the bench files and ends the run's idle counting
+void handleBenchCleanup() {
+    if (benchDownloadsActive()) {
+        server.send(409, "text/plain", "Bench downloads in progress");
+        return;
+    }
+    if (benchPrepare.active) {
+        benchPrepareEnd();
+    }
+    benchPrepare.failed = false;
+    benchReleaseIdle();
+    if (sdCardReady) {
+        removeDirectory(BENCH_DOWNLOAD_DIR);
+    }
+    server.send(200, "text/plain", "removed");
+}
+
+void handleBenchFile() {
+    benchTouchedAt = millis();
+    size_t size = server.hasArg("size") ? static_cast<size_t>(server.arg("size").toInt()) : 0;
+    size_t bufferSize = server.hasArg("buf") ? static_cast<size_t>(server.arg("buf").toInt()) : downloadBufferSize;
+    int depth = server.hasArg("depth") ? server.arg("depth").toInt() : downloadPipelineDepth;
+    uint32_t run = static_cast<uint32_t>(server.arg("run").toInt());
+    if (bufferSize < 512 || bufferSize > 65536 || depth < 1 || depth > 8) {
+        server.send(400, "text/plain", "buf must be 512..65536 and depth 1..8");
+        return;
+    }
+    File file = SD.open(benchFilePath(size), FILE_READ);
+    if (!file) {
+        server.send(404, "text/plain", "Prepare the file first");
+        return;
+    }
+
+    if (benchRun.id != run) {
+        benchRun = BenchRun();
+        benchRun.id = run;
+    }
+
+    if (!downloadSlotAvailable()) {
+        file.close();
+        server.send(503, "text/plain", "All download slots are busy");
+        return;
+    }
+
+    size_t internalBefore = freeInternalHeap();
+    size_t psramBefore = freePsram();
+    size_t length = file.size();
+    ActiveDownload* download = prepareDownload(file, length, bufferSize, depth);
+    if (!download) {
+        server.send(503, "text/plain", "Out of memory for download buffers");
+        return;
+    }
+    server.setContentLength(length);
+    server.send(200, "application/octet-stream", "");
+    int weight = server.hasArg("weight") ? server.arg("weight").toInt() : DOWNLOAD_DEFAULT_WEIGHT;
+    activateDownload(download, constrain(weight, 1, 16));
+    download->benchRunId = run;
+    benchRun.heapUsedInternal = std::max(benchRun.heapUsedInternal,
+                                         internalBefore - std::min(internalBefore, freeInternalHeap()));
+    benchRun.heapUsedPsram = std::max(benchRun.heapUsedPsram,
+                                      psramBefore - std::min(psramBefore, freePsram()));
+}
+
+void handleBenchResult() {
+    benchTouchedAt = millis();
+    uint32_t run = static_cast<uint32_t>(server.arg("run").toInt());
+    if (run != benchRun.id) {
+        server.send(404, "application/json", "{}");
+        return;
+    }
+    // The last bytes can reach the browser a pass before the scheduler retires the transfer;
+    // until loop() has, the page is told to ask again
+    for (const ActiveDownload* download : activeDownloads) {
+        if (download->benchRunId == run) {
+            server.send(202, "application/json", "{}");
+            return;
+        }
+    }
+    int cpu[2] = {-1, -1};
+    for (int core = 0; core < 2; ++core) {
+        float expected = benchIdleRate[core] * benchRun.idleWindowMs;
+        if (expected > 0) {
+            cpu[core] = constrain(static_cast<int>(100.0f - 100.0f * benchRun.idleCount[core] / expected), 0, 100);
+        }
+    }
+    String json = "{\"transfers\":" + String(benchRun.transfers);
+    json += ",\"bytes\":" + String(static_cast<unsigned long long>(benchRun.bytes));
+    json += ",\"server_ms\":" + String(benchRun.serverMs);
+    json += ",\"cpu0\":" + String(cpu[0]) + ",\"cpu1\":" + String(cpu[1]);
+    json += ",\"heap\":" + String(static_cast<unsigned long>(benchRun.heapUsedInternal));
+    json += ",\"psram\":" + String(static_cast<unsigned long>(benchRun.heapUsedPsram));
+    json += ",\"spi_hz\":" + String(static_cast<unsigned long>(sdSpiClockHz)) + "}";
+    server.send(200, "application/json", json);
+}
+
+void handleUploadBenchPage() {
+    static const char UPLOAD_BENCH_PAGE[] PROGMEM = R"=====(<!DOCTYPE html>
+<html><head><meta name='viewport' content='width=device-width, initial-scale=1'><title>UPL04D B3NCH</title>
+<style>
+body{font-family:'Courier New',monospace;background:#000;color:#0f0;margin:20px}
+input{background:#000;color:#0f0;border:1px solid #0f0;width:100%;margin:2px 0 8px}
+button{background:#000;color:#0f0;border:1px solid #0f0;padding:8px 20px;cursor:pointer}
+table{border-collapse:collapse;margin-top:15px;width:100%}td,th{border:1px solid #0a0;padding:3px 6px;text-align:right}
+#status{color:#0a0;margin-top:10px}
+</style></head><body>
+<h2>//UPL04D B3NCH//</h2>
+Bytes per client<input id='size' value='1048576'>
+Concurrent clients<input id='clients' value='1,2,4'>
+Client link (KB/s, 0 = unpaced)<input id='rates' value='0,256,48'>
+Chunk per PATCH (bytes)<input id='chunk' value='65536'>
+Jitter (%)<input id='jitter' value='30'>
+Stall chance per chunk (%), stall length (ms)<input id='stall' value='5,4000'>
+Abort chance per chunk (%)<input id='abort' value='5'>
+Write-behind buffers (bytes, 0 = direct)<input id='bufs' value='16384,32768'>
+Writer slots<input id='writers' value='2'>
+Page timed during the run<input id='probe' value='/uploadpage'>
+<button id='go' onclick='run()'>RUN</button><div id='status'></div>
+<table><thead><tr><th>clients</th><th>KB/s</th><th>buf</th><th>writers</th><th>MB/s</th><th>server MB/s</th><th>chunks ok</th><th>refused</th><th>aborts</th><th>stalls</th><th>loop max ms</th><th>blocked ms</th><th>heap KB</th><th>psram KB</th><th>page p50/p95 idle</th><th>page p50/p95 load</th></tr></thead><tbody id='rows'></tbody></table>
+<script>
+  const list=id=>document.getElementById(id).value.split(',').map(Number).filter(x=>x>=0&&!isNaN(x));
+  const setStatus=t=>document.getElementById('status').textContent=t;
+  const sleep=ms=>new Promise(r=>setTimeout(r,ms));
+  const pct=(a,p)=>{const s=[...a].sort((x,y)=>x-y);return s.length?Math.round(s[Math.min(s.length-1,Math.floor(p*s.length))]):0;};
+  async function timePage(url,samples,more){
+    do{
+      const t=performance.now();
+      try{await(await fetch(url,{cache:'no-store'})).arrayBuffer();}catch(e){}
+      samples.push(performance.now()-t);
+      await sleep(250);
+    }while(more());
+  }
+  async function session(id){
+    for(let i=0;;i++){
+      try{const r=await fetch('/upload/session?id='+id);if(r.status===404)throw new Error('session gone');return await r.json();}
+      catch(e){if(i>20||e.message==='session gone')throw e;await sleep(500);}
+    }
+  }
+  // One simulated phone: paced PATCHes with jitter, the odd stall, and aborted bodies it resumes from
+  async function client(run,i,cfg,stats){
+    const body=new Uint8Array(cfg.size);
+    for(let o=0;o<body.length;o+=65536)crypto.getRandomValues(body.subarray(o,Math.min(o+65536,body.length)));
+    const r=await fetch(`/upload/session?name=bench-${run}-${i}.lib&size=${cfg.size}`,{method:'POST'});
+    if(!r.ok)throw new Error('session '+r.status);
+    let s=await r.json();
+    try{
+      while(s.offset<cfg.size){
+        if(s.queue>0){await sleep(500);s=await session(s.id);continue;}
+        if(Math.random()<cfg.stall){stats.stalls++;await sleep(cfg.stallMs);}
+        const end=Math.min(s.offset+cfg.chunk,cfg.size),linkMs=cfg.rate>0?(end-s.offset)/cfg.rate:50;
+        const ctl=new AbortController(),t=performance.now();
+        let timer=null;
+        if(Math.random()<cfg.abort)timer=setTimeout(()=>ctl.abort(),Math.random()*linkMs);
+        try{
+          const c=await fetch(`/upload/chunk?id=${s.id}&offset=${s.offset}`,{method:'PATCH',headers:{'Content-Type':'application/octet-stream'},body:body.subarray(s.offset,end),signal:ctl.signal});
+          if(c.status===200)stats.ok++;else stats.refused++;
+          s=c.status===404?await session(s.id):await c.json();
+        }catch(e){
+          if(e.message==='session gone')throw e;
+          if(e.name==='AbortError')stats.aborts++;
+          s=await session(s.id);
+        }
+        clearTimeout(timer);
+        // The chunk crossed Wi-Fi at full speed; wait out the rest of its time on the emulated link
+        if(cfg.rate>0){const left=linkMs*(1+cfg.jitter*(2*Math.random()-1))-(performance.now()-t);if(left>0)await sleep(left);}
+      }
+    }finally{
+      await fetch('/upload/session?id='+s.id,{method:'DELETE'});
+    }
+  }
+  async function run(){
+    document.getElementById('go').disabled=true;
+    const num=id=>Number(document.getElementById(id).value)||0,stall=list('stall');
+    const before=await(await fetch('/scheduler',{method:'POST'})).text();
+    const setting=k=>(before.match(new RegExp(k+' (\\d+)'))||[])[1];
+    const probe=document.getElementById('probe').value;
+    try{
+      for(const buf of list('bufs'))for(const w of list('writers').filter(x=>x>0))for(const n of list('clients').filter(x=>x>0&&x<=8))for(const kbps of list('rates')){
+        // Real uploads keep their sessions and settings: no run while one is open
+        const queue=await(await fetch('/upload/queue')).text();
+        if(queue.split('\n').some(l=>l&&!/\tbench-[^\t]*$/.test(l))){setStatus('Stopped: uploads in progress');return;}
+        await fetch(`/scheduler?upbuf=${buf}&writers=${w}`,{method:'POST'});
+        setStatus(`Timing ${probe} idle`);
+        const idle=[],load=[];
+        let left=8;
+        await timePage(probe,idle,()=>--left>0);
+        setStatus(`Running ${n} client(s) at ${kbps||'full'} KB/s, ${buf} B buffers, ${w} writer(s)`);
+        const runId=Math.floor(Math.random()*1e9),stats={ok:0,refused:0,aborts:0,stalls:0};
+        const cfg={size:num('size'),chunk:num('chunk')||65536,rate:kbps*1.024,jitter:num('jitter')/100,
+                   stall:(stall[0]||0)/100,stallMs:stall[1]||0,abort:num('abort')/100};
+        if(!(await fetch('/bench/upload/start?run='+runId,{method:'POST'})).ok){setStatus('Stopped: uploads in progress');return;}
+        let running=true;
+        const t0=performance.now(),timing=timePage(probe,load,()=>running);
+        const results=await Promise.allSettled(Array.from({length:n},(_,i)=>client(runId,i,cfg,stats)));
+        const ms=performance.now()-t0;
+        running=false;
+        await timing;
+        const s=await(await fetch('/bench/upload/result?run='+runId)).json();
+        const done=results.filter(x=>x.status==='fulfilled').length;
+        const tr=document.createElement('tr');
+        [n,kbps||'-',buf,w,(done*cfg.size/1048.576/ms).toFixed(2),(s.bytes/1048.576/Math.max(1,s.server_ms)).toFixed(2),stats.ok,stats.refused,stats.aborts,stats.stalls,
+         s.loop_max_ms,s.blocked_ms,(s.heap/1024).toFixed(1),(s.psram/1024).toFixed(1),pct(idle,.5)+'/'+pct(idle,.95),pct(load,.5)+'/'+pct(load,.95)]
+          .forEach(v=>{const td=document.createElement('td');td.textContent=v;tr.appendChild(td);});
+        if(done<n)tr.title=(n-done)+' client(s) failed';
+        document.getElementById('rows').appendChild(tr);
+      }
+    }finally{
+      await fetch(`/scheduler?upbuf=${setting('upbuf')}&writers=${setting('writers')}`,{method:'POST'});
+      setStatus('Done');
+      document.getElementById('go').disabled=false;
+    }
+  }
+</script></body></html>)=====";
+    server.send_P(200, "text/html", UPLOAD_BENCH_PAGE);
+}
+
+void handleUploadBenchStart() {
+    // The run takes over the session table and the upload settings; not while anyone else uploads
+    bool othersUploading = uploadInProgress();
+    for (const auto& entry : uploadSessions) {
+        othersUploading = othersUploading || !entry.second.name.startsWith("bench-");
+    }
+    if (othersUploading) {
+        server.send(409, "text/plain", "Uploads in progress");
+        return;
+    }
+    uploadBench = UploadBenchRun();
+    uploadBench.id = static_cast<uint32_t>(server.arg("run").toInt());
+    uploadBench.active = true;
+    uploadBench.startedAt = millis();
+    uploadBench.bytesAtStart = uploadBytesTotal;
+    uploadBench.acceptedAtStart = uploadChunksAccepted;
+    uploadBench.rejectedAtStart = uploadChunksRejected;
+    uploadBench.heapAtStart = uploadBench.heapLow = freeInternalHeap();
+    uploadBench.psramAtStart = uploadBench.psramLow = freePsram();
+    server.send(200, "text/plain", "started");
+}
+
+void handleUploadBenchResult() {
+    if (!uploadBench.active || static_cast<uint32_t>(server.arg("run").toInt()) != uploadBench.id) {
+        server.send(404, "application/json", "{}");
+        return;
+    }
+    uploadBench.active = false;
+    unsigned long elapsed = millis() - uploadBench.startedAt;
+    uint64_t bytes = uploadBytesTotal - uploadBench.bytesAtStart;
+    Serial.printf("[BENCH] Upload run %lu: %llu bytes in %lu ms, loop max gap %lu ms, %llu ms blocked\n",
+                  static_cast<unsigned long>(uploadBench.id), static_cast<unsigned long long>(bytes), elapsed,
+                  static_cast<unsigned long>(uploadBench.maxGapUs / 1000),
+                  static_cast<unsigned long long>(uploadBench.blockedUs / 1000));
+    String json = "{\"bytes\":" + String(static_cast<unsigned long long>(bytes));
+    json += ",\"server_ms\":" + String(elapsed);
+    json += ",\"chunks_ok\":" + String(uploadChunksAccepted - uploadBench.acceptedAtStart);
+    json += ",\"chunks_refused\":" + String(uploadChunksRejected - uploadBench.rejectedAtStart);
+    json += ",\"loop_passes\":" + String(static_cast<unsigned long>(uploadBench.passes));
+    json += ",\"loop_max_ms\":" + String(static_cast<unsigned long>(uploadBench.maxGapUs / 1000));
+    json += ",\"blocked_ms\":" + String(static_cast<unsigned long long>(uploadBench.blockedUs / 1000));
+    json += ",\"heap\":" + String(static_cast<unsigned long>(uploadBench.heapAtStart - std::min(uploadBench.heapAtStart, uploadBench.heapLow)));
+    json += ",\"psram\":" + String(static_cast<unsigned long>(uploadBench.psramAtStart - std::min(uploadBench.psramAtStart, uploadBench.psramLow)));
+    json += ",\"upbuf\":" + String(static_cast<unsigned long>(uploadBufferSize));
+    json += ",\"writers\":" + String(uploadWriterSlots) + "}";
+    server.send(200, "application/json", json);
+}
+
+void handleScheduler() {
+    // Runtime tuning: cap (bytes/s, 0 = uncapped), slots, hot (PSRAM cache bytes, 0 = off),
+    // upbuf (upload write-behind bytes, 0 = direct writes), verify (upload read-back, 0 = off)
+    // and writers (upload sessions admitted at once)
+    if (server.hasArg("cap")) {
+        long cap = server.arg("cap").toInt();
+        downloadRateCap = cap == 0 ? 0 : constrain(cap, static_cast<long>(DOWNLOAD_RATE_CAP_MIN),
+                                                   static_cast<long>(DOWNLOAD_RATE_CAP_MAX));
+    }
+    if (server.hasArg("slots")) {
+        downloadSlots = constrain(static_cast<int>(server.arg("slots").toInt()), 1, static_cast<int>(DOWNLOAD_SLOTS_MAX));
+    }
+    if (server.hasArg("upbuf")) {
+        // 0 = write every HTTP chunk straight through, as uploads did before write-behind
+        // Flushes land on whole clusters when the count knows their size, else whole sectors
+        size_t upbuf = constrain(static_cast<int>(server.arg("upbuf").toInt()), 0, 65536);
+        size_t unit = freeSpace.clusterBytes > 0 && freeSpace.clusterBytes <= upbuf ? freeSpace.clusterBytes : 512;
+        uploadBufferSize = upbuf - upbuf % unit;
+    }
+    if (server.hasArg("writers")) {
+        uploadWriterSlots = constrain(static_cast<int>(server.arg("writers").toInt()), 1, static_cast<int>(UPLOAD_SESSION_MAX));
+    }
+    if (server.hasArg("verify")) {
+        uploadReadBack = server.arg("verify").toInt() != 0;
+    }
+    if (server.hasArg("hot") && (freePsram() > 0 || server.arg("hot").toInt() == 0)) {
+        // Shrinking takes effect as entries are evicted or invalidated
+        hotCacheCapacity = static_cast<size_t>(server.arg("hot").toInt());
+        if (hotCacheCapacity == 0) {
+            hotCacheInvalidate("/");
+        }
+    }
+    server.send(200, "text/plain", "cap " + String(static_cast<unsigned long>(downloadRateCap)) +
+                                   " slots " + String(downloadSlots) +
+                                   " hot " + String(static_cast<unsigned long>(hotCacheCapacity)) +
+                                   " upbuf " + String(static_cast<unsigned long>(uploadBufferSize)) +
+                                   " verify " + String(uploadReadBack ? 1 : 0) +
+                                   " writers " + String(uploadWriterSlots) + "\n");
+}